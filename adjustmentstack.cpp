@@ -0,0 +1,382 @@
+#include <QCoreApplication>
+#include <QDesktopServices>
+#include <QDir>
+#include <QFile>
+
+#include "adjustmentstack.h"
+#include "filters.h"
+#include "resultcache.h"
+#include "filters/memorymeter.h"
+
+static const qint64 memoryBudget = Q_INT64_C(256)*1024*1024;
+
+static qint64 area(const QRect &rect)
+{
+  return qint64(rect.width())*rect.height();
+}
+
+AdjustmentStack::AdjustmentStack()
+  : m_base(-1), m_memoryUsed(0), m_nextId(0)
+{
+  m_dir = QDir(QDesktopServices::storageLocation(QDesktopServices::CacheLocation))
+            .filePath(QString("layers-%1").arg(QCoreApplication::applicationPid()));
+  QDir().mkpath(m_dir);
+}
+
+AdjustmentStack::~AdjustmentStack()
+{
+  reset(QImage());
+  QDir().rmdir(m_dir);
+
+  foreach (IFilter *filter, m_filters)
+  {
+    delete filter->settingsWidget();
+    delete dynamic_cast<QObject *>(filter);
+  }
+}
+
+void AdjustmentStack::reset(const QImage &base)
+{
+  m_layers.clear();
+  m_memory.clear();
+  m_memoryLru.clear();
+  m_memoryUsed = 0;
+  foreach (int id, m_disk)
+    QFile::remove(tilePath(id));
+  m_disk.clear();
+
+  m_size = base.size();
+  m_base = base.isNull() ? -1 : storeTile(base);
+}
+
+void AdjustmentStack::append(IFilter *filter, const SpanMask &mask, const QRect &dirty,
+                             const QImage &result)
+{
+  Layer layer;
+  layer.filterName = filter->filterName();
+  layer.parameters = filter->parameters();
+  layer.mask = mask;
+  layer.linear = filter->linearLight();
+  layer.dirty = dirty;
+  layer.sizeBefore = m_size;
+  layer.after = -1;
+  setCheckpoint(layer, result);
+  m_layers.append(layer);
+  m_size = result.size();
+}
+
+void AdjustmentStack::appendPending(IFilter *filter, const SpanMask &mask)
+{
+  Layer layer;
+  layer.filterName = filter->filterName();
+  layer.parameters = filter->parameters();
+  layer.mask = mask;
+  layer.linear = filter->linearLight();
+  layer.sizeBefore = layer.sizeAfter = m_size;
+  layer.after = -1;
+  m_layers.append(layer);
+}
+
+QImage AdjustmentStack::edit(int index, const QByteArray &params, const QImage &top,
+                             QRect *changed, int *rendered)
+{
+  materialize();
+
+  // Inside a run of resamplings, the run is re-rendered from its start
+  m_layers[index].parameters = params;
+  int first = runStart(index);
+  QImage image = stateBefore(first, top);
+  // Where image may differ from what the layers rendered before
+  QRect region;
+  *rendered = 0;
+
+  for (int i=first; i<m_layers.size(); i++)
+  {
+    Layer &layer = m_layers[i];
+    bool sameSize = image.size() == layer.sizeBefore;
+    if (i > index && sameSize)
+    {
+      // Unchanged input gives the recorded output
+      IFilter *filter = instance(layer);
+      QRect input = filter->inputRect(image, layer.mask.boundingRect()) & image.rect();
+      if (!input.intersects(region))
+      {
+        restore(image, layer.after, afterRect(layer), layer.sizeAfter);
+        continue;
+      }
+      if (filter->isLocal())
+      {
+        renderAround(layer, image, region);
+        ++*rendered;
+        continue;
+      }
+    }
+
+    QSize oldSize = layer.sizeAfter;
+    if (sameSize)
+      region |= layer.dirty;
+    render(layer, image);
+    region |= layer.dirty;
+    // A resizing layer moves every pixel, even at the same new size
+    if (image.size() != oldSize || layer.sizeAfter != layer.sizeBefore)
+      region = image.rect();
+    ++*rendered;
+  }
+  m_run.clear();
+
+  m_size = image.size();
+  *changed = region & image.rect();
+  return image;
+}
+
+IFilter *AdjustmentStack::instance(const Layer &layer)
+{
+  IFilter *filter = m_filters.value(layer.filterName);
+  if (!filter)
+  {
+    filter = createFilter(layer.filterName, 0);
+    m_filters.insert(layer.filterName, filter);
+  }
+  filter->setParameters(layer.parameters);
+  filter->setLinearLight(layer.linear);
+  return filter;
+}
+
+// True if layer is a resampling, see IFilter::resampling()
+bool AdjustmentStack::resampling(const Layer &layer, Transform &t)
+{
+  return layer.mask.isRect() && instance(layer)->resampling(layer.mask.boundingRect(), t);
+}
+
+// First layer of the run of resamplings of the same rect and blending
+// mode that layer index is in, or index
+int AdjustmentStack::runStart(int index)
+{
+  Transform t = Transform::scale(1, 1);
+  const Layer &layer = m_layers[index];
+  if (!resampling(layer, t))
+    return index;
+
+  int first = index;
+  while (first > 0 && m_layers[first-1].linear == layer.linear
+           && m_layers[first-1].mask.boundingRect() == layer.mask.boundingRect()
+           && resampling(m_layers[first-1], t))
+    first--;
+  return first;
+}
+
+// Run the whole layer over image. Resamplings rendered in a row are
+// resampled once, as when they were applied.
+void AdjustmentStack::render(Layer &layer, QImage &image)
+{
+  IFilter *filter = instance(layer);
+  filter->prepareFormat(image);
+  layer.sizeBefore = image.size();
+  layer.dirty = filter->dirtyRect(image, layer.mask.boundingRect());
+  Transform t = Transform::scale(1, 1);
+  if (layer.mask.isRect() && filter->resampling(layer.mask.boundingRect(), t))
+    image = m_run.apply(image, layer.mask.boundingRect(), t, Bilinear, layer.linear);
+  else
+  {
+    m_run.clear();
+    filter->applyMasked(image, layer.mask);
+  }
+  setCheckpoint(layer, image);
+}
+
+// Run a local layer only where its input overlaps changed, taking the
+// rest of its output from the checkpoint. changed grows by the pixels
+// rendered.
+void AdjustmentStack::renderAround(Layer &layer, QImage &image, QRect &changed)
+{
+  IFilter *filter = instance(layer);
+  filter->prepareFormat(image);
+  QSize halo = filter->halo();
+  SpanMask part = layer.mask.intersected(changed.adjusted(-halo.width(), -halo.height(),
+                                                          halo.width(), halo.height()));
+
+  // The filter reads its input, so the old output goes in after it
+  QImage after = loadTile(layer.after);
+  if (isGray(image) && !isGray(after))
+    image = image.convertToFormat(QImage::Format_RGB32);
+  filter->applyMasked(image, part);
+  copySpans(image, after, layer.mask.intersected(layer.dirty).subtracted(part),
+            layer.dirty.topLeft());
+  setCheckpoint(layer, image);
+  changed |= part.boundingRect();
+}
+
+void AdjustmentStack::setCheckpoint(Layer &layer, const QImage &result)
+{
+  dropTile(layer.after);
+  layer.sizeAfter = result.size();
+  QImage after = result.copy(afterRect(layer));
+  MemoryMeter::instance().allocated("checkpoints", after.byteCount());
+  layer.after = storeTile(after);
+}
+
+// Region of the after checkpoint: the whole image if the layer resized it
+QRect AdjustmentStack::afterRect(const Layer &layer) const
+{
+  if (layer.sizeAfter != layer.sizeBefore)
+    return QRect(QPoint(0, 0), layer.sizeAfter);
+  return layer.dirty;
+}
+
+void AdjustmentStack::restore(QImage &image, int id, const QRect &rect, const QSize &size,
+                              const QRect &clip)
+{
+  QRect part = clip.isNull() ? rect : rect & clip;
+  if (image.size() == size && part.isEmpty())
+    return;
+
+  QImage tile = loadTile(id);
+  if (image.size() != size)
+    image = tile;
+  else
+  {
+    // Tiles rendered after the image left the gray format are 32-bit
+    if (isGray(image) && !isGray(tile))
+      image = image.convertToFormat(QImage::Format_RGB32);
+    copySpans(image, tile, part, rect.topLeft());
+  }
+}
+
+// Write rect of the image under layer index into image: the state
+// after layer start, or the base for -1, which must be whole, then the
+// after checkpoints of the layers between
+void AdjustmentStack::redo(QImage &image, int start, int index, const QRect &rect)
+{
+  if (start < 0)
+    restore(image, m_base, QRect(QPoint(0, 0), m_layers[0].sizeBefore),
+            m_layers[0].sizeBefore, rect);
+  else
+    restore(image, m_layers[start].after, afterRect(m_layers[start]),
+            m_layers[start].sizeAfter, rect);
+  for (int i=start+1; i<index; i++)
+    restore(image, m_layers[i].after, afterRect(m_layers[i]), m_layers[i].sizeAfter, rect);
+}
+
+// Pixels redo() copies
+qint64 AdjustmentStack::redoCost(int start, int index, const QRect &rect) const
+{
+  qint64 res = area(rect);
+  for (int i=start+1; i<index; i++)
+    res += area(afterRect(m_layers[i]) & rect);
+  return res;
+}
+
+// Image under layer index. Either top with the regions of the layers
+// from index on redone from below, or the whole image redone, whichever
+// copies fewer pixels. Redoing starts at the last layer below index that
+// resized the image, whose checkpoint is whole, or at the base.
+QImage AdjustmentStack::stateBefore(int index, const QImage &top)
+{
+  int start = index-1;
+  while (start >= 0 && m_layers[start].sizeAfter == m_layers[start].sizeBefore)
+    start--;
+
+  QRect whole(QPoint(0, 0), m_layers[index].sizeBefore);
+  qint64 fromTop = 0, fromBase = redoCost(start, index, whole);
+  bool resized = false;
+  for (int i=index; i<m_layers.size(); i++)
+  {
+    resized |= m_layers[i].sizeAfter != m_layers[i].sizeBefore;
+    fromTop += redoCost(start, index, m_layers[i].dirty);
+  }
+
+  QImage image;
+  if (!resized && fromTop <= fromBase)
+  {
+    image = top;
+    for (int i=index; i<m_layers.size(); i++)
+      redo(image, start, index, m_layers[i].dirty);
+  }
+  else
+    redo(image, start, index, whole);
+  return image;
+}
+
+// Make the checkpoints of pending layers, replaying up to each of them
+void AdjustmentStack::materialize()
+{
+  int first = 0;
+  while (first < m_layers.size() && m_layers[first].after >= 0)
+    first++;
+  if (first == m_layers.size())
+    return;
+
+  QImage image = loadTile(m_base);
+  for (int i=0; i<m_layers.size(); i++)
+  {
+    Layer &layer = m_layers[i];
+    if (i < first || layer.after >= 0)
+      restore(image, layer.after, afterRect(layer), layer.sizeAfter);
+    else
+      render(layer, image);
+  }
+  m_run.clear();
+}
+
+int AdjustmentStack::storeTile(const QImage &tile)
+{
+  int id = m_nextId++;
+  m_memory.insert(id, tile);
+  m_memoryLru.append(id);
+  m_memoryUsed += tile.byteCount();
+  trimMemory();
+  return id;
+}
+
+QImage AdjustmentStack::loadTile(int id)
+{
+  if (m_memory.contains(id))
+  {
+    m_memoryLru.removeOne(id);
+    m_memoryLru.append(id);
+    return m_memory.value(id);
+  }
+
+  // Promote back to memory
+  QImage tile = readRawImage(tilePath(id));
+  QFile::remove(tilePath(id));
+  m_disk.remove(id);
+  m_memory.insert(id, tile);
+  m_memoryLru.append(id);
+  m_memoryUsed += tile.byteCount();
+  trimMemory();
+  return tile;
+}
+
+void AdjustmentStack::dropTile(int id)
+{
+  if (m_memory.contains(id))
+  {
+    m_memoryUsed -= m_memory.take(id).byteCount();
+    m_memoryLru.removeOne(id);
+  }
+  else if (m_disk.remove(id))
+    QFile::remove(tilePath(id));
+}
+
+void AdjustmentStack::trimMemory()
+{
+  // The most recent tile stays: it is about to be used
+  while (m_memoryUsed > memoryBudget && m_memoryLru.size() > 1)
+  {
+    int id = m_memoryLru.first();
+    const QImage &tile = m_memory[id];
+    // Checkpoints can't be dropped: keep them in memory if the disk fails
+    if (!writeRawImage(tilePath(id), tile))
+      break;
+    m_memoryUsed -= tile.byteCount();
+    m_memory.remove(id);
+    m_memoryLru.removeFirst();
+    m_disk.insert(id);
+  }
+}
+
+QString AdjustmentStack::tilePath(int id) const
+{
+  return QDir(m_dir).filePath(QString("%1.tile").arg(id));
+}
@@ -0,0 +1,110 @@
+#ifndef ADJUSTMENTSTACK_H
+#define ADJUSTMENTSTACK_H
+
+#include <QImage>
+#include <QHash>
+#include <QList>
+#include <QSet>
+#include <QString>
+#include "filters/spanmask.h"
+#include "filters/transform.h"
+
+class IFilter;
+
+/** The filters applied since loading, kept as editable layers.
+ * Each layer records the filter, its settings and selection, and a
+ * checkpoint of the region it wrote: its pixels after the layer. What
+ * was there before is the state the layers below leave, so editing a
+ * layer rebuilds the image under it from the base and the checkpoints
+ * below, either whole or only where the layers above wrote, whichever
+ * copies less. It then re-renders the layer and walks the
+ * layers above: a layer whose input misses the changed region replays
+ * its checkpoint, a local one is re-rendered only around that region,
+ * and anything else is re-rendered whole. Runs of resampling layers are
+ * resampled at once, as they were when applied, and an edit inside a run
+ * re-renders the run from its start.
+ * Checkpoints live in memory up to a budget; least recently used ones
+ * then spill to a disk directory that lives as long as the stack.
+ */
+class AdjustmentStack
+{
+public:
+  struct Layer
+  {
+      QString filterName;
+      QByteArray parameters;
+      SpanMask mask;
+      bool linear;        // the filter's blending mode
+      // Region written, in the image the layer was applied to
+      QRect dirty;
+      QSize sizeBefore;
+      QSize sizeAfter;
+      // Checkpoint id, -1 while the layer is pending
+      int after;
+  };
+
+  AdjustmentStack();
+  ~AdjustmentStack();
+
+  // Start over from base, dropping all layers
+  void reset(const QImage &base);
+
+  int count() const { return m_layers.size(); }
+  const Layer &layer(int index) const { return m_layers[index]; }
+
+  // Record filter applied over mask, writing dirty; result is the whole
+  // image after it
+  void append(IFilter *filter, const SpanMask &mask, const QRect &dirty,
+              const QImage &result);
+  // Record filter without its result, as in lazy rendering. Its
+  // checkpoints are made the next time a layer is edited.
+  void appendPending(IFilter *filter, const SpanMask &mask);
+
+  // Change the settings of layer index of top, the current result, and
+  // return the new result. changed receives the region that may differ
+  // from top, rendered the number of layers whose filter had to run.
+  QImage edit(int index, const QByteArray &params, const QImage &top,
+              QRect *changed, int *rendered);
+
+  qint64 memoryUsed() const { return m_memoryUsed; }
+  int spilledCount() const { return m_disk.size(); }
+
+private:
+  IFilter *instance(const Layer &layer);
+  bool resampling(const Layer &layer, Transform &t);
+  int runStart(int index);
+  void render(Layer &layer, QImage &image);
+  void renderAround(Layer &layer, QImage &image, QRect &changed);
+  void setCheckpoint(Layer &layer, const QImage &result);
+  QRect afterRect(const Layer &layer) const;
+  // Checkpoint id of rect in an image of size into image, within clip
+  void restore(QImage &image, int id, const QRect &rect, const QSize &size,
+               const QRect &clip = QRect());
+  void redo(QImage &image, int start, int index, const QRect &rect);
+  qint64 redoCost(int start, int index, const QRect &rect) const;
+  QImage stateBefore(int index, const QImage &top);
+  void materialize();
+
+  int storeTile(const QImage &tile);
+  QImage loadTile(int id);
+  void dropTile(int id);
+  void trimMemory();
+  QString tilePath(int id) const;
+
+  QList<Layer> m_layers;
+  int m_base;
+  QSize m_size;
+  // Private filter instances by name, set to each layer's settings in turn
+  QHash<QString, IFilter *> m_filters;
+  // Run of resamplings being rendered
+  TransformChain m_run;
+
+  QHash<int, QImage> m_memory;
+  QList<int> m_memoryLru;     // least recently used first
+  qint64 m_memoryUsed;
+  QSet<int> m_disk;
+  int m_nextId;
+  QString m_dir;
+};
+
+#endif // ADJUSTMENTSTACK_H
@@ -0,0 +1,262 @@
+#include <cstdlib>
+#include <QFile>
+#include <QSettings>
+#include <QThread>
+#include <QElapsedTimer>
+#include <QTextStream>
+
+#include "autotuner.h"
+#include "filters/convolution.h"
+
+static const char *const profileGroup = "Tuning";
+static const char *const overrideGroup = "TuningOverride";
+// Benchmark image side and batches per candidate, of which the best
+// counts. A batch repeats the kernel until it takes 20 ms, on at most
+// 32 copies of the image.
+static const int benchSize = 512;
+static const int benchRuns = 3;
+static const qint64 benchMinTime = 20*1000000;
+static const int benchMaxBatch = 32;
+
+static QImage benchImage()
+{
+  // Noise: no kernel gets an easy input
+  srand(1);
+  QImage img(benchSize, benchSize, QImage::Format_RGB32);
+  for (int y=0; y<img.height(); y++)
+  {
+    QRgb *line = reinterpret_cast<QRgb *>(img.scanLine(y));
+    for (int x=0; x<img.width(); x++)
+      line[x] = qRgb(rand() % 256, rand() % 256, rand() % 256);
+  }
+  return img;
+}
+
+// Qt before 4.8 only counts milliseconds
+static qint64 nsecsElapsed(const QElapsedTimer &t)
+{
+#if QT_VERSION >= 0x040800
+  return t.nsecsElapsed();
+#else
+  return t.elapsed()*1000000;
+#endif
+}
+
+struct MedianRun
+{
+    int size;
+    void operator()(QImage &img) const { median(img, img.rect(), size); }
+};
+
+struct ConvolveRun
+{
+    const KernelInfo *info;
+    void operator()(QImage &img) const { convolve(img, img.rect(), *info); }
+};
+
+// Nanoseconds per run of kernel on a copy of src. Runs are batched until
+// a batch takes benchMinTime; the best of benchRuns batches counts. The
+// copies are made before the clock starts.
+template<typename Kernel>
+static qint64 timeKernel(const QImage &src, const Kernel &kernel)
+{
+  int count = 1;
+  qint64 best = -1;
+  for (int i=0; i<benchRuns; )
+  {
+    QVector<QImage> images(count);
+    for (int j=0; j<count; j++)
+      images[j] = src.copy();
+    QElapsedTimer t;
+    t.start();
+    for (int j=0; j<count; j++)
+      kernel(images[j]);
+    qint64 time = nsecsElapsed(t);
+    if (time < benchMinTime && count < benchMaxBatch)
+    {
+      count *= 2;
+      continue;
+    }
+    best = best < 0 ? time/count : qMin(best, time/count);
+    i++;
+  }
+  return best;
+}
+
+static qint64 timeMedian(const QImage &src, int size)
+{
+  MedianRun run = { size };
+  return timeKernel(src, run);
+}
+
+static qint64 timeConvolve(const QImage &src, const KernelInfo &info)
+{
+  ConvolveRun run = { &info };
+  return timeKernel(src, run);
+}
+
+// Gaussian of size 2*hsize+1, evaluated through path
+static KernelInfo benchKernel(int hsize, KernelInfo::Path path)
+{
+  Matrix<double> m = gaussian(hsize, hsize/2.0 + 0.5);
+  KernelInfo info = analyzeKernel(m);
+  if (path == KernelInfo::Separable && info.path != KernelInfo::Separable)
+  {
+    // Let the analysis factor it whatever the current crossover
+    Tuning t = tuning(), any = t;
+    any.separableMinSize = 1;
+    setTuning(any);
+    info = analyzeKernel(m);
+    setTuning(t);
+  }
+  else if (path == KernelInfo::Dense)
+    info.path = KernelInfo::Dense;
+  return info;
+}
+
+AutoTuner::AutoTuner()
+  : m_measured(false), m_measureTime(0)
+{
+}
+
+QString AutoTuner::machineId()
+{
+  QString cpu;
+  QFile f("/proc/cpuinfo");
+  if (f.open(QIODevice::ReadOnly | QIODevice::Text))
+  {
+    QTextStream in(&f);
+    for (QString line=in.readLine(); !line.isNull(); line=in.readLine())
+      if (line.startsWith("model name"))
+      {
+        cpu = line.section(':', 1).trimmed();
+        break;
+      }
+  }
+  if (cpu.isEmpty())
+    cpu = QString::fromLocal8Bit(qgetenv("PROCESSOR_IDENTIFIER"));
+  return QString("%1, %2 threads").arg(cpu).arg(QThread::idealThreadCount());
+}
+
+Tuning AutoTuner::run(bool retune)
+{
+  QSettings settings("mgraph01", "mgraph01-editor");
+  QString machine = machineId();
+
+  settings.beginGroup(profileGroup);
+  if (retune || settings.value("machine").toString() != machine)
+  {
+    m_tuning = measure();
+    settings.setValue("machine", machine);
+    settings.setValue("threads", m_tuning.threads);
+    settings.setValue("bandRows", m_tuning.bandRows);
+    settings.setValue("separableMinSize", m_tuning.separableMinSize);
+  }
+  else
+  {
+    m_tuning.threads = settings.value("threads", m_tuning.threads).toInt();
+    m_tuning.bandRows = settings.value("bandRows", m_tuning.bandRows).toInt();
+    m_tuning.separableMinSize =
+        settings.value("separableMinSize", m_tuning.separableMinSize).toInt();
+  }
+  settings.endGroup();
+
+  settings.beginGroup(overrideGroup);
+  m_overridden = settings.childKeys();
+  if (settings.contains("threads"))
+    m_tuning.threads = settings.value("threads").toInt();
+  if (settings.contains("bandRows"))
+    m_tuning.bandRows = settings.value("bandRows").toInt();
+  if (settings.contains("separableMinSize"))
+    m_tuning.separableMinSize = settings.value("separableMinSize").toInt();
+  settings.endGroup();
+
+  setTuning(m_tuning);
+  m_tuning = tuning();
+  return m_tuning;
+}
+
+Tuning AutoTuner::measure()
+{
+  QElapsedTimer clock;
+  clock.start();
+
+  QImage img = benchImage();
+  Tuning best;
+  KernelInfo smooth = benchKernel(2, KernelInfo::Dense);
+
+  // Thread counts: powers of two up to the core count, and the core count
+  int cores = QThread::idealThreadCount();
+  QList<int> threads;
+  for (int n=1; n<cores; n*=2)
+    threads << n;
+  threads << qMax(1, cores);
+  qint64 bestTime = -1;
+  foreach (int n, threads)
+  {
+    Tuning t = best;
+    t.threads = n;
+    setTuning(t);
+    qint64 time = timeMedian(img, 3) + timeConvolve(img, smooth);
+    if (bestTime < 0 || time < bestTime)
+    {
+      bestTime = time;
+      best.threads = n;
+    }
+  }
+
+  // Band height with that many threads
+  static const int bandRows[] = { 8, 16, 32, 64, 128 };
+  bestTime = -1;
+  for (unsigned i=0; i<sizeof(bandRows)/sizeof(bandRows[0]); i++)
+  {
+    Tuning t = best;
+    t.bandRows = bandRows[i];
+    setTuning(t);
+    qint64 time = timeMedian(img, 3) + timeConvolve(img, smooth);
+    if (bestTime < 0 || time < bestTime)
+    {
+      bestTime = time;
+      best.bandRows = bandRows[i];
+    }
+  }
+  setTuning(best);
+
+  // Separable crossover: the smallest size from which the two passes win.
+  // Above 7 there is no unrolled 2D path, so the passes always win there.
+  best.separableMinSize = 9;
+  for (int hsize=3; hsize>=1; hsize--)
+  {
+    if (timeConvolve(img, benchKernel(hsize, KernelInfo::Separable)) >=
+        timeConvolve(img, benchKernel(hsize, KernelInfo::Dense)))
+      break;
+    best.separableMinSize = 2*hsize + 1;
+  }
+
+  m_measured = true;
+  m_measureTime = clock.elapsed();
+  return best;
+}
+
+QString AutoTuner::report() const
+{
+  QString res;
+  QTextStream out(&res);
+  out << "Machine: " << machineId() << "\n";
+  if (m_measured)
+    out << "Profile: measured now in " << m_measureTime << " ms\n";
+  else
+    out << "Profile: stored\n";
+
+  const char *const keys[] = { "threads", "bandRows", "separableMinSize" };
+  const int values[] = { m_tuning.threads, m_tuning.bandRows, m_tuning.separableMinSize };
+  for (int i=0; i<3; i++)
+  {
+    out << "  " << keys[i] << " = " << values[i];
+    if (m_overridden.contains(keys[i]))
+      out << " (" << overrideGroup << ")";
+    out << "\n";
+  }
+  out.flush();
+  return res;
+}
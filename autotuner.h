@@ -0,0 +1,37 @@
+#ifndef AUTOTUNER_H
+#define AUTOTUNER_H
+
+#include <QString>
+#include <QStringList>
+#include "filters/tuning.h"
+
+/** Chooses the kernel Tuning of this machine. On first start, and when
+ * asked to, short benchmarks of the kernels pick the thread count, the
+ * band height and the separable convolution crossover; the result is
+ * stored in the settings with the identity of the machine, so a profile
+ * copied to another machine is measured again. Keys set in the
+ * TuningOverride settings group win over the measured values.
+ */
+class AutoTuner
+{
+public:
+  AutoTuner();
+
+  // Stored profile of this machine, measured first if there is none or
+  // if retune, with the overrides applied
+  Tuning run(bool retune = false);
+  // Chosen values and where they come from
+  QString report() const;
+
+  static QString machineId();
+
+private:
+  Tuning measure();
+
+  Tuning m_tuning;
+  bool m_measured;
+  qint64 m_measureTime;
+  QStringList m_overridden;
+};
+
+#endif // AUTOTUNER_H
@@ -0,0 +1,318 @@
+#include <QDir>
+#include <QFileInfo>
+#include <QImageReader>
+#include <QRunnable>
+#include <QThread>
+#include <QWidget>
+
+#include "batchpipeline.h"
+#include "filters.h"
+#include "imageloader.h"
+#include "imagesaver.h"
+#include "filters/scratchpool.h"
+
+static const int defaultCapacity = 4;
+
+class BatchWorker : public QRunnable
+{
+public:
+  BatchWorker(BatchPipeline *pipeline, BatchPipeline::Stage stage, int slot)
+    : m_pipeline(pipeline), m_stage(stage), m_slot(slot) {}
+
+  void run() { m_pipeline->runWorker(m_stage, m_slot); }
+
+private:
+  BatchPipeline *m_pipeline;
+  BatchPipeline::Stage m_stage;
+  int m_slot;
+};
+
+BatchPipeline::BatchPipeline(const QList<BatchStep> &chain, QObject *parent)
+  : QObject(parent), m_chain(chain), m_pngLevel(6), m_jpegQuality(90),
+    m_capacity(defaultCapacity), m_decoded(0), m_filtered(0), m_elapsed(0)
+{
+  // Filtering is the heavy stage; decoding and encoding are mostly I/O
+  int cores = QThread::idealThreadCount();
+  m_workers[Decode] = qMax(1, cores/4);
+  m_workers[Filter] = qMax(1, cores/2);
+  m_workers[Encode] = qMax(1, cores/4);
+
+  for (int i=0; i<StageCount; i++)
+  {
+    m_busy[i] = 0;
+    m_processed[i] = 0;
+  }
+}
+
+BatchPipeline::~BatchPipeline()
+{
+  cancel();
+  m_pool.waitForDone();
+  releaseChains();
+  delete m_decoded;
+  delete m_filtered;
+}
+
+void BatchPipeline::setWorkers(Stage stage, int count)
+{
+  m_workers[stage] = qMax(1, count);
+}
+
+bool BatchPipeline::overwritesInput(const QStringList &files, const QString &outputDir)
+{
+  // Empty for a folder that doesn't exist yet
+  QString output = QDir(outputDir).canonicalPath();
+  if (output.isEmpty())
+    return false;
+  foreach (const QString &file, files)
+    if (QFileInfo(file).canonicalPath() == output)
+      return true;
+  return false;
+}
+
+bool BatchPipeline::start(const QStringList &files, const QString &outputDir,
+                          int pngLevel, int jpegQuality)
+{
+  if (isRunning() || overwritesInput(files, outputDir))
+    return false;
+  m_pool.waitForDone();
+
+  // Filter widgets must be created on this thread
+  releaseChains();
+  for (int slot=0; slot<m_workers[Filter]; slot++)
+  {
+    QList<IFilter *> chain;
+    foreach (const BatchStep &step, m_chain)
+    {
+      IFilter *filter = createFilter(step.filterName, this);
+      if (!filter)
+      {
+        m_chains << chain;
+        releaseChains();
+        return false;
+      }
+      filter->setParameters(step.parameters);
+      filter->setLinearLight(step.linear);
+      chain << filter;
+    }
+    m_chains << chain;
+  }
+
+  m_files = files;
+  m_outputDir = outputDir;
+  m_pngLevel = pngLevel;
+  m_jpegQuality = jpegQuality;
+
+  delete m_decoded;
+  delete m_filtered;
+  m_decoded = new BoundedQueue<BatchItem>(m_capacity);
+  m_filtered = new BoundedQueue<BatchItem>(m_capacity);
+
+  m_canceled = 0;
+  m_next = 0;
+  m_done = 0;
+  m_running = 1;
+  for (int i=0; i<StageCount; i++)
+  {
+    m_busy[i] = 0;
+    m_processed[i] = 0;
+    m_remaining[i] = m_workers[i];
+  }
+  m_elapsed = 0;
+  m_clock.start();
+
+  m_pool.setMaxThreadCount(m_workers[Decode] + m_workers[Filter] + m_workers[Encode]);
+  for (int s=0; s<StageCount; s++)
+    for (int slot=0; slot<m_workers[s]; slot++)
+      m_pool.start(new BatchWorker(this, Stage(s), slot));
+  return true;
+}
+
+void BatchPipeline::cancel()
+{
+  if (!isRunning())
+    return;
+
+  m_canceled = 1;
+  m_decoded->abort();
+  m_filtered->abort();
+}
+
+BatchPipeline::StageStats BatchPipeline::stats(Stage stage) const
+{
+  QMutexLocker lock(&m_statsMutex);
+  qint64 elapsed = isRunning() ? m_clock.elapsed() : m_elapsed;
+
+  StageStats res;
+  res.workers = m_workers[stage];
+  res.processed = m_processed[stage];
+  res.occupancy = elapsed > 0 ? double(m_busy[stage])/(elapsed*res.workers) : 0;
+  res.meanQueue = 0;
+  res.maxQueue = 0;
+  res.queueCapacity = 0;
+
+  // Input queue of the stage
+  const BoundedQueue<BatchItem> *queue = stage == Filter ? m_decoded
+                                       : stage == Encode ? m_filtered : 0;
+  if (queue)
+  {
+    res.meanQueue = queue->meanLength();
+    res.maxQueue = queue->maxLength();
+    res.queueCapacity = queue->capacity();
+  }
+  return res;
+}
+
+QString BatchPipeline::report() const
+{
+  static const char *names[StageCount] = { "decode", "filter", "encode" };
+
+  QStringList lines;
+  for (int s=0; s<StageCount; s++)
+  {
+    StageStats st = stats(Stage(s));
+    QString line = tr("%1: %2 workers, %3 images, %4% busy")
+                     .arg(names[s]).arg(st.workers).arg(st.processed)
+                     .arg(int(st.occupancy*100 + 0.5));
+    if (st.queueCapacity)
+      line += tr(", input queue %1 mean, %2 max of %3")
+                .arg(st.meanQueue, 0, 'f', 1).arg(st.maxQueue).arg(st.queueCapacity);
+    lines << line;
+  }
+  lines << ScratchPool::instance().report();
+  return lines.join("\n");
+}
+
+void BatchPipeline::runWorker(Stage stage, int slot)
+{
+  switch (stage)
+  {
+  case Decode:
+    decodeLoop();
+    break;
+  case Filter:
+    filterLoop(slot);
+    break;
+  default:
+  case Encode:
+    encodeLoop();
+  }
+
+  // The last worker of a stage ends the stream for the next one
+  if (!m_remaining[stage].deref())
+    stageDone(stage);
+}
+
+void BatchPipeline::decodeLoop()
+{
+  for (;;)
+  {
+    int index = m_next.fetchAndAddOrdered(1);
+    if (index >= m_files.size() || int(m_canceled))
+      return;
+
+    QElapsedTimer measure;
+    measure.start();
+    BatchItem item;
+    item.index = index;
+    item.fileName = m_files[index];
+    QImageReader reader(item.fileName);
+    item.image = reader.read();
+    ImageLoader::normalizeFormat(item.image);
+    account(Decode, measure.elapsed());
+
+    if (item.image.isNull())
+      itemDone(item, false);
+    else if (!m_decoded->push(item))
+      return;
+  }
+}
+
+void BatchPipeline::filterLoop(int slot)
+{
+  const QList<IFilter *> &chain = m_chains[slot];
+  BatchItem item;
+  while (m_decoded->pop(item))
+  {
+    QElapsedTimer measure;
+    measure.start();
+    // Resampling steps in a row are resampled at once
+    TransformChain run;
+    foreach (IFilter *filter, chain)
+    {
+      filter->prepareFormat(item.image);
+      Transform t = Transform::scale(1, 1);
+      if (filter->resampling(item.image.rect(), t))
+        item.image = run.apply(item.image, item.image.rect(), t, Bilinear, filter->linearLight());
+      else
+      {
+        run.clear();
+        filter->apply(item.image, item.image.rect());
+      }
+    }
+    account(Filter, measure.elapsed());
+
+    if (!m_filtered->push(item))
+      return;
+  }
+}
+
+void BatchPipeline::encodeLoop()
+{
+  BatchItem item;
+  while (m_filtered->pop(item))
+  {
+    QElapsedTimer measure;
+    measure.start();
+    QString target = QDir(m_outputDir).filePath(QFileInfo(item.fileName).fileName());
+    bool ok = ImageSaver::write(item.image, target, m_pngLevel, m_jpegQuality);
+    account(Encode, measure.elapsed());
+    itemDone(item, ok);
+  }
+}
+
+void BatchPipeline::stageDone(Stage stage)
+{
+  switch (stage)
+  {
+  case Decode:
+    m_decoded->close();
+    break;
+  case Filter:
+    m_filtered->close();
+    break;
+  default:
+  case Encode:
+    {
+      QMutexLocker lock(&m_statsMutex);
+      m_elapsed = m_clock.elapsed();
+      m_running = 0;
+    }
+    emit finished();
+  }
+}
+
+void BatchPipeline::account(Stage stage, qint64 ms)
+{
+  QMutexLocker lock(&m_statsMutex);
+  m_busy[stage] += ms;
+  m_processed[stage]++;
+}
+
+void BatchPipeline::itemDone(const BatchItem &item, bool ok)
+{
+  if (!ok)
+    emit fileFailed(item.fileName);
+  emit progress(m_done.fetchAndAddOrdered(1) + 1, m_files.size());
+}
+
+void BatchPipeline::releaseChains()
+{
+  foreach (const QList<IFilter *> &chain, m_chains)
+    foreach (IFilter *filter, chain)
+    {
+      delete filter->settingsWidget();
+      delete dynamic_cast<QObject *>(filter);
+    }
+  m_chains.clear();
+}
@@ -0,0 +1,128 @@
+#ifndef BATCHPIPELINE_H
+#define BATCHPIPELINE_H
+
+#include <QObject>
+#include <QImage>
+#include <QStringList>
+#include <QThreadPool>
+#include <QAtomicInt>
+#include <QMutex>
+#include <QElapsedTimer>
+#include "boundedqueue.h"
+
+class IFilter;
+
+// One filter application of a batch chain
+struct BatchStep
+{
+    BatchStep() : linear(false) {}
+    BatchStep(const QString &name, const QByteArray &params, bool linearLight)
+      : filterName(name), parameters(params), linear(linearLight) {}
+
+    QString filterName;
+    QByteArray parameters;
+    bool linear;        // blending mode the step was applied with
+};
+
+// Image travelling through the pipeline
+struct BatchItem
+{
+    int index;
+    QString fileName;
+    QImage image;
+};
+
+/** Runs a filter chain over many files in three stages: decode, filter
+ * and encode. Each stage has its own worker threads, and the stages are
+ * connected by bounded queues, so I/O and filtering overlap, memory
+ * stays bounded and throughput is limited by the slowest stage.
+ */
+class BatchPipeline : public QObject
+{
+  Q_OBJECT
+public:
+  enum Stage { Decode, Filter, Encode, StageCount };
+
+  struct StageStats
+  {
+      int workers;
+      int processed;
+      // Share of the stage's worker time spent working, 0-1
+      double occupancy;
+      // Input queue: time-weighted mean and max length (not for Decode)
+      double meanQueue;
+      int maxQueue;
+      int queueCapacity;
+  };
+
+  explicit BatchPipeline(const QList<BatchStep> &chain, QObject *parent = 0);
+  ~BatchPipeline();
+
+  // Worker counts and queue capacity take effect on start()
+  void setWorkers(Stage stage, int count);
+  int workers(Stage stage) const { return m_workers[stage]; }
+  void setQueueCapacity(int capacity) { m_capacity = capacity; }
+
+  // Results go to outputDir under the input file names. Returns false if
+  // a pipeline is already running, the chain names unknown filters or
+  // results would replace inputs.
+  bool start(const QStringList &files, const QString &outputDir,
+             int pngLevel, int jpegQuality);
+  // True if a file of files is in outputDir, where its result would
+  // overwrite it
+  static bool overwritesInput(const QStringList &files, const QString &outputDir);
+  void cancel();
+  bool isRunning() const { return int(m_running) != 0; }
+
+  StageStats stats(Stage stage) const;
+  // One line per stage
+  QString report() const;
+
+signals:
+  // Emitted from the worker threads
+  void progress(int done, int total);
+  void fileFailed(const QString &filename);
+  void finished();
+
+private:
+  friend class BatchWorker;
+
+  void runWorker(Stage stage, int slot);
+  void decodeLoop();
+  void filterLoop(int slot);
+  void encodeLoop();
+  void stageDone(Stage stage);
+  void account(Stage stage, qint64 ms);
+  void itemDone(const BatchItem &item, bool ok);
+  void releaseChains();
+
+  QList<BatchStep> m_chain;
+  // Private filter instances per filter worker: widgets are not shared
+  // across threads
+  QList<QList<IFilter *> > m_chains;
+
+  QStringList m_files;
+  QString m_outputDir;
+  int m_pngLevel;
+  int m_jpegQuality;
+
+  int m_workers[StageCount];
+  int m_capacity;
+  QThreadPool m_pool;
+  BoundedQueue<BatchItem> *m_decoded;
+  BoundedQueue<BatchItem> *m_filtered;
+
+  QAtomicInt m_running;
+  QAtomicInt m_canceled;
+  QAtomicInt m_next;
+  QAtomicInt m_done;
+  QAtomicInt m_remaining[StageCount];
+
+  mutable QMutex m_statsMutex;
+  QElapsedTimer m_clock;
+  qint64 m_elapsed;
+  qint64 m_busy[StageCount];
+  int m_processed[StageCount];
+};
+
+#endif // BATCHPIPELINE_H
@@ -0,0 +1,117 @@
+#ifndef BOUNDEDQUEUE_H
+#define BOUNDEDQUEUE_H
+
+#include <QQueue>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QWaitCondition>
+#include <QElapsedTimer>
+
+/** Blocking FIFO of limited capacity between two pipeline stages.
+ * push() waits while the queue is full, which throttles a fast producer
+ * to its consumer (back-pressure); pop() waits while it is empty.
+ * After close() the remaining items are still popped, then pop() fails.
+ */
+template<class T> class BoundedQueue
+{
+  public:
+    explicit BoundedQueue(int capacity)
+      : m_capacity(qMax(1, capacity)), m_closed(false),
+        m_maxLength(0), m_lengthTime(0), m_lastChange(0)
+    {
+      m_clock.start();
+    }
+
+    // False if the queue was closed meanwhile; item is then dropped
+    bool push(const T &item)
+    {
+      QMutexLocker lock(&m_mutex);
+      while (!m_closed && m_items.size() >= m_capacity)
+        m_notFull.wait(&m_mutex);
+      if (m_closed)
+        return false;
+
+      account();
+      m_items.enqueue(item);
+      m_maxLength = qMax(m_maxLength, m_items.size());
+      m_notEmpty.wakeOne();
+      return true;
+    }
+
+    // False once the queue is closed and drained
+    bool pop(T &item)
+    {
+      QMutexLocker lock(&m_mutex);
+      while (!m_closed && m_items.isEmpty())
+        m_notEmpty.wait(&m_mutex);
+      if (m_items.isEmpty())
+        return false;
+
+      account();
+      item = m_items.dequeue();
+      m_notFull.wakeOne();
+      return true;
+    }
+
+    // No more items will be pushed
+    void close()
+    {
+      QMutexLocker lock(&m_mutex);
+      m_closed = true;
+      m_notFull.wakeAll();
+      m_notEmpty.wakeAll();
+    }
+
+    // Close and drop the waiting items
+    void abort()
+    {
+      QMutexLocker lock(&m_mutex);
+      account();
+      m_items.clear();
+      m_closed = true;
+      m_notFull.wakeAll();
+      m_notEmpty.wakeAll();
+    }
+
+    int capacity() const { return m_capacity; }
+
+    int maxLength() const
+    {
+      QMutexLocker lock(&m_mutex);
+      return m_maxLength;
+    }
+
+    // Time-weighted mean number of waiting items so far
+    double meanLength() const
+    {
+      QMutexLocker lock(&m_mutex);
+      qint64 now = m_clock.elapsed();
+      if (now <= 0)
+        return m_items.size();
+      return double(m_lengthTime + m_items.size()*(now - m_lastChange))/now;
+    }
+
+  private:
+    // Integrate the length up to now; called before each change
+    void account()
+    {
+      qint64 now = m_clock.elapsed();
+      m_lengthTime += m_items.size()*(now - m_lastChange);
+      m_lastChange = now;
+    }
+
+    QQueue<T> m_items;
+    int m_capacity;
+    bool m_closed;
+
+    mutable QMutex m_mutex;
+    QWaitCondition m_notFull;
+    QWaitCondition m_notEmpty;
+
+    QElapsedTimer m_clock;
+    int m_maxLength;
+    qint64 m_lengthTime;
+    qint64 m_lastChange;
+};
+
+#endif // BOUNDEDQUEUE_H
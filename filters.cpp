@@ -1,3 +1,4 @@
+#include <cmath>
 #include <QWidget>
 #include <QFormLayout>
 #include <QDoubleSpinBox>
@@ -9,28 +10,57 @@
 #include <QPainter>
 #include <QRect>
 #include <QComboBox>
+#include <QDataStream>
 
 #include "filters.h"
 #include "filters/colorcorrect.h"
 #include "filters/artistic.h"
+#include "filters/denoise.h"
 #include "filters/transform.h"
 #include "filters/convolution.h"
+#include "filters/edges.h"
+#include "filters/planar.h"
 
-QList<IFilter *> createFilters(QObject *parent)
+QList<IFilter *> createFilters(QObject *parent, IntegralImage *integral)
 {
   return QList<IFilter *>()
-      << new WhiteBalance(parent)
+      << new WhiteBalance(parent, integral)
       << new LumaStretch(parent)
       << new RGBStretch(parent)
+      << new AdaptiveEqualize(parent)
       << 0
       << new Rotate(parent)
       << new Scale(parent)
       << 0
       << new GaussianBlur(parent)
+      << new BoxBlur(parent)
       << new UnsharpMask(parent)
       << new Median(parent)
+      << new BilateralDenoise(parent)
+      << new Morphology(parent)
       << new MatteGlass(parent)
-      << new CustomConvolution(parent);
+      << new CustomConvolution(parent)
+      << 0
+      << new EdgeDetect(parent)
+      << new CannyEdges(parent);
+}
+
+IFilter *createFilter(const QString &name, QObject *parent)
+{
+  IFilter *res = 0;
+  foreach (IFilter *filter, createFilters(parent, 0))
+  {
+    if (!filter)
+      continue;
+    if (!res && filter->filterName() == name)
+      res = filter;
+    else
+    {
+      delete filter->settingsWidget();
+      delete dynamic_cast<QObject *>(filter);
+    }
+  }
+  return res;
 }
 
 static int sizeForSigma(double sigma)
@@ -73,19 +103,109 @@ static QPixmap visualFilter(const Matrix<double> &m)
   return viz;
 }
 
+// Odd window sizes in [min, max], shown as NxN if square, with the size
+// as item data
+static QComboBox *windowSizeBox(QWidget *parent, int min, int max, bool square)
+{
+  static const int sizes[] = { 1, 3, 5, 7, 9, 11, 15, 21, 31, 41, 51 };
+  QComboBox *cb = new QComboBox(parent);
+  for (unsigned i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++)
+    if (sizes[i] >= min && sizes[i] <= max)
+      cb->addItem(square ? QObject::tr("%1x%1").arg(sizes[i]) : QString::number(sizes[i]),
+                  sizes[i]);
+  return cb;
+}
+
 // =======
 
 void WhiteBalance::apply(QImage &image, const QRect &rect)
+{
+  applyMasked(image, rect);
+}
+
+void WhiteBalance::applyMasked(QImage &image, const SpanMask &mask)
+{
+  whitebalance(image, mask, m_integral);
+}
+
+void WhiteBalance::applyPlanar(PlanarImage &image, const QRect &rect)
 {
   whitebalance(image, rect);
 }
 
 void LumaStretch::apply(QImage &image, const QRect &rect)
+{
+  applyMasked(image, rect);
+}
+
+void LumaStretch::applyMasked(QImage &image, const SpanMask &mask)
+{
+  luma_stretch(image, mask);
+}
+
+void LumaStretch::applyPlanar(PlanarImage &image, const QRect &rect)
 {
   luma_stretch(image, rect);
 }
 
+AdaptiveEqualize::AdaptiveEqualize(QObject *parent)
+  : QObject(parent), IFilter(new QWidget())
+{
+  QFormLayout *layout = new QFormLayout;
+  settingsWidget()->setLayout(layout);
+
+  sbTiles = new QSpinBox(settingsWidget());
+  sbTiles->setRange(1, 32);
+  sbTiles->setValue(8);
+  layout->addRow(tr("Tiles per side:"), sbTiles);
+
+  // Multiple of the mean histogram bin: 1 leaves the image as it is
+  sbClipLimit = new QDoubleSpinBox(settingsWidget());
+  sbClipLimit->setRange(1, 16);
+  sbClipLimit->setSingleStep(0.5);
+  sbClipLimit->setValue(3);
+  layout->addRow(tr("Contrast limit:"), sbClipLimit);
+}
+
+void AdaptiveEqualize::apply(QImage &image, const QRect &rect)
+{
+  applyMasked(image, rect);
+}
+
+void AdaptiveEqualize::applyMasked(QImage &image, const SpanMask &mask)
+{
+  clahe(image, mask, sbTiles->value(), sbClipLimit->value());
+}
+
+QByteArray AdaptiveEqualize::parameters()
+{
+  QByteArray res;
+  QDataStream s(&res, QIODevice::WriteOnly);
+  s << sbTiles->value() << sbClipLimit->value();
+  return res;
+}
+
+void AdaptiveEqualize::setParameters(const QByteArray &params)
+{
+  QDataStream s(params);
+  int tiles;
+  double clipLimit;
+  s >> tiles >> clipLimit;
+  sbTiles->setValue(tiles);
+  sbClipLimit->setValue(clipLimit);
+}
+
 void RGBStretch::apply(QImage &image, const QRect &rect)
+{
+  applyMasked(image, rect);
+}
+
+void RGBStretch::applyMasked(QImage &image, const SpanMask &mask)
+{
+  rgb_stretch(image, mask);
+}
+
+void RGBStretch::applyPlanar(PlanarImage &image, const QRect &rect)
 {
   rgb_stretch(image, rect);
 }
@@ -115,11 +235,57 @@ GaussianBlur::GaussianBlur(QObject *parent)
 }
 
 void GaussianBlur::apply(QImage &image, const QRect &rect)
+{
+  applyMasked(image, rect);
+}
+
+void GaussianBlur::applyMasked(QImage &image, const SpanMask &mask)
+{
+  double sigma = sbRadius->value();
+  convolve(image, mask, gaussian(sizeForSigma(sigma), sigma), linearLight());
+}
+
+void GaussianBlur::applyPlanar(PlanarImage &image, const QRect &rect)
 {
   double sigma = sbRadius->value();
   convolve(image, rect, gaussian(sizeForSigma(sigma), sigma));
 }
 
+QSize GaussianBlur::halo()
+{
+  int hsize = sizeForSigma(sbRadius->value());
+  return QSize(hsize, hsize);
+}
+
+int GaussianBlur::refinementPasses()
+{
+  return sbRadius->value() >= 2 ? 1 : 0;
+}
+
+void GaussianBlur::applyCoarse(QImage &image, const SpanMask &mask, int)
+{
+  // Box blur of the same variance, ((2r+1)^2-1)/12, at constant cost
+  double sigma = sbRadius->value();
+  int radius = qRound((sqrt(12*sigma*sigma + 1) - 1)/2);
+  boxblur(image, mask, qMin(radius, sizeForSigma(sigma)));
+}
+
+QByteArray GaussianBlur::parameters()
+{
+  QByteArray res;
+  QDataStream s(&res, QIODevice::WriteOnly);
+  s << sbRadius->value();
+  return res;
+}
+
+void GaussianBlur::setParameters(const QByteArray &params)
+{
+  QDataStream s(params);
+  double radius;
+  s >> radius;
+  sbRadius->setValue(radius);
+}
+
 void GaussianBlur::filterChanged()
 {
   double sigma = sbRadius->value();
@@ -129,6 +295,50 @@ void GaussianBlur::filterChanged()
   lblVisual->setPixmap(visualFilter(gaussian(hsize, sigma)));
 }
 
+BoxBlur::BoxBlur(QObject *parent)
+  : QObject(parent), IFilter(new QWidget())
+{
+  QFormLayout *layout = new QFormLayout;
+  settingsWidget()->setLayout(layout);
+
+  sbRadius = new QSpinBox(settingsWidget());
+  sbRadius->setRange(1, 100);
+  sbRadius->setValue(3);
+  layout->addRow(tr("Radius:"), sbRadius);
+}
+
+void BoxBlur::apply(QImage &image, const QRect &rect)
+{
+  applyMasked(image, rect);
+}
+
+void BoxBlur::applyMasked(QImage &image, const SpanMask &mask)
+{
+  boxblur(image, mask, sbRadius->value());
+}
+
+QSize BoxBlur::halo()
+{
+  int hsize = sbRadius->value();
+  return QSize(hsize, hsize);
+}
+
+QByteArray BoxBlur::parameters()
+{
+  QByteArray res;
+  QDataStream s(&res, QIODevice::WriteOnly);
+  s << sbRadius->value();
+  return res;
+}
+
+void BoxBlur::setParameters(const QByteArray &params)
+{
+  QDataStream s(params);
+  int radius;
+  s >> radius;
+  sbRadius->setValue(radius);
+}
+
 UnsharpMask::UnsharpMask(QObject *parent)
   : QObject(parent), IFilter(new QWidget())
 {
@@ -159,11 +369,53 @@ UnsharpMask::UnsharpMask(QObject *parent)
 }
 
 void UnsharpMask::apply(QImage &image, const QRect &rect)
+{
+  applyMasked(image, rect);
+}
+
+void UnsharpMask::applyMasked(QImage &image, const SpanMask &mask)
+{
+  double sigma = sbRadius->value();
+  convolve(image, mask, unsharp(sizeForSigma(sigma), sigma, sbStrength->value()),
+           linearLight());
+}
+
+void UnsharpMask::applyPlanar(PlanarImage &image, const QRect &rect)
 {
   double sigma = sbRadius->value();
   convolve(image, rect, unsharp(sizeForSigma(sigma), sigma, sbStrength->value()));
 }
 
+QSize UnsharpMask::halo()
+{
+  int hsize = sizeForSigma(sbRadius->value());
+  return QSize(hsize, hsize);
+}
+
+int UnsharpMask::refinementPasses()
+{
+  // The kernel is dense: cost grows with its area
+  int hsize = sizeForSigma(sbRadius->value());
+  return hsize >= 7 ? 2 : hsize >= 3 ? 1 : 0;
+}
+
+QByteArray UnsharpMask::parameters()
+{
+  QByteArray res;
+  QDataStream s(&res, QIODevice::WriteOnly);
+  s << sbRadius->value() << sbStrength->value();
+  return res;
+}
+
+void UnsharpMask::setParameters(const QByteArray &params)
+{
+  QDataStream s(params);
+  double radius, strength;
+  s >> radius >> strength;
+  sbRadius->setValue(radius);
+  sbStrength->setValue(strength);
+}
+
 void UnsharpMask::filterChanged()
 {
   double sigma = sbRadius->value();
@@ -180,19 +432,168 @@ Median::Median(QObject *parent)
   QFormLayout *layout = new QFormLayout;
   settingsWidget()->setLayout(layout);
 
-  cbSize = new QComboBox(settingsWidget());
-  cbSize->addItem(tr("3x3"), 3);
-  cbSize->addItem(tr("5x5"), 5);
-  cbSize->addItem(tr("7x7"), 7);
+  cbSize = windowSizeBox(settingsWidget(), 3, 7, true);
   cbSize->setCurrentIndex(0);
 
   layout->addRow(tr("Filter size:"), cbSize);
 }
 
 void Median::apply(QImage &image, const QRect &rect)
+{
+  applyMasked(image, rect);
+}
+
+void Median::applyMasked(QImage &image, const SpanMask &mask)
 {
   int size = cbSize->itemData(cbSize->currentIndex()).toInt();
-  median(image, rect, size);
+  median(image, mask, size);
+}
+
+QSize Median::halo()
+{
+  int size = cbSize->itemData(cbSize->currentIndex()).toInt();
+  return QSize(size/2, size/2);
+}
+
+int Median::refinementPasses()
+{
+  int size = cbSize->itemData(cbSize->currentIndex()).toInt();
+  return size >= 7 ? 2 : size == 5 ? 1 : 0;
+}
+
+QByteArray Median::parameters()
+{
+  QByteArray res;
+  QDataStream s(&res, QIODevice::WriteOnly);
+  s << cbSize->itemData(cbSize->currentIndex()).toInt();
+  return res;
+}
+
+void Median::setParameters(const QByteArray &params)
+{
+  QDataStream s(params);
+  int size;
+  s >> size;
+  cbSize->setCurrentIndex(cbSize->findData(size));
+}
+
+BilateralDenoise::BilateralDenoise(QObject *parent)
+  : QObject(parent), IFilter(new QWidget())
+{
+  QFormLayout *layout = new QFormLayout;
+  settingsWidget()->setLayout(layout);
+
+  // Cells of the grid: pixels by luminance levels
+  sbSpace = new QSpinBox(settingsWidget());
+  sbSpace->setRange(8, 64);
+  sbSpace->setValue(16);
+  layout->addRow(tr("Spatial sigma:"), sbSpace);
+
+  sbRange = new QSpinBox(settingsWidget());
+  sbRange->setRange(8, 128);
+  sbRange->setValue(24);
+  layout->addRow(tr("Range sigma:"), sbRange);
+}
+
+void BilateralDenoise::apply(QImage &image, const QRect &rect)
+{
+  applyMasked(image, rect);
+}
+
+void BilateralDenoise::applyMasked(QImage &image, const SpanMask &mask)
+{
+  bilateral(image, mask, sbSpace->value(), sbRange->value());
+}
+
+QSize BilateralDenoise::halo()
+{
+  int hsize = bilateralHalo(sbSpace->value());
+  return QSize(hsize, hsize);
+}
+
+QByteArray BilateralDenoise::parameters()
+{
+  QByteArray res;
+  QDataStream s(&res, QIODevice::WriteOnly);
+  s << sbSpace->value() << sbRange->value();
+  return res;
+}
+
+void BilateralDenoise::setParameters(const QByteArray &params)
+{
+  QDataStream s(params);
+  int space, range;
+  s >> space >> range;
+  sbSpace->setValue(space);
+  sbRange->setValue(range);
+}
+
+Morphology::Morphology(QObject *parent)
+  : QObject(parent), IFilter(new QWidget())
+{
+  QFormLayout *layout = new QFormLayout;
+  settingsWidget()->setLayout(layout);
+
+  cbOperation = new QComboBox(settingsWidget());
+  cbOperation->addItem(tr("Dilate"), int(Dilate));
+  cbOperation->addItem(tr("Erode"), int(Erode));
+  cbOperation->addItem(tr("Open"), int(Open));
+  cbOperation->addItem(tr("Close"), int(Close));
+  cbOperation->addItem(tr("Top-hat"), int(TopHat));
+  layout->addRow(tr("Operation:"), cbOperation);
+
+  // Same sizes as the median and up, for structures of scanned pages
+  cbWidth = windowSizeBox(settingsWidget(), 1, 51, false);
+  cbWidth->setCurrentIndex(cbWidth->findData(3));
+  layout->addRow(tr("Width:"), cbWidth);
+
+  cbHeight = windowSizeBox(settingsWidget(), 1, 51, false);
+  cbHeight->setCurrentIndex(cbHeight->findData(3));
+  layout->addRow(tr("Height:"), cbHeight);
+}
+
+void Morphology::apply(QImage &image, const QRect &rect)
+{
+  applyMasked(image, rect);
+}
+
+void Morphology::applyMasked(QImage &image, const SpanMask &mask)
+{
+  morphology(image, mask, operation(),
+             cbWidth->itemData(cbWidth->currentIndex()).toInt(),
+             cbHeight->itemData(cbHeight->currentIndex()).toInt());
+}
+
+QSize Morphology::halo()
+{
+  return morphologyHalo(operation(),
+                        cbWidth->itemData(cbWidth->currentIndex()).toInt(),
+                        cbHeight->itemData(cbHeight->currentIndex()).toInt());
+}
+
+QByteArray Morphology::parameters()
+{
+  QByteArray res;
+  QDataStream s(&res, QIODevice::WriteOnly);
+  s << int(operation())
+    << cbWidth->itemData(cbWidth->currentIndex()).toInt()
+    << cbHeight->itemData(cbHeight->currentIndex()).toInt();
+  return res;
+}
+
+void Morphology::setParameters(const QByteArray &params)
+{
+  QDataStream s(params);
+  int op, width, height;
+  s >> op >> width >> height;
+  cbOperation->setCurrentIndex(cbOperation->findData(op));
+  cbWidth->setCurrentIndex(cbWidth->findData(width));
+  cbHeight->setCurrentIndex(cbHeight->findData(height));
+}
+
+MorphologyOp Morphology::operation()
+{
+  return MorphologyOp(cbOperation->itemData(cbOperation->currentIndex()).toInt());
 }
 
 MatteGlass::MatteGlass(QObject *parent)
@@ -214,7 +615,49 @@ MatteGlass::MatteGlass(QObject *parent)
 
 void MatteGlass::apply(QImage &image, const QRect &rect)
 {
-  glass(image, rect, sbRadius->value(), sbSamples->value());
+  applyMasked(image, rect);
+}
+
+void MatteGlass::applyMasked(QImage &image, const SpanMask &mask)
+{
+  glass(image, mask, sbRadius->value(), sbSamples->value(), linearLight());
+}
+
+QSize MatteGlass::halo()
+{
+  int hsize = int(sbRadius->value());
+  return QSize(hsize, hsize);
+}
+
+int MatteGlass::refinementPasses()
+{
+  int samples = sbSamples->value();
+  return samples >= 16 ? 2 : samples >= 4 ? 1 : 0;
+}
+
+void MatteGlass::applyCoarse(QImage &image, const SpanMask &mask, int pass)
+{
+  // A quarter of the samples of the next pass
+  int samples = sbSamples->value() >> 2*(refinementPasses() - pass);
+  glass(image, mask, sbRadius->value(), qMax(1, samples), linearLight());
+}
+
+QByteArray MatteGlass::parameters()
+{
+  QByteArray res;
+  QDataStream s(&res, QIODevice::WriteOnly);
+  s << sbRadius->value() << sbSamples->value();
+  return res;
+}
+
+void MatteGlass::setParameters(const QByteArray &params)
+{
+  QDataStream s(params);
+  double radius;
+  int samples;
+  s >> radius >> samples;
+  sbRadius->setValue(radius);
+  sbSamples->setValue(samples);
 }
 
 Rotate::Rotate(QObject *parent)
@@ -231,7 +674,34 @@ Rotate::Rotate(QObject *parent)
 
 void Rotate::apply(QImage &image, const QRect &rect)
 {
-  image = rotate(image, rect, sbAngle->value());
+  image = rotate(image, rect, sbAngle->value(), Bilinear, linearLight());
+}
+
+void Rotate::applyPlanar(PlanarImage &image, const QRect &rect)
+{
+  rotate(image, rect, sbAngle->value());
+}
+
+bool Rotate::resampling(const QRect &rect, Transform &t)
+{
+  t = rotateTransform(rect, sbAngle->value());
+  return true;
+}
+
+QByteArray Rotate::parameters()
+{
+  QByteArray res;
+  QDataStream s(&res, QIODevice::WriteOnly);
+  s << sbAngle->value();
+  return res;
+}
+
+void Rotate::setParameters(const QByteArray &params)
+{
+  QDataStream s(params);
+  double angle;
+  s >> angle;
+  sbAngle->setValue(angle);
 }
 
 Scale::Scale(QObject *parent)
@@ -248,7 +718,34 @@ Scale::Scale(QObject *parent)
 
 void Scale::apply(QImage &image, const QRect &rect)
 {
-  image = scale(image, rect, sbFactor->value());
+  image = scale(image, rect, sbFactor->value(), Bilinear, linearLight());
+}
+
+void Scale::applyPlanar(PlanarImage &image, const QRect &rect)
+{
+  scale(image, rect, sbFactor->value());
+}
+
+bool Scale::resampling(const QRect &rect, Transform &t)
+{
+  t = scaleTransform(rect, sbFactor->value());
+  return true;
+}
+
+QByteArray Scale::parameters()
+{
+  QByteArray res;
+  QDataStream s(&res, QIODevice::WriteOnly);
+  s << sbFactor->value();
+  return res;
+}
+
+void Scale::setParameters(const QByteArray &params)
+{
+  QDataStream s(params);
+  double factor;
+  s >> factor;
+  sbFactor->setValue(factor);
 }
 
 CustomConvolution::CustomConvolution(QObject *parent)
@@ -261,10 +758,7 @@ CustomConvolution::CustomConvolution(QObject *parent)
   QFormLayout *layout = new QFormLayout;
   settingsWidget()->setLayout(layout);
 
-  cbSize = new QComboBox(settingsWidget());
-  cbSize->addItem(tr("3x3"), 3);
-  cbSize->addItem(tr("5x5"), 5);
-  cbSize->addItem(tr("7x7"), 7);
+  cbSize = windowSizeBox(settingsWidget(), 3, 7, true);
   cbSize->setCurrentIndex(0);
 
   grid = new QGridLayout;
@@ -275,10 +769,15 @@ CustomConvolution::CustomConvolution(QObject *parent)
       QLineEdit *le = new QLineEdit(l.toString(0.0, 'f', 1), settingsWidget());
       le->setValidator(new QDoubleValidator(le));
       grid->addWidget(le, y, x);
+      connect(le, SIGNAL(textChanged(QString)), SLOT(updateKernelInfo()));
     }
 
+  lblKernelPath = new QLabel(settingsWidget());
+  lblKernelPath->setWordWrap(true);
+
   layout->addRow(tr("Matrix size:"), cbSize);
   layout->addRow(grid);
+  layout->addRow(tr("Evaluation:"), lblKernelPath);
 
   connect(cbSize, SIGNAL(currentIndexChanged(int)), SLOT(updateMatrixSize()));
 
@@ -300,9 +799,34 @@ void CustomConvolution::updateMatrixSize()
       else
         w->hide();
     }
+  updateKernelInfo();
 }
 
-void CustomConvolution::apply(QImage &image, const QRect &rect)
+void CustomConvolution::updateKernelInfo()
+{
+  KernelInfo info = analyzeKernel(matrix());
+  QString text;
+  switch (info.path)
+  {
+  case KernelInfo::Separable:
+    text = tr("separable, %1+%1 taps").arg(info.size);
+    break;
+  case KernelInfo::Integer:
+    text = tr("exact integer, %1 taps, divisor %2")
+             .arg(info.nonZero).arg(1 << info.shift);
+    break;
+  case KernelInfo::Sparse:
+    text = tr("sparse, %1 of %2 taps")
+             .arg(info.nonZero).arg(info.size*info.size);
+    break;
+  default:
+  case KernelInfo::Dense:
+    text = tr("dense, %1 taps").arg(info.nonZero);
+  }
+  lblKernelPath->setText(text);
+}
+
+Matrix<double> CustomConvolution::matrix() const
 {
   int size = cbSize->itemData(cbSize->currentIndex()).toInt();
 
@@ -318,5 +842,162 @@ void CustomConvolution::apply(QImage &image, const QRect &rect)
       else
         m.set(x, y, 0);
     }
-  convolve(image, rect, m);
+  return m;
+}
+
+void CustomConvolution::apply(QImage &image, const QRect &rect)
+{
+  applyMasked(image, rect);
+}
+
+void CustomConvolution::applyMasked(QImage &image, const SpanMask &mask)
+{
+  convolve(image, mask, matrix(), linearLight());
+}
+
+void CustomConvolution::applyPlanar(PlanarImage &image, const QRect &rect)
+{
+  convolve(image, rect, matrix());
+}
+
+QSize CustomConvolution::halo()
+{
+  int size = cbSize->itemData(cbSize->currentIndex()).toInt();
+  return QSize(size/2, size/2);
+}
+
+QByteArray CustomConvolution::parameters()
+{
+  Matrix<double> m = matrix();
+  QByteArray res;
+  QDataStream s(&res, QIODevice::WriteOnly);
+  s << m.size();
+  for (int y=0; y<m.size(); y++)
+    for (int x=0; x<m.size(); x++)
+      s << m.at(x, y);
+  return res;
+}
+
+void CustomConvolution::setParameters(const QByteArray &params)
+{
+  QDataStream s(params);
+  int size;
+  s >> size;
+  cbSize->setCurrentIndex(cbSize->findData(size));
+
+  QLocale l = QLocale::system();
+  for (int y=0; y<size; y++)
+    for (int x=0; x<size; x++)
+    {
+      double v;
+      s >> v;
+      QLineEdit *le = qobject_cast<QLineEdit *>(grid->itemAtPosition(y, x)->widget());
+      le->setText(l.toString(v));
+    }
+}
+
+// Edge operators, with the EdgeOperator as item data
+static QComboBox *edgeOperatorBox(QWidget *parent)
+{
+  QComboBox *res = new QComboBox(parent);
+  res->addItem(QObject::tr("Sobel"), int(Sobel));
+  res->addItem(QObject::tr("Scharr"), int(Scharr));
+  return res;
+}
+
+EdgeDetect::EdgeDetect(QObject *parent)
+  : QObject(parent), IFilter(new QWidget())
+{
+  QFormLayout *layout = new QFormLayout;
+  settingsWidget()->setLayout(layout);
+
+  cbOperator = edgeOperatorBox(settingsWidget());
+  layout->addRow(tr("Operator:"), cbOperator);
+}
+
+void EdgeDetect::apply(QImage &image, const QRect &rect)
+{
+  applyMasked(image, rect);
+}
+
+void EdgeDetect::applyMasked(QImage &image, const SpanMask &mask)
+{
+  edges(image, mask, EdgeOperator(cbOperator->itemData(cbOperator->currentIndex()).toInt()));
+}
+
+QSize EdgeDetect::halo()
+{
+  return QSize(1, 1);
+}
+
+QByteArray EdgeDetect::parameters()
+{
+  QByteArray res;
+  QDataStream s(&res, QIODevice::WriteOnly);
+  s << cbOperator->itemData(cbOperator->currentIndex()).toInt();
+  return res;
+}
+
+void EdgeDetect::setParameters(const QByteArray &params)
+{
+  QDataStream s(params);
+  int op;
+  s >> op;
+  cbOperator->setCurrentIndex(cbOperator->findData(op));
+}
+
+CannyEdges::CannyEdges(QObject *parent)
+  : QObject(parent), IFilter(new QWidget())
+{
+  QFormLayout *layout = new QFormLayout;
+  settingsWidget()->setLayout(layout);
+
+  cbOperator = edgeOperatorBox(settingsWidget());
+  layout->addRow(tr("Operator:"), cbOperator);
+
+  // Thresholds on the gradient magnitude, in levels
+  sbLow = new QSpinBox(settingsWidget());
+  sbLow->setRange(0, 255);
+  sbLow->setValue(20);
+  layout->addRow(tr("Low threshold:"), sbLow);
+
+  sbHigh = new QSpinBox(settingsWidget());
+  sbHigh->setRange(0, 255);
+  sbHigh->setValue(50);
+  layout->addRow(tr("High threshold:"), sbHigh);
+}
+
+void CannyEdges::apply(QImage &image, const QRect &rect)
+{
+  applyMasked(image, rect);
+}
+
+void CannyEdges::applyMasked(QImage &image, const SpanMask &mask)
+{
+  canny(image, mask, EdgeOperator(cbOperator->itemData(cbOperator->currentIndex()).toInt()),
+        sbLow->value(), sbHigh->value());
+}
+
+QSize CannyEdges::halo()
+{
+  return QSize(2, 2);
+}
+
+QByteArray CannyEdges::parameters()
+{
+  QByteArray res;
+  QDataStream s(&res, QIODevice::WriteOnly);
+  s << cbOperator->itemData(cbOperator->currentIndex()).toInt()
+    << sbLow->value() << sbHigh->value();
+  return res;
+}
+
+void CannyEdges::setParameters(const QByteArray &params)
+{
+  QDataStream s(params);
+  int op, low, high;
+  s >> op >> low >> high;
+  cbOperator->setCurrentIndex(cbOperator->findData(op));
+  sbLow->setValue(low);
+  sbHigh->setValue(high);
 }
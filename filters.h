@@ -5,6 +5,9 @@
 #include <QWidget>
 #include <QImage>
 #include "ifilter.h"
+#include "filters/convolution.h"
+#include "filters/edges.h"
+#include "filters/morphology.h"
 
 class QSpinBox;
 class QDoubleSpinBox;
@@ -12,9 +15,13 @@ class QGridLayout;
 class QSlider;
 class QLabel;
 class QComboBox;
+class IntegralImage;
 
-// Get filter instances
-QList<IFilter *> createFilters(QObject *parent);
+// Get filter instances. Filters that measure the image share integral,
+// which the caller keeps invalidated on changes.
+QList<IFilter *> createFilters(QObject *parent, IntegralImage *integral);
+// New instance of the filter named name, 0 if there is none
+IFilter *createFilter(const QString &name, QObject *parent);
 
 
 // Simple filters
@@ -23,10 +30,16 @@ class WhiteBalance: public QObject, public IFilter
 {
     Q_OBJECT
   public:
-    WhiteBalance(QObject *parent) : QObject(parent) {}
+    WhiteBalance(QObject *parent, IntegralImage *integral)
+      : QObject(parent), m_integral(integral) {}
     // reimplemented
     virtual QString filterName() { return tr("White Balance"); }
     virtual void apply(QImage &image, const QRect &rect);
+    virtual void applyMasked(QImage &image, const SpanMask &mask);
+    virtual bool supportsGray() { return true; }
+    virtual void applyPlanar(PlanarImage &image, const QRect &rect);
+  private:
+    IntegralImage *m_integral;
 };
 
 class LumaStretch: public QObject, public IFilter
@@ -37,6 +50,26 @@ class LumaStretch: public QObject, public IFilter
     // reimplemented
     virtual QString filterName() { return tr("Luma Stretch"); }
     virtual void apply(QImage &image, const QRect &rect);
+    virtual void applyMasked(QImage &image, const SpanMask &mask);
+    virtual bool supportsGray() { return true; }
+    virtual void applyPlanar(PlanarImage &image, const QRect &rect);
+};
+
+class AdaptiveEqualize: public QObject, public IFilter
+{
+    Q_OBJECT
+  public:
+    AdaptiveEqualize(QObject *parent);
+    // reimplemented
+    virtual QString filterName() { return tr("Adaptive Equalize"); }
+    virtual void apply(QImage &image, const QRect &rect);
+    virtual void applyMasked(QImage &image, const SpanMask &mask);
+    virtual bool supportsGray() { return true; }
+    virtual QByteArray parameters();
+    virtual void setParameters(const QByteArray &params);
+  private:
+    QSpinBox *sbTiles;
+    QDoubleSpinBox *sbClipLimit;
 };
 
 class RGBStretch: public QObject, public IFilter
@@ -47,6 +80,9 @@ class RGBStretch: public QObject, public IFilter
     // reimplemented
     virtual QString filterName() { return tr("RGB Stretch"); }
     virtual void apply(QImage &image, const QRect &rect);
+    virtual void applyMasked(QImage &image, const SpanMask &mask);
+    virtual bool supportsGray() { return true; }
+    virtual void applyPlanar(PlanarImage &image, const QRect &rect);
 };
 
 // Complex filters
@@ -59,6 +95,15 @@ class GaussianBlur: public QObject, public IFilter
     // reimplemented
     virtual QString filterName() { return tr("Gaussian Blur"); }
     virtual void apply(QImage &image, const QRect &rect);
+    virtual void applyMasked(QImage &image, const SpanMask &mask);
+    virtual bool supportsGray() { return true; }
+    virtual QSize halo();
+    virtual QByteArray parameters();
+    virtual void setParameters(const QByteArray &params);
+    virtual bool isLocal() { return true; }
+    virtual int refinementPasses();
+    virtual void applyCoarse(QImage &image, const SpanMask &mask, int pass);
+    virtual void applyPlanar(PlanarImage &image, const QRect &rect);
   private slots:
     void filterChanged();
   private:
@@ -67,6 +112,24 @@ class GaussianBlur: public QObject, public IFilter
     QLabel *lblVisual;
 };
 
+class BoxBlur: public QObject, public IFilter
+{
+    Q_OBJECT
+  public:
+    BoxBlur(QObject *parent);
+    // reimplemented
+    virtual QString filterName() { return tr("Box Blur"); }
+    virtual void apply(QImage &image, const QRect &rect);
+    virtual void applyMasked(QImage &image, const SpanMask &mask);
+    virtual bool supportsGray() { return true; }
+    virtual QSize halo();
+    virtual QByteArray parameters();
+    virtual void setParameters(const QByteArray &params);
+    virtual bool isLocal() { return true; }
+  private:
+    QSpinBox *sbRadius;
+};
+
 class UnsharpMask: public QObject, public IFilter
 {
     Q_OBJECT
@@ -75,6 +138,14 @@ class UnsharpMask: public QObject, public IFilter
     // reimplemented
     virtual QString filterName() { return tr("Unsharp Mask"); }
     virtual void apply(QImage &image, const QRect &rect);
+    virtual void applyMasked(QImage &image, const SpanMask &mask);
+    virtual bool supportsGray() { return true; }
+    virtual QSize halo();
+    virtual QByteArray parameters();
+    virtual void setParameters(const QByteArray &params);
+    virtual bool isLocal() { return true; }
+    virtual int refinementPasses();
+    virtual void applyPlanar(PlanarImage &image, const QRect &rect);
   private slots:
     void filterChanged();
   private:
@@ -92,10 +163,58 @@ class Median: public QObject, public IFilter
     // reimplemented
     virtual QString filterName() { return tr("Median"); }
     virtual void apply(QImage &image, const QRect &rect);
+    virtual void applyMasked(QImage &image, const SpanMask &mask);
+    virtual bool supportsGray() { return true; }
+    virtual QSize halo();
+    virtual QByteArray parameters();
+    virtual void setParameters(const QByteArray &params);
+    virtual bool isLocal() { return true; }
+    virtual int refinementPasses();
   private:
     QComboBox *cbSize;
 };
 
+class BilateralDenoise: public QObject, public IFilter
+{
+    Q_OBJECT
+  public:
+    BilateralDenoise(QObject *parent);
+    // reimplemented
+    virtual QString filterName() { return tr("Bilateral Denoise"); }
+    virtual void apply(QImage &image, const QRect &rect);
+    virtual void applyMasked(QImage &image, const SpanMask &mask);
+    virtual QSize halo();
+    virtual QByteArray parameters();
+    virtual void setParameters(const QByteArray &params);
+    // Not local: grid cells are placed relative to the image origin, so
+    // a tile copied out of the image would see a shifted grid
+  private:
+    QSpinBox *sbSpace;
+    QSpinBox *sbRange;
+};
+
+class Morphology: public QObject, public IFilter
+{
+    Q_OBJECT
+  public:
+    Morphology(QObject *parent);
+    // reimplemented
+    virtual QString filterName() { return tr("Morphology"); }
+    virtual void apply(QImage &image, const QRect &rect);
+    virtual void applyMasked(QImage &image, const SpanMask &mask);
+    virtual bool supportsGray() { return true; }
+    virtual QSize halo();
+    virtual QByteArray parameters();
+    virtual void setParameters(const QByteArray &params);
+    virtual bool isLocal() { return true; }
+  private:
+    MorphologyOp operation();
+
+    QComboBox *cbOperation;
+    QComboBox *cbWidth;
+    QComboBox *cbHeight;
+};
+
 class MatteGlass: public QObject, public IFilter
 {
     Q_OBJECT
@@ -104,6 +223,14 @@ class MatteGlass: public QObject, public IFilter
     // reimplemented
     virtual QString filterName() { return tr("Matte Glass"); }
     virtual void apply(QImage &image, const QRect &rect);
+    virtual void applyMasked(QImage &image, const SpanMask &mask);
+    virtual bool isCacheable() { return false; }
+    virtual QSize halo();
+    virtual QByteArray parameters();
+    virtual void setParameters(const QByteArray &params);
+    virtual bool isLocal() { return true; }
+    virtual int refinementPasses();
+    virtual void applyCoarse(QImage &image, const SpanMask &mask, int pass);
   private:
     QDoubleSpinBox *sbRadius;
     QSpinBox *sbSamples;
@@ -117,6 +244,12 @@ class Rotate: public QObject, public IFilter
     // reimplemented
     virtual QString filterName() { return tr("Rotate"); }
     virtual void apply(QImage &image, const QRect &rect);
+    virtual bool supportsGray() { return true; }
+    virtual void applyPlanar(PlanarImage &image, const QRect &rect);
+    virtual QRect dirtyRect(const QImage &image, const QRect &) { return image.rect(); }
+    virtual QByteArray parameters();
+    virtual void setParameters(const QByteArray &params);
+    virtual bool resampling(const QRect &rect, Transform &t);
   private:
     QDoubleSpinBox *sbAngle;
 };
@@ -129,6 +262,12 @@ class Scale: public QObject, public IFilter
     // reimplemented
     virtual QString filterName() { return tr("Scale"); }
     virtual void apply(QImage &image, const QRect &rect);
+    virtual bool supportsGray() { return true; }
+    virtual void applyPlanar(PlanarImage &image, const QRect &rect);
+    virtual QRect dirtyRect(const QImage &image, const QRect &) { return image.rect(); }
+    virtual QByteArray parameters();
+    virtual void setParameters(const QByteArray &params);
+    virtual bool resampling(const QRect &rect, Transform &t);
   private:
     QDoubleSpinBox *sbFactor;
 };
@@ -141,12 +280,61 @@ class CustomConvolution: public QObject, public IFilter
     // reimplemented
     virtual QString filterName() { return tr("Convolution"); }
     virtual void apply(QImage &image, const QRect &rect);
+    virtual void applyMasked(QImage &image, const SpanMask &mask);
+    virtual bool supportsGray() { return true; }
+    virtual QSize halo();
+    virtual QByteArray parameters();
+    virtual void setParameters(const QByteArray &params);
+    virtual bool isLocal() { return true; }
+    virtual void applyPlanar(PlanarImage &image, const QRect &rect);
   private slots:
     void updateMatrixSize();
+    void updateKernelInfo();
   private:
+    Matrix<double> matrix() const;
+
     QGridLayout *grid;
     QComboBox *cbSize;
     QLabel *lblMatrixSize;
+    QLabel *lblKernelPath;
+};
+
+class EdgeDetect: public QObject, public IFilter
+{
+    Q_OBJECT
+  public:
+    EdgeDetect(QObject *parent);
+    // reimplemented
+    virtual QString filterName() { return tr("Edge Detection"); }
+    virtual void apply(QImage &image, const QRect &rect);
+    virtual void applyMasked(QImage &image, const SpanMask &mask);
+    virtual bool supportsGray() { return true; }
+    virtual QSize halo();
+    virtual QByteArray parameters();
+    virtual void setParameters(const QByteArray &params);
+    virtual bool isLocal() { return true; }
+  private:
+    QComboBox *cbOperator;
+};
+
+class CannyEdges: public QObject, public IFilter
+{
+    Q_OBJECT
+    // Not local: hysteresis follows edges across the whole selection
+  public:
+    CannyEdges(QObject *parent);
+    // reimplemented
+    virtual QString filterName() { return tr("Canny Edges"); }
+    virtual void apply(QImage &image, const QRect &rect);
+    virtual void applyMasked(QImage &image, const SpanMask &mask);
+    virtual bool supportsGray() { return true; }
+    virtual QSize halo();
+    virtual QByteArray parameters();
+    virtual void setParameters(const QByteArray &params);
+  private:
+    QComboBox *cbOperator;
+    QSpinBox *sbLow;
+    QSpinBox *sbHigh;
 };
 
 #endif // FILTERS_H
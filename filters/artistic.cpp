@@ -1,5 +1,6 @@
 #include "artistic.h"
 #include "rgbv.h"
+#include "scratchpool.h"
 
 // Normal distribution approximation in [-1..1]
 static double rand_n()
@@ -29,11 +30,13 @@ static int variate(int min, int base, int max, int radius)
   return qBound(min, base+d, max);
 }
 
-void glass(QImage &img, const QRect &rect, int radius, int samples)
+template<bool Linear>
+static void glassSpans(QImage &img, const QImage &src, const SpanMask &mask,
+                       int radius, int samples)
 {
-  QImage src = img;
-  for (int y=rect.top(); y<rect.bottom(); y++)
-    for (int x=rect.left(); x<rect.right(); x++)
+  const QVector<Span> &spans = mask.spans();
+  for (int i=0; i<spans.size(); i++)
+    for (int x=spans[i].x1, y=spans[i].y; x<=spans[i].x2; x++)
     {
       RGBV acc;
       double k = 1.0/samples;
@@ -41,9 +44,20 @@ void glass(QImage &img, const QRect &rect, int radius, int samples)
       {
         int px = variate(0, x, img.width()-1, radius);
         int py = variate(0, y, img.height()-1, radius);
-        acc.addk(src.pixel(px, py), k);
+        acc.addk(decodeRGBV<Linear>(src.pixel(px, py)), k);
       }
-      img.setPixel(x, y, acc.toQRgb());
+      img.setPixel(x, y, encodeRGBV<Linear>(acc));
     }
 }
 
+void glass(QImage &img, const SpanMask &mask, int radius, int samples, bool linear)
+{
+  // Samples stay within radius of the selection: only that is copied
+  QRect input = mask.boundingRect().adjusted(-radius, -radius, radius, radius);
+  ScratchImage scratch(img, input, "glass source");
+  if (linear)
+    glassSpans<true>(img, scratch.image(), mask, radius, samples);
+  else
+    glassSpans<false>(img, scratch.image(), mask, radius, samples);
+}
+
@@ -2,7 +2,9 @@
 #define ARTISTIC_H
 
 #include <QImage>
+#include "spanmask.h"
 
-void glass(QImage &img, const QRect &rect, int radius, int samples);
+// linear: blend in linear light, see srgb.h
+void glass(QImage &img, const SpanMask &mask, int radius, int samples, bool linear = false);
 
 #endif // ARTISTIC_H
@@ -1,70 +1,424 @@
+#include <cmath>
 #include "colorcorrect.h"
 #include "rgbv.h"
+#include "pixelformat.h"
 #include "histogram.h"
+#include "planar.h"
+#include "integral.h"
+#include "tuning.h"
 
-void whitebalance(QImage &img, const QRect &rect)
+void whitebalance(QImage &img, const SpanMask &mask, IntegralImage *integral)
 {
   RGBV mean(0.1, 0.1, 0.1); // Avoid zero division
-  
-  // Measure
-  for (int y=rect.top(); y<=rect.bottom(); y++)
-    for (int x=rect.left(); x<=rect.right(); x++)
-      mean.add(img.pixel(x, y));
+  const QVector<Span> &spans = mask.spans();
+
+  // Measure. Building the tables would cost more than a scan of the
+  // selection: they are only used if up to date.
+  if (integral && integral->isFresh(img, mask.boundingRect()))
+  {
+    mean.r += integral->sum(IntegralImage::Red, mask)/255.0;
+    mean.g += integral->sum(IntegralImage::Green, mask)/255.0;
+    mean.b += integral->sum(IntegralImage::Blue, mask)/255.0;
+  }
+  else
+    for (int i=0; i<spans.size(); i++)
+      for (int x=spans[i].x1; x<=spans[i].x2; x++)
+        mean.add(img.pixel(x, spans[i].y));
   
   double avg = (mean.r + mean.g + mean.b)/3;
   RGBV k(avg/mean.r, avg/mean.g, avg/mean.b);
 
-  // Adjust
-  for (int y=rect.top(); y<=rect.bottom(); y++)
-    for (int x=rect.left(); x<=rect.right(); x++)
+  // Adjust. Gray pixels have equal means, so they stay gray.
+  bool gray = isGray(img);
+  for (int i=0; i<spans.size(); i++)
+    for (int x=spans[i].x1, y=spans[i].y; x<=spans[i].x2; x++)
     {
       RGBV p(img.pixel(x, y));
       p.mulv(k);
       p.clamp();
-      img.setPixel(x, y, p.toQRgb());
+      if (gray)
+        img.scanLine(y)[x] = qRed(p.toQRgb());
+      else
+        img.setPixel(x, y, p.toQRgb());
     }
 }
 
-void luma_stretch(QImage &img, const QRect &rect)
+void luma_stretch(QImage &img, const SpanMask &mask)
 {
   int qmin, qmax;
-  makeHistogram(img, rect, getLuma, 256, &qmin, &qmax);
+  makeHistogram(img, mask, getLuma, 256, &qmin, &qmax);
 
   double ymin = qmin/255.0;
   double k = qmax==qmin? 1.0 : 255.0/(qmax-qmin);
 
-  for (int y=rect.top(); y<=rect.bottom(); y++)
-    for (int x=rect.left(); x<=rect.right(); x++)
+  // Gray pixels stay gray: write back the level rather than the color
+  bool gray = isGray(img);
+  const QVector<Span> &spans = mask.spans();
+  for (int i=0; i<spans.size(); i++)
+    for (int x=spans[i].x1, y=spans[i].y; x<=spans[i].x2; x++)
     {
       RGBV c(img.pixel(x, y));
       double yval = getLuma(img.pixel(x, y)); // Current luminance
       double ytgt = (yval - ymin)*k; // Target luminance
       c.mul(ytgt/yval);
       c.clamp();
-      img.setPixel(x, y, c.toQRgb());
+      if (gray)
+        img.scanLine(y)[x] = qRed(c.toQRgb());
+      else
+        img.setPixel(x, y, c.toQRgb());
     }
 }
 
-void rgb_stretch(QImage &img, const QRect &rect)
+void rgb_stretch(QImage &img, const SpanMask &mask)
 {
   int rmin, rmax;
   int gmin, gmax;
   int bmin, bmax;
-  makeHistogram(img, rect, getRed,   256, &rmin, &rmax);
-  makeHistogram(img, rect, getGreen, 256, &gmin, &gmax);
-  makeHistogram(img, rect, getBlue,  256, &bmin, &bmax);
+  makeHistogram(img, mask, getRed,   256, &rmin, &rmax);
+  makeHistogram(img, mask, getGreen, 256, &gmin, &gmax);
+  makeHistogram(img, mask, getBlue,  256, &bmin, &bmax);
 
   RGBV lo(rmin/255.0, gmin/255.0, bmin/255.0);
   RGBV stretch(rmax==rmin? 1.0 : 255.0/(rmax-rmin),
                gmax==gmin? 1.0 : 255.0/(gmax-gmin),
                bmax==bmin? 1.0 : 255.0/(bmax-bmin));
-  for (int y=rect.top(); y<=rect.bottom(); y++)
-    for (int x=rect.left(); x<=rect.right(); x++)
+
+  // Gray pixels get the same stretch in every channel
+  bool gray = isGray(img);
+  const QVector<Span> &spans = mask.spans();
+  for (int i=0; i<spans.size(); i++)
+    for (int x=spans[i].x1, y=spans[i].y; x<=spans[i].x2; x++)
     {
       RGBV c(img.pixel(x, y));
       c.addk(lo, -1);
       c.mulv(stretch);
       c.clamp();
-      img.setPixel(x, y, c.toQRgb());
+      if (gray)
+        img.scanLine(y)[x] = qRed(c.toQRgb());
+      else
+        img.setPixel(x, y, c.toQRgb());
+    }
+}
+
+// ==========
+
+// Tiles of an adaptive equalization over bounds. The last row and
+// column of tiles may be smaller.
+struct ClaheGrid
+{
+    QRect bounds;
+    int columns, rows;
+    int tileWidth, tileHeight;
+    double clipLimit;
+    // Per tile, row-major: luma level -> equalized luma level
+    QVector<uchar> luts;
+};
+
+// Tile of the histogram pass, or spans [first, last) of the mapping pass
+struct ClaheJob
+{
+    ClaheGrid *grid;
+    QImage *img;
+    const SpanMask *mask;
+    int tile;
+    const Span *spans;
+    // Per column of bounds: left tile of the blend, right tile weight
+    const int *tileX;
+    const float *weightX;
+    bool gray;
+    int first, last;
+};
+
+// Clip the bins to limit and spread the excess evenly over all of them
+static void clipHistogram(qint64 *bins, qint64 limit)
+{
+  qint64 excess = 0;
+  for (int b=0; b<ImageHistogram::bins; b++)
+    if (bins[b] > limit)
+    {
+      excess += bins[b] - limit;
+      bins[b] = limit;
+    }
+
+  qint64 each = excess/ImageHistogram::bins;
+  int rest = excess % ImageHistogram::bins;
+  for (int b=0; b<ImageHistogram::bins; b++)
+    bins[b] += each;
+  for (int i=0; i<rest; i++)
+    bins[i*ImageHistogram::bins/rest]++;
+}
+
+static void claheTile(ClaheJob &job)
+{
+  ClaheGrid &g = *job.grid;
+  QRect tile(g.bounds.left() + job.tile % g.columns * g.tileWidth,
+             g.bounds.top() + job.tile / g.columns * g.tileHeight,
+             g.tileWidth, g.tileHeight);
+
+  ImageHistogram hist;
+  hist.add(*job.img, job.mask->intersected(tile & g.bounds));
+  uchar *lut = g.luts.data() + job.tile*ImageHistogram::bins;
+  qint64 total = hist.total();
+  if (total == 0)
+  {
+    // Nothing selected here: leave the levels as they are
+    for (int b=0; b<ImageHistogram::bins; b++)
+      lut[b] = b;
+    return;
+  }
+
+  qint64 bins[ImageHistogram::bins];
+  for (int b=0; b<ImageHistogram::bins; b++)
+    bins[b] = hist.count(ImageHistogram::Luma, b);
+  clipHistogram(bins, qMax<qint64>(1, qint64(g.clipLimit*total/ImageHistogram::bins)));
+
+  qint64 cdf = 0;
+  for (int b=0; b<ImageHistogram::bins; b++)
+  {
+    cdf += bins[b];
+    lut[b] = uchar(qMin<qint64>(255, (cdf*255 + total/2)/total));
+  }
+}
+
+// Tile to the left of or above a pixel at offset v, and the weight of
+// the next one: pixels blend between the centers of the nearest tiles
+static inline void claheNeighbor(int v, int size, int count, int *tile, float *weight)
+{
+  float f = (v + 0.5f)/size - 0.5f;
+  int i = int(floor(f));
+  if (i < 0)
+  {
+    *tile = 0;
+    *weight = 0;
+  }
+  else if (i >= count-1)
+  {
+    *tile = count-1;
+    *weight = 0;
+  }
+  else
+  {
+    *tile = i;
+    *weight = f - i;
+  }
+}
+
+static void claheMap(ClaheJob &job)
+{
+  const ClaheGrid &g = *job.grid;
+  const int bins = ImageHistogram::bins;
+  for (int i=job.first; i<job.last; i++)
+  {
+    const Span &s = job.spans[i];
+    int ty;
+    float wy;
+    claheNeighbor(s.y - g.bounds.top(), g.tileHeight, g.rows, &ty, &wy);
+    const uchar *top = g.luts.constData() + ty*g.columns*bins;
+    const uchar *bottom = wy > 0 ? top + g.columns*bins : top;
+    uchar *line = job.gray ? job.img->scanLine(s.y) : 0;
+
+    for (int x=s.x1; x<=s.x2; x++)
+    {
+      QRgb c = line ? 0 : job.img->pixel(x, s.y);
+      int luma = line ? line[x] : lumaLevel(c);
+      int tx = job.tileX[x - g.bounds.left()];
+      float wx = job.weightX[x - g.bounds.left()];
+      int right = wx > 0 ? bins : 0;
+      const uchar *l = top + tx*bins + luma;
+      const uchar *r = bottom + tx*bins + luma;
+      float upper = l[0] + wx*(l[right] - l[0]);
+      float lower = r[0] + wx*(r[right] - r[0]);
+      float target = upper + wy*(lower - upper);
+      if (line)
+      {
+        line[x] = uchar(target + 0.5f);
+        continue;
+      }
+
+      // Keep the hue as luma_stretch() does: scale all channels
+      QRgb res;
+      if (luma == 0)
+        res = qRgb(int(target + 0.5f), int(target + 0.5f), int(target + 0.5f));
+      else
+      {
+        float k = target/luma;
+        res = qRgb(qMin(255, int(qRed(c)*k + 0.5f)),
+                   qMin(255, int(qGreen(c)*k + 0.5f)),
+                   qMin(255, int(qBlue(c)*k + 0.5f)));
+      }
+      job.img->setPixel(x, s.y, res);
+    }
+  }
+}
+
+void clahe(QImage &img, const SpanMask &mask, int tiles, double clipLimit)
+{
+  if (mask.isEmpty())
+    return;
+
+  ClaheGrid g;
+  g.bounds = mask.boundingRect();
+  g.columns = qBound(1, tiles, g.bounds.width());
+  g.rows = qBound(1, tiles, g.bounds.height());
+  g.tileWidth = (g.bounds.width() + g.columns-1)/g.columns;
+  g.tileHeight = (g.bounds.height() + g.rows-1)/g.rows;
+  g.columns = (g.bounds.width() + g.tileWidth-1)/g.tileWidth;
+  g.rows = (g.bounds.height() + g.tileHeight-1)/g.tileHeight;
+  g.clipLimit = clipLimit;
+  g.luts.resize(g.columns*g.rows*ImageHistogram::bins);
+
+  QVector<int> tileX(g.bounds.width());
+  QVector<float> weightX(g.bounds.width());
+  for (int x=0; x<g.bounds.width(); x++)
+    claheNeighbor(x, g.tileWidth, g.columns, &tileX[x], &weightX[x]);
+
+  ClaheJob job;
+  job.grid = &g;
+  job.img = &img;
+  job.mask = &mask;
+  job.spans = mask.spans().constData();
+  job.tileX = tileX.constData();
+  job.weightX = weightX.constData();
+  job.gray = isGray(img);
+
+  // One histogram pass, tiles in parallel
+  QVector<ClaheJob> jobs(g.columns*g.rows, job);
+  for (int i=0; i<jobs.size(); i++)
+    jobs[i].tile = i;
+  runJobs(jobs, claheTile);
+
+  // One mapping pass, bands of spans in parallel
+  runBands(img, spanBands(mask.spans()), job, claheMap);
+}
+
+// ==========
+
+// Luma histogram of a planar region, same binning as makeHistogram()
+static void lumaQuantiles(const PlanarImage &img, const QRect &rect,
+                          int *qmin, int *qmax)
+{
+  QVector<double> stats(256, 0);
+  QVector<float> luma(rect.width());
+  for (int y=rect.top(); y<=rect.bottom(); y++)
+  {
+    const float *r = img.line(PlanarImage::Red, y) + rect.left();
+    const float *g = img.line(PlanarImage::Green, y) + rect.left();
+    const float *b = img.line(PlanarImage::Blue, y) + rect.left();
+    float *l = luma.data();
+    int n = rect.width();
+    for (int x=0; x<n; x++)
+      l[x] = 0.2125f*r[x] + 0.7154f*g[x] + 0.0721f*b[x]; // BT.709
+    for (int x=0; x<n; x++)
+      stats[qBound(0, int(l[x]*255), 255)] += 1;
+  }
+
+  double k = 1.0/(rect.width()*rect.height());
+  for (int p=0; p<256; p++)
+    stats[p] *= k;
+
+  findQuantiles(stats, qmin, qmax);
+}
+
+static void planeQuantiles(const PlanarImage &img, int plane, const QRect &rect,
+                           int *qmin, int *qmax)
+{
+  QVector<double> stats(256, 0);
+  for (int y=rect.top(); y<=rect.bottom(); y++)
+  {
+    const float *v = img.line(plane, y);
+    for (int x=rect.left(); x<=rect.right(); x++)
+      stats[qBound(0, int(v[x]*255), 255)] += 1;
+  }
+
+  double k = 1.0/(rect.width()*rect.height());
+  for (int p=0; p<256; p++)
+    stats[p] *= k;
+
+  findQuantiles(stats, qmin, qmax);
+}
+
+// out = clamp((in - lo) * k)
+static void stretchPlane(PlanarImage &img, int plane, const QRect &rect,
+                         float lo, float k)
+{
+  for (int y=rect.top(); y<=rect.bottom(); y++)
+  {
+    float *v = img.line(plane, y) + rect.left();
+    int n = rect.width();
+    for (int x=0; x<n; x++)
+      v[x] = qBound(0.0f, (v[x] - lo)*k, 1.0f);
+  }
+}
+
+void whitebalance(PlanarImage &img, const QRect &rect)
+{
+  QRect r = rect & img.rect();
+  if (r.isEmpty())
+    return;
+
+  // Measure
+  double mean[3] = { 0.1, 0.1, 0.1 }; // Avoid zero division
+  for (int p=PlanarImage::Red; p<=PlanarImage::Blue; p++)
+    for (int y=r.top(); y<=r.bottom(); y++)
+    {
+      const float *v = img.line(p, y) + r.left();
+      int n = r.width();
+      float sum = 0;
+      for (int x=0; x<n; x++)
+        sum += v[x];
+      mean[p] += sum;
+    }
+
+  // Adjust
+  double avg = (mean[0] + mean[1] + mean[2])/3;
+  for (int p=PlanarImage::Red; p<=PlanarImage::Blue; p++)
+    stretchPlane(img, p, r, 0, avg/mean[p]);
+  img.fill(PlanarImage::Alpha, r, 1.0f);
+}
+
+void luma_stretch(PlanarImage &img, const QRect &rect)
+{
+  QRect r = rect & img.rect();
+  if (r.isEmpty())
+    return;
+
+  int qmin, qmax;
+  lumaQuantiles(img, r, &qmin, &qmax);
+
+  float ymin = qmin/255.0f;
+  float k = qmax==qmin? 1.0f : 255.0f/(qmax-qmin);
+
+  for (int y=r.top(); y<=r.bottom(); y++)
+  {
+    float *red = img.line(PlanarImage::Red, y) + r.left();
+    float *green = img.line(PlanarImage::Green, y) + r.left();
+    float *blue = img.line(PlanarImage::Blue, y) + r.left();
+    int n = r.width();
+    for (int x=0; x<n; x++)
+    {
+      float yval = 0.2125f*red[x] + 0.7154f*green[x] + 0.0721f*blue[x]; // Current luminance
+      float ytgt = (yval - ymin)*k; // Target luminance
+      float s = yval > 0? ytgt/yval : 0.0f;
+      red[x]   = qBound(0.0f, red[x]*s,   1.0f);
+      green[x] = qBound(0.0f, green[x]*s, 1.0f);
+      blue[x]  = qBound(0.0f, blue[x]*s,  1.0f);
     }
+  }
+  img.fill(PlanarImage::Alpha, r, 1.0f);
+}
+
+void rgb_stretch(PlanarImage &img, const QRect &rect)
+{
+  QRect r = rect & img.rect();
+  if (r.isEmpty())
+    return;
+
+  for (int p=PlanarImage::Red; p<=PlanarImage::Blue; p++)
+  {
+    int qmin, qmax;
+    planeQuantiles(img, p, r, &qmin, &qmax);
+    stretchPlane(img, p, r, qmin/255.0f,
+                 qmax==qmin? 1.0f : 255.0f/(qmax-qmin));
+  }
+  img.fill(PlanarImage::Alpha, r, 1.0f);
 }
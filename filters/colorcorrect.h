@@ -2,10 +2,27 @@
 #define COLORCORRECT_H
 
 #include <QImage>
+#include "spanmask.h"
 
-void whitebalance(QImage &img, const QRect &rect);
-void luma_stretch(QImage &img, const QRect &rect);
-void rgb_stretch(QImage &img, const QRect &rect);
+class PlanarImage;
+class IntegralImage;
+
+// Measures through integral if it is given and up to date with img over
+// the selection, else scans the selection
+void whitebalance(QImage &img, const SpanMask &mask, IntegralImage *integral = 0);
+void luma_stretch(QImage &img, const SpanMask &mask);
+void rgb_stretch(QImage &img, const SpanMask &mask);
+
+/* Contrast limited adaptive histogram equalization of luma. The selection
+ * is split into tiles x tiles tiles; the luma histogram of each, clipped
+ * at clipLimit times the mean bin, gives a mapping, and pixels blend the
+ * mappings of the four nearest tile centers.
+ */
+void clahe(QImage &img, const SpanMask &mask, int tiles, double clipLimit);
+
+void whitebalance(PlanarImage &img, const QRect &rect);
+void luma_stretch(PlanarImage &img, const QRect &rect);
+void rgb_stretch(PlanarImage &img, const QRect &rect);
 
 #endif // COLORCORRECT_H
 
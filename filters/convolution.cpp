@@ -1,41 +1,594 @@
 #include <cmath>
+#include <cstring>
+#include <algorithm>
 #include <QtAlgorithms>
+#include <QVector>
 
 #include "convolution.h"
 #include "rgbv.h"
+#include "pixelformat.h"
+#include "planar.h"
+#include "integral.h"
+#include "scratchpool.h"
+#include "tuning.h"
 
-static QImage grow(const QImage &img, int size)
+QSize grownSize(const QImage &img, int size)
 {
-  QImage res(img.width() + size*2, img.height() + size*2, img.format());
+  return QSize(img.width() + size*2, img.height() + size*2);
+}
+
+void grow(const QImage &img, int size, QImage &res)
+{
+  if (img.depth() != 32 && img.depth() != 8)
+  {
+    for (int y=0; y<res.height(); y++)
+      for (int x=0; x<res.width(); x++)
+      {
+        int ox = qBound(0, x-size, img.width()-1);
+        int oy = qBound(0, y-size, img.height()-1);
+        res.setPixel(x, y, img.pixel(ox, oy));
+      }
+    return;
+  }
+
+  if (img.format() == QImage::Format_Indexed8)
+    res.setColorTable(img.colorTable());
+  int w = img.width();
+  int bpp = img.depth()/8;
   for (int y=0; y<res.height(); y++)
-    for (int x=0; x<res.width(); x++)
+  {
+    const uchar *src = img.constScanLine(qBound(0, y-size, img.height()-1));
+    uchar *dst = res.scanLine(y);
+    for (int x=0; x<size; x++)
     {
-      int ox = qBound(0, x-size, img.width()-1);
-      int oy = qBound(0, y-size, img.height()-1);
-      res.setPixel(x, y, img.pixel(ox, oy));
+      memcpy(dst + x*bpp, src, bpp);
+      memcpy(dst + (size + w + x)*bpp, src + (w-1)*bpp, bpp);
     }
-  return res;
+    memcpy(dst + size*bpp, src, w*bpp);
+  }
 }
 
-static QRgb apply(const QImage &img, const Matrix<double> &m, int x, int y)
+// ==========
+// Kernel analysis
+
+static const double epsilon = 1e-9;
+
+/* One-sided Jacobi SVD of m (rows: y, columns: x).
+ * On return a's columns are u_k*sigma_k and v holds the right vectors,
+ * so that m(x, y) = sum_k a[y][k]*v[x][k].
+ */
+static void jacobiSVD(const Matrix<double> &m,
+                      QVector<double> &a, QVector<double> &v)
 {
-  RGBV acc;
-  int size = (m.size()-1)/2;
+  int n = m.size();
+  a = QVector<double>(n*n);
+  v = QVector<double>(n*n, 0);
+  for (int y=0; y<n; y++)
+    for (int x=0; x<n; x++)
+      a[y*n + x] = m.at(x, y);
+  for (int i=0; i<n; i++)
+    v[i*n + i] = 1;
+
+  for (int sweep=0; sweep<30; sweep++)
+  {
+    bool rotated = false;
+    for (int p=0; p<n-1; p++)
+      for (int q=p+1; q<n; q++)
+      {
+        double alpha = 0, beta = 0, gamma = 0;
+        for (int i=0; i<n; i++)
+        {
+          alpha += a[i*n + p]*a[i*n + p];
+          beta  += a[i*n + q]*a[i*n + q];
+          gamma += a[i*n + p]*a[i*n + q];
+        }
+        if (fabs(gamma) <= epsilon*sqrt(alpha*beta) || gamma == 0)
+          continue;
+
+        rotated = true;
+        double zeta = (beta - alpha)/(2*gamma);
+        double t = (zeta >= 0? 1.0 : -1.0)/(fabs(zeta) + sqrt(1 + zeta*zeta));
+        double c = 1/sqrt(1 + t*t);
+        double s = c*t;
+        for (int i=0; i<n; i++)
+        {
+          double ap = a[i*n + p], aq = a[i*n + q];
+          a[i*n + p] = c*ap - s*aq;
+          a[i*n + q] = s*ap + c*aq;
+          double vp = v[i*n + p], vq = v[i*n + q];
+          v[i*n + p] = c*vp - s*vq;
+          v[i*n + q] = s*vp + c*vq;
+        }
+      }
+    if (!rotated)
+      break;
+  }
+}
+
+// Try to factor m into column*row^T
+static bool factorSeparable(const Matrix<double> &m,
+                            QVector<double> &row, QVector<double> &column)
+{
+  int n = m.size();
+  QVector<double> a, v;
+  jacobiSVD(m, a, v);
+
+  // Singular values are the column norms of a
+  QVector<double> sigma(n, 0);
+  int k1 = 0;
+  for (int k=0; k<n; k++)
+  {
+    for (int i=0; i<n; i++)
+      sigma[k] += a[i*n + k]*a[i*n + k];
+    sigma[k] = sqrt(sigma[k]);
+    if (sigma[k] > sigma[k1])
+      k1 = k;
+  }
+  if (sigma[k1] <= epsilon)
+    return false;
+  for (int k=0; k<n; k++)
+    if (k != k1 && sigma[k] > 1e-7*sigma[k1])
+      return false;
+
+  row = QVector<double>(n);
+  column = QVector<double>(n);
+  for (int i=0; i<n; i++)
+  {
+    column[i] = a[i*n + k1];
+    row[i] = v[i*n + k1];
+  }
+  return true;
+}
+
+// Find the smallest shift making all weights integers
+static bool factorInteger(const QVector<KernelTap> &taps,
+                          QVector<int> &weights, int &shift)
+{
+  static const int maxShift = 16;
+  for (shift=0; shift<=maxShift; shift++)
+  {
+    double k = 1 << shift;
+    double sum = 0;
+    bool exact = true;
+    for (int i=0; i<taps.size() && exact; i++)
+    {
+      double w = taps[i].weight*k;
+      exact = fabs(w - floor(w + 0.5)) <= epsilon*qMax(1.0, fabs(w));
+      sum += fabs(w);
+    }
+    if (!exact)
+      continue;
+    // Accumulator must not overflow on 8-bit input
+    if (sum*255 >= 2147483647.0)
+      return false;
+
+    weights = QVector<int>(taps.size());
+    for (int i=0; i<taps.size(); i++)
+      weights[i] = int(floor(taps[i].weight*k + 0.5));
+    return true;
+  }
+  return false;
+}
+
+KernelInfo analyzeKernel(const Matrix<double> &m)
+{
+  KernelInfo info;
+  info.size = m.size();
+  info.shift = 0;
+
+  int hsize = (m.size()-1)/2;
   for (int dy=0; dy<m.size(); dy++)
     for (int dx=0; dx<m.size(); dx++)
-      acc.addk(img.pixel(x+dx-size, y+dy-size), m.at(dx, dy));
-  acc.clamp();
-  return acc.toQRgb();
+      if (m.at(dx, dy) != 0)
+      {
+        KernelTap tap = { dx-hsize, dy-hsize, m.at(dx, dy) };
+        info.taps.append(tap);
+      }
+  info.nonZero = info.taps.size();
+
+  // Prefer the fewest multiplications; integer taps are exact and cheap.
+  // Below the tuned size the 2D loops beat the two passes anyway.
+  bool separable = m.size() > 1 && m.size() >= tuning().separableMinSize &&
+                   factorSeparable(m, info.row, info.column);
+  if (separable && 2*m.size() < info.nonZero)
+  {
+    info.path = KernelInfo::Separable;
+    info.cost = 2*m.size();
+  }
+  else if (factorInteger(info.taps, info.intWeights, info.shift))
+  {
+    info.path = KernelInfo::Integer;
+    info.cost = info.nonZero;
+  }
+  else
+  {
+    info.path = info.nonZero < m.size()*m.size()? KernelInfo::Sparse
+                                                 : KernelInfo::Dense;
+    info.cost = info.nonZero;
+    info.shift = 0;
+  }
+  return info;
 }
 
-void convolve(QImage &img, const QRect &rect, const Matrix<double> &m)
+// ==========
+// Evaluation paths. All of them read the padded copy made by grow(), of
+// gray images for Channels = 1 and of 32-bit ones for Channels = 3.
+
+template<int Channels>
+static inline const typename Pixels<Channels>::Type *pixelAt(const QImage &img, int x, int y)
 {
+  return constPixelLine<Channels>(img, y) + x;
+}
+
+// Spans [first, last) of a convolution, or rows [first, last) of the
+// bounding rect plus halo for the row pass of the separable path
+struct ConvolveJob
+{
+    QImage *img;
+    const QImage *tmp;
+    int hsize;
+    const KernelInfo *info;
+    const Span *spans;
+    // Separable: row pass results, one plane per channel used
+    QRect bounds;
+    float *planes[3];
+    int first, last;
+};
+
+template<bool Linear, int Channels>
+static void convolveTaps(ConvolveJob &job)
+{
+  typedef Pixels<Channels> P;
+  const QVector<KernelTap> &taps = job.info->taps;
+  int hsize = job.hsize;
+  for (int i=job.first; i<job.last; i++)
+  {
+    int y = job.spans[i].y;
+    typename P::Type *dst = pixelLine<Channels>(*job.img, y);
+    for (int x=job.spans[i].x1; x<=job.spans[i].x2; x++)
+    {
+      double acc[Channels];
+      for (int c=0; c<Channels; c++)
+        acc[c] = 0;
+      for (int t=0; t<taps.size(); t++)
+      {
+        typename P::Type p = *pixelAt<Channels>(*job.tmp, x+hsize+taps[t].dx, y+hsize+taps[t].dy);
+        for (int c=0; c<Channels; c++)
+          acc[c] += decodeUnit<Linear>(P::level(p, c)) * taps[t].weight;
+      }
+      int v[Channels];
+      for (int c=0; c<Channels; c++)
+        v[c] = encodeUnit<Linear>(qBound(0.0, acc[c], 1.0));
+      dst[x] = P::pack(v);
+    }
+  }
+}
+
+template<int N>
+static FixedKernel<N> fixedKernel(const KernelInfo &info)
+{
+  FixedKernel<N> k;
+  int hsize = FixedKernel<N>::HalfSize;
+  for (int t=0; t<info.taps.size(); t++)
+    k.set(info.taps[t].dx + hsize, info.taps[t].dy + hsize, info.taps[t].weight);
+  return k;
+}
+
+// Accumulated channel back to 8 bits: encoded levels are truncated like
+// the double paths, linear values rounded to the nearest level
+template<bool Linear>
+static inline int encodeLevel(float v)
+{
+  return Linear ? fromLinear(int(v + 0.5f)) : qBound(0, int(v), 255);
+}
+
+// Fully unrolled dense kernel for N = 3, 5, 7
+template<int N, bool Linear, int Channels>
+static void convolveFixed(ConvolveJob &job)
+{
+  typedef Pixels<Channels> P;
+  FixedKernel<N> k = fixedKernel<N>(*job.info);
+  int hsize = job.hsize;
+  for (int i=job.first; i<job.last; i++)
+  {
+    int y = job.spans[i].y;
+    const typename P::Type *rows[N];
+    for (int dy=0; dy<N; dy++)
+      rows[dy] = pixelAt<Channels>(*job.tmp, hsize - FixedKernel<N>::HalfSize,
+                                   y + hsize - FixedKernel<N>::HalfSize + dy);
+    typename P::Type *dst = pixelLine<Channels>(*job.img, y);
+
+    for (int x=job.spans[i].x1; x<=job.spans[i].x2; x++)
+    {
+      float acc[Channels];
+      for (int c=0; c<Channels; c++)
+        acc[c] = 0;
+      for (int dy=0; dy<N; dy++)
+        for (int dx=0; dx<N; dx++)
+        {
+          typename P::Type p = rows[dy][x+dx];
+          float w = k.at(dx, dy);
+          for (int c=0; c<Channels; c++)
+            acc[c] += w*decodeLevel<Linear>(P::level(p, c));
+        }
+      int v[Channels];
+      for (int c=0; c<Channels; c++)
+        v[c] = encodeLevel<Linear>(acc[c]);
+      dst[x] = P::pack(v);
+    }
+  }
+}
+
+// Sums of the integer path: 16-bit linear values overflow 32 bits with
+// the larger weights
+template<bool Linear> struct IntegerSum { typedef int Type; };
+template<> struct IntegerSum<true> { typedef qint64 Type; };
+
+template<bool Linear, int Channels>
+static void convolveInteger(ConvolveJob &job)
+{
+  typedef typename IntegerSum<Linear>::Type Sum;
+  typedef Pixels<Channels> P;
+  const KernelInfo &info = *job.info;
+  const QVector<KernelTap> &taps = info.taps;
+  const int *w = info.intWeights.constData();
+  int hsize = job.hsize;
+  // Linear values are rounded to the nearest
+  Sum half = Linear ? (Sum(1) << info.shift) >> 1 : 0;
+  for (int i=job.first; i<job.last; i++)
+  {
+    int y = job.spans[i].y;
+    typename P::Type *dst = pixelLine<Channels>(*job.img, y);
+    for (int x=job.spans[i].x1; x<=job.spans[i].x2; x++)
+    {
+      Sum acc[Channels];
+      for (int c=0; c<Channels; c++)
+        acc[c] = 0;
+      for (int t=0; t<taps.size(); t++)
+      {
+        typename P::Type p = *pixelAt<Channels>(*job.tmp, x+hsize+taps[t].dx, y+hsize+taps[t].dy);
+        for (int c=0; c<Channels; c++)
+          acc[c] += Sum(w[t])*decodeLevel<Linear>(P::level(p, c));
+      }
+      // Arithmetic shift floors, as the double path truncates after clamping
+      int v[Channels];
+      for (int c=0; c<Channels; c++)
+        v[c] = Linear ? fromLinear(int(qBound<Sum>(0, (acc[c] + half) >> info.shift, 65535)))
+                      : int(qBound<Sum>(0, acc[c] >> info.shift, 255));
+      dst[x] = P::pack(v);
+    }
+  }
+}
+
+template<bool Linear, int Channels>
+static void separableRows(ConvolveJob &job)
+{
+  typedef Pixels<Channels> P;
+  const KernelInfo &info = *job.info;
+  int n = info.size;
+  int bw = job.bounds.width();
+  for (int ty=job.first; ty<job.last; ty++)
+  {
+    const typename P::Type *src = pixelAt<Channels>(*job.tmp, job.bounds.left(),
+                                                    job.bounds.top() + ty);
+    for (int x=0; x<bw; x++)
+    {
+      double acc[Channels];
+      for (int c=0; c<Channels; c++)
+        acc[c] = 0;
+      for (int k=0; k<n; k++)
+        for (int c=0; c<Channels; c++)
+          acc[c] += info.row[k]*decodeLevel<Linear>(P::level(src[x+k], c));
+      for (int c=0; c<Channels; c++)
+        job.planes[c][ty*bw + x] = acc[c];
+    }
+  }
+}
+
+// Column pass at selected pixels only
+template<bool Linear, int Channels>
+static void separableColumns(ConvolveJob &job)
+{
+  typedef Pixels<Channels> P;
+  const KernelInfo &info = *job.info;
+  int n = info.size;
+  int bw = job.bounds.width();
+  double scale = Linear ? 65535.0 : 255.0;
+  for (int i=job.first; i<job.last; i++)
+  {
+    int y = job.spans[i].y;
+    typename P::Type *dst = pixelLine<Channels>(*job.img, y);
+    for (int x=job.spans[i].x1; x<=job.spans[i].x2; x++)
+    {
+      int offset = (y - job.bounds.top())*bw + x - job.bounds.left();
+      double acc[Channels];
+      for (int c=0; c<Channels; c++)
+        acc[c] = 0;
+      for (int k=0; k<n; k++)
+      {
+        double w = info.column[k]/scale;
+        for (int c=0; c<Channels; c++)
+          acc[c] += w*job.planes[c][offset + k*bw];
+      }
+      int v[Channels];
+      for (int c=0; c<Channels; c++)
+        v[c] = encodeUnit<Linear>(qBound(0.0, acc[c], 1.0));
+      dst[x] = P::pack(v);
+    }
+  }
+}
+
+typedef void (*ConvolveFn)(ConvolveJob &);
+
+template<bool Linear, int Channels>
+static void convolvePaths(ConvolveJob &job, const SpanMask &mask)
+{
+  const KernelInfo &info = *job.info;
+  QVector<Band> bands = spanBands(mask.spans());
+  ConvolveFn fn;
+
+  switch (info.path)
+  {
+  case KernelInfo::Separable:
+    {
+      // Row pass over the bounding rect plus vertical halo
+      job.bounds = mask.boundingRect();
+      int bw = job.bounds.width();
+      int bh = job.bounds.height() + 2*job.hsize;
+      ScratchFloats planes[Channels];
+      for (int c=0; c<Channels; c++)
+      {
+        planes[c].resize(bw*bh);
+        job.planes[c] = planes[c].data();
+      }
+      runBands(rowBands(0, bh-1), job, separableRows<Linear, Channels>);
+      runBands(*job.img, bands, job, separableColumns<Linear, Channels>);
+    }
+    return;
+  case KernelInfo::Integer:
+    fn = convolveInteger<Linear, Channels>;
+    break;
+  case KernelInfo::Sparse:
+    // Only the non-zero taps: what analyzeKernel() counted
+    fn = convolveTaps<Linear, Channels>;
+    break;
+  default:
+    // Straight-line code for the common small sizes
+    if (info.size == 3)
+      fn = convolveFixed<3, Linear, Channels>;
+    else if (info.size == 5)
+      fn = convolveFixed<5, Linear, Channels>;
+    else if (info.size == 7)
+      fn = convolveFixed<7, Linear, Channels>;
+    else
+      fn = convolveTaps<Linear, Channels>;
+  }
+  runBands(*job.img, bands, job, fn);
+}
+
+void convolve(QImage &img, const SpanMask &mask, const KernelInfo &info, bool linear)
+{
+  if (mask.isEmpty())
+    return;
+
+  int hsize = (info.size-1)/2;
+  ScratchImage scratch(grownSize(img, hsize), img.format(), "grow");
+  grow(img, hsize, scratch.image());
+
+  ConvolveJob job;
+  job.img = &img;
+  job.tmp = &scratch.image();
+  job.hsize = hsize;
+  job.info = &info;
+  job.spans = mask.spans().constData();
+  bool gray = isGray(img);
+  if (linear)
+  {
+    if (gray)
+      convolvePaths<true, 1>(job, mask);
+    else
+      convolvePaths<true, 3>(job, mask);
+  }
+  else
+  {
+    if (gray)
+      convolvePaths<false, 1>(job, mask);
+    else
+      convolvePaths<false, 3>(job, mask);
+  }
+}
+
+void convolve(QImage &img, const SpanMask &mask, const Matrix<double> &m, bool linear)
+{
+  convolve(img, mask, analyzeKernel(m), linear);
+}
+
+void convolve(PlanarImage &img, const QRect &rect, const Matrix<double> &m)
+{
+  QRect r = rect & img.rect();
+  if (r.isEmpty())
+    return;
+
+  KernelInfo info = analyzeKernel(m);
   int size = (m.size()-1)/2;
-  QImage tmp = grow(img, size);
+  int tw = r.width() + size*2;
+  int th = r.height() + size*2;
+
+  QVector<float> weights(m.size()*m.size());
+  for (int dy=0; dy<m.size(); dy++)
+    for (int dx=0; dx<m.size(); dx++)
+      weights[dy*m.size() + dx] = m.at(dx, dy);
+
+  ScratchFloats tile(tw*th);
+  ScratchFloats rows;
+  if (info.path == KernelInfo::Separable)
+    rows.resize(r.width()*th);
+  ScratchFloats acc(r.width());
+
+  for (int p=PlanarImage::Red; p<=PlanarImage::Blue; p++)
+  {
+    // Padded copy of the source region, borders clamped as in grow()
+    for (int ty=0; ty<th; ty++)
+    {
+      const float *src = img.line(p, qBound(0, r.top()+ty-size, img.height()-1));
+      float *dst = tile.data() + ty*tw;
+      for (int tx=0; tx<tw; tx++)
+        dst[tx] = src[qBound(0, r.left()+tx-size, img.width()-1)];
+    }
 
-  for (int y=rect.top(); y<=rect.bottom(); y++)
-    for (int x=rect.left(); x<=rect.right(); x++)
-      img.setPixel(x, y, apply(tmp, m, x+size, y+size));
+    int n = r.width();
+
+    // Separable kernels: horizontal pass over the whole tile height first
+    if (info.path == KernelInfo::Separable)
+      for (int ty=0; ty<th; ty++)
+      {
+        float *h = rows.data() + ty*n;
+        for (int x=0; x<n; x++)
+          h[x] = 0;
+        for (int k=0; k<m.size(); k++)
+        {
+          float w = info.row[k];
+          const float *src = tile.constData() + ty*tw + k;
+          for (int x=0; x<n; x++)
+            h[x] += w*src[x];
+        }
+      }
+
+    // Accumulate whole rows per tap: the inner loop is a plain saxpy
+    for (int y=0; y<r.height(); y++)
+    {
+      float *a = acc.data();
+      for (int x=0; x<n; x++)
+        a[x] = 0;
+
+      if (info.path == KernelInfo::Separable)
+        for (int k=0; k<m.size(); k++)
+        {
+          float w = info.column[k];
+          const float *src = rows.constData() + (y+k)*n;
+          for (int x=0; x<n; x++)
+            a[x] += w*src[x];
+        }
+      else
+        for (int dy=0; dy<m.size(); dy++)
+          for (int dx=0; dx<m.size(); dx++)
+          {
+            float w = weights[dy*m.size() + dx];
+            if (w == 0)
+              continue;
+            const float *src = tile.constData() + (y+dy)*tw + dx;
+            for (int x=0; x<n; x++)
+              a[x] += w*src[x];
+          }
+
+      float *dst = img.line(p, r.top()+y) + r.left();
+      for (int x=0; x<n; x++)
+        dst[x] = qBound(0.0f, a[x], 1.0f);
+    }
+  }
+
+  // Matches the QImage path, which produces opaque pixels
+  img.fill(PlanarImage::Alpha, r, 1.0f);
 }
 
 // ===========
@@ -81,41 +634,146 @@ static uchar findMedian(uchar *vs, int size)
   return vs[size/2];
 }
 
-static QRgb doMedian(const QImage &img, int size, int x, int y)
+#define SORT2(a, b) { if ((a) > (b)) { uchar t_ = (a); (a) = (b); (b) = t_; } }
+
+// Median of 9 with the 19 compare-exchange network (Paeth)
+static inline uchar median9(uchar *p)
 {
-  int fsize = size*size;
-  int hsize = (size-1)/2;
-  Q_ASSERT(fsize <= 256);
-  uchar vs[256];
+  SORT2(p[1], p[2]); SORT2(p[4], p[5]); SORT2(p[7], p[8]);
+  SORT2(p[0], p[1]); SORT2(p[3], p[4]); SORT2(p[6], p[7]);
+  SORT2(p[1], p[2]); SORT2(p[4], p[5]); SORT2(p[7], p[8]);
+  SORT2(p[0], p[3]); SORT2(p[5], p[8]); SORT2(p[4], p[7]);
+  SORT2(p[3], p[6]); SORT2(p[1], p[4]); SORT2(p[2], p[5]);
+  SORT2(p[4], p[7]); SORT2(p[4], p[2]); SORT2(p[6], p[4]);
+  SORT2(p[4], p[2]);
+  return p[4];
+}
+
+#undef SORT2
+
+template<int N>
+static inline uchar medianFixed(uchar *vs)
+{
+  std::nth_element(vs, vs + N*N/2, vs + N*N);
+  return vs[N*N/2];
+}
 
-  // Red
-  QRgb res = qRgb(0, 0, 0);
-  QRgb mask = 0xff;
-  int shift = 0;
-  for (int i=0; i<3; i++)
+template<>
+inline uchar medianFixed<3>(uchar *vs)
+{
+  return median9(vs);
+}
+
+template<int N, int Channels>
+static void medianFixedSize(ConvolveJob &job)
+{
+  typedef Pixels<Channels> P;
+  uchar vs[Channels][N*N];
+  for (int i=job.first; i<job.last; i++)
   {
-    int p = 0;
-    for (int dx=-hsize; dx<=hsize; dx++)
-      for (int dy=-hsize; dy<=hsize; dy++)
-        vs[p++] = (img.pixel(x+dx, y+dy) & mask) >> shift;
+    int y = job.spans[i].y;
+    const typename P::Type *rows[N];
+    for (int dy=0; dy<N; dy++)
+      rows[dy] = pixelAt<Channels>(*job.tmp, 0, y + dy);
+    typename P::Type *dst = pixelLine<Channels>(*job.img, y);
 
-    int m = findMedian(vs, fsize);
-    res |= m << shift;
-    mask <<= 8;
-    shift += 8;
+    for (int x=job.spans[i].x1; x<=job.spans[i].x2; x++)
+    {
+      for (int dy=0; dy<N; dy++)
+        for (int dx=0; dx<N; dx++)
+          for (int c=0; c<Channels; c++)
+            vs[c][dy*N + dx] = P::level(rows[dy][x+dx], c);
+      int v[Channels];
+      for (int c=0; c<Channels; c++)
+        v[c] = medianFixed<N>(vs[c]);
+      dst[x] = P::pack(v);
+    }
+  }
+}
+
+template<int Channels>
+static void medianAnySize(ConvolveJob &job)
+{
+  typedef Pixels<Channels> P;
+  int hsize = job.hsize;
+  int fsize = (2*hsize+1)*(2*hsize+1);
+  Q_ASSERT(fsize <= 256);
+  uchar vs[256];
+  for (int i=job.first; i<job.last; i++)
+  {
+    int y = job.spans[i].y;
+    typename P::Type *dst = pixelLine<Channels>(*job.img, y);
+    for (int x=job.spans[i].x1; x<=job.spans[i].x2; x++)
+    {
+      int v[Channels];
+      for (int c=0; c<Channels; c++)
+      {
+        int p = 0;
+        for (int dy=0; dy<=2*hsize; dy++)
+          for (int dx=0; dx<=2*hsize; dx++)
+            vs[p++] = P::level(*pixelAt<Channels>(*job.tmp, x+dx, y+dy), c);
+        v[c] = findMedian(vs, fsize);
+      }
+      dst[x] = P::pack(v);
+    }
   }
-  return res;
 }
 
-void median(QImage &img, const QRect &rect, int size)
+template<int Channels>
+static ConvolveFn medianPath(int size)
+{
+  if (size == 3)
+    return medianFixedSize<3, Channels>;
+  else if (size == 5)
+    return medianFixedSize<5, Channels>;
+  else if (size == 7)
+    return medianFixedSize<7, Channels>;
+  else
+    return medianAnySize<Channels>;
+}
+
+void median(QImage &img, const SpanMask &mask, int size)
 {
   int hsize = (size-1)/2;
-  QImage tmp = grow(img, hsize);
+  ScratchImage scratch(grownSize(img, hsize), img.format(), "grow");
+  grow(img, hsize, scratch.image());
 
-  for (int y=rect.top(); y<=rect.bottom(); y++)
-    for (int x=rect.left(); x<=rect.right(); x++)
-      img.setPixel(x, y, doMedian(tmp, size, x+hsize, y+hsize));
+  ConvolveJob job;
+  job.img = &img;
+  job.tmp = &scratch.image();
+  job.hsize = hsize;
+  job.info = 0;
+  job.spans = mask.spans().constData();
+  runBands(img, spanBands(mask.spans()), job,
+           isGray(img) ? medianPath<1>(size) : medianPath<3>(size));
 }
 
+// ==========
+
+void boxblur(QImage &img, const SpanMask &mask, int radius)
+{
+  if (mask.isEmpty())
+    return;
 
+  QRect bounds = mask.boundingRect();
+  IntegralImage sat(img, bounds.adjusted(-radius, -radius, radius, radius));
 
+  int size = 2*radius+1;
+  bool gray = isGray(img);
+  const QVector<Span> &spans = mask.spans();
+  for (int i=0; i<spans.size(); i++)
+    for (int x=spans[i].x1, y=spans[i].y; x<=spans[i].x2; x++)
+    {
+      QRect window = QRect(x-radius, y-radius, size, size) & sat.area();
+      quint64 n = quint64(window.width())*window.height();
+      int r = (sat.sum(IntegralImage::Red, window) + n/2)/n;
+      if (gray)
+      {
+        img.scanLine(y)[x] = r;
+        continue;
+      }
+      int g = (sat.sum(IntegralImage::Green, window) + n/2)/n;
+      int b = (sat.sum(IntegralImage::Blue, window) + n/2)/n;
+      img.setPixel(x, y, qRgb(r, g, b));
+    }
+}
@@ -2,24 +2,58 @@
 #define CONVOLUTION_H
 
 #include <QImage>
+#include "spanmask.h"
+
+class PlanarImage;
 
 template<class V>
 class Matrix
 {
   public:
     Matrix(int size)
-      : m_size(size), m_d(new V[size*size])
+      : m_size(size), m_d(allocate(size))
     {
       memset(m_d, 0, size*size*sizeof(V));
     }
     Matrix(const Matrix &other)
-      : m_size(other.m_size), m_d(new V[other.m_size*other.m_size])
+      : m_size(other.m_size), m_d(allocate(other.m_size))
     {
       memcpy(m_d, other.m_d, m_size*m_size*sizeof(V));
     }
+#ifdef Q_COMPILER_RVALUE_REFS
+    Matrix(Matrix &&other)
+      : m_size(other.m_size), m_d(m_inline)
+    {
+      // Heap storage is taken over, inline storage copied
+      if (other.m_d != other.m_inline)
+      {
+        m_d = other.m_d;
+        other.m_size = 0;
+        other.m_d = other.m_inline;
+      }
+      else
+        memcpy(m_d, other.m_d, m_size*m_size*sizeof(V));
+    }
+#endif
     ~Matrix()
     {
-      delete[] m_d;
+      release();
+    }
+
+    Matrix &operator=(const Matrix &other)
+    {
+      if (this != &other)
+      {
+        if (m_size != other.m_size)
+        {
+          V *d = allocate(other.m_size);
+          release();
+          m_d = d;
+          m_size = other.m_size;
+        }
+        memcpy(m_d, other.m_d, m_size*m_size*sizeof(V));
+      }
+      return *this;
     }
 
     int size() const { return m_size; }
@@ -28,16 +62,106 @@ class Matrix
     void set(int x, int y, V v) { m_d[m_size*y + x] = v; }
 
   private: 
+    // Kernels up to 7x7 are stored inline, without heap allocation
+    enum { InlineSize = 7*7 };
+
+    V *allocate(int size)
+    {
+      return size*size <= InlineSize ? m_inline : new V[size*size];
+    }
+    void release()
+    {
+      if (m_d != m_inline)
+        delete[] m_d;
+    }
+
     int m_size;
     V *m_d;
+    V m_inline[InlineSize];
 };
 
+// Single kernel tap: weight at offset (dx, dy) from the center
+struct KernelTap
+{
+    int dx, dy;
+    double weight;
+};
+
+/** Kernel with compile-time size N x N.
+ * Storage lives inline (no heap allocation), so copies and moves are
+ * plain memberwise copies, and loops over N unroll completely.
+ */
+template<int N>
+class FixedKernel
+{
+  public:
+    enum { Size = N, HalfSize = (N-1)/2 };
+
+    FixedKernel()
+    {
+      for (int i=0; i<N*N; i++)
+        m_d[i] = 0;
+    }
+    explicit FixedKernel(const Matrix<double> &m)
+    {
+      Q_ASSERT(m.size() == N);
+      for (int y=0; y<N; y++)
+        for (int x=0; x<N; x++)
+          m_d[N*y + x] = m.at(x, y);
+    }
+
+    float at(int x, int y) const { return m_d[N*y + x]; }
+    void set(int x, int y, float v) { m_d[N*y + x] = v; }
+
+  private:
+    float m_d[N*N];
+};
+
+// Evaluation strategy chosen for a kernel by analyzeKernel()
+struct KernelInfo
+{
+    enum Path
+    {
+      Dense,      // All taps in double precision
+      Sparse,     // Non-zero taps only
+      Separable,  // Rank-1: row pass, then column pass
+      Integer     // Exact integer weights, divisor 2^shift
+    };
+
+    Path path;
+    int size;
+    int nonZero;
+    // Multiplications per pixel and channel
+    int cost;
+
+    QVector<KernelTap> taps;
+    // Separable: m(x, y) = column[y]*row[x]
+    QVector<double> row, column;
+    // Integer: m(tap) = intWeights[i] / 2^shift
+    QVector<int> intWeights;
+    int shift;
+};
+
+KernelInfo analyzeKernel(const Matrix<double> &m);
+
+// Border handling of the window filters: img copied into res, which has
+// grownSize(img, size), with a border of size pixels repeating the edges
+QSize grownSize(const QImage &img, int size);
+void grow(const QImage &img, int size, QImage &res);
+
 // Filter generators. Matrix size is 2*halfsize+1
 Matrix<double> unsharp(int halfsize, double sigma, double alpha);
 Matrix<double> gaussian(int halfsize, double sigma);
 
-void convolve(QImage &img, const QRect &rect, const Matrix<double> &m);
+// linear: blend in linear light, see srgb.h
+void convolve(QImage &img, const SpanMask &mask, const Matrix<double> &m, bool linear = false);
+void convolve(QImage &img, const SpanMask &mask, const KernelInfo &info, bool linear = false);
+void convolve(PlanarImage &img, const QRect &rect, const Matrix<double> &m);
+
+void median(QImage &img, const SpanMask &mask, int size);
 
-void median(QImage &img, const QRect &rect, int size);
+// Mean of the (2*radius+1)^2 window clipped to the image, through a
+// summed-area table: cost per pixel independent of radius
+void boxblur(QImage &img, const SpanMask &mask, int radius);
 
 #endif // CONVOLUTION_H
@@ -0,0 +1,190 @@
+#include <cstring>
+
+#include "denoise.h"
+#include "scratchpool.h"
+#include "tuning.h"
+
+// Per cell: red, green and blue sums, then the pixel count
+static const int channels = 4;
+
+// Cell (x, y, z) collects the pixels nearest to image position
+// ((x+originX)*space, (y+originY)*space) and luminance (z-1)*range
+struct BilateralGrid
+{
+    int space, range;
+    int originX, originY;
+    int width, height, depth;
+    float *cells;
+
+    float *cell(int x, int y, int z) const
+    {
+      return cells + ((qint64(y)*width + x)*depth + z)*channels;
+    }
+};
+
+// Grid rows or columns [first, last), or spans [first, last) for slicing
+struct BilateralJob
+{
+    const BilateralGrid *grid;
+    QImage *image;
+    QRect input;
+    const Span *spans;
+    int first, last;
+};
+
+static inline int nearestCell(int v, int size)
+{
+  return (v + size/2)/size;
+}
+
+static void splatRows(BilateralJob &job)
+{
+  const BilateralGrid &g = *job.grid;
+  int s = g.space;
+  int y1 = qMax(job.input.top(), (job.first + g.originY)*s - s/2);
+  int y2 = qMin(job.input.bottom() + 1, (job.last + g.originY)*s - s/2);
+  for (int y=y1; y<y2; y++)
+  {
+    const QRgb *line = job.image->depth() == 32
+        ? reinterpret_cast<const QRgb *>(job.image->constScanLine(y)) : 0;
+    int gy = nearestCell(y, s) - g.originY;
+    for (int x=job.input.left(); x<=job.input.right(); x++)
+    {
+      QRgb c = line ? line[x] : job.image->pixel(x, y);
+      float *p = g.cell(nearestCell(x, s) - g.originX, gy, nearestCell(qGray(c), g.range) + 1);
+      p[0] += qRed(c);
+      p[1] += qGreen(c);
+      p[2] += qBlue(c);
+      p[3] += 1;
+    }
+  }
+}
+
+// [1 2 1] over n cells step floats apart, in place. Not normalized: the
+// weights cancel out in the slice.
+static void blurLine(float *p, int n, qint64 step, float *tmp)
+{
+  for (int i=0; i<n; i++)
+    memcpy(tmp + i*channels, p + i*step, channels*sizeof(float));
+  for (int i=0; i<n; i++)
+    for (int c=0; c<channels; c++)
+    {
+      float v = 2*tmp[i*channels + c];
+      if (i > 0)
+        v += tmp[(i-1)*channels + c];
+      if (i < n-1)
+        v += tmp[(i+1)*channels + c];
+      p[i*step + c] = v;
+    }
+}
+
+static void blurRows(BilateralJob &job)
+{
+  const BilateralGrid &g = *job.grid;
+  QVector<float> tmp(qMax(g.width, g.depth)*channels);
+  for (int y=job.first; y<job.last; y++)
+  {
+    for (int z=0; z<g.depth; z++)
+      blurLine(g.cell(0, y, z), g.width, g.depth*channels, tmp.data());
+    for (int x=0; x<g.width; x++)
+      blurLine(g.cell(x, y, 0), g.depth, channels, tmp.data());
+  }
+}
+
+static void blurColumns(BilateralJob &job)
+{
+  const BilateralGrid &g = *job.grid;
+  QVector<float> tmp(g.height*channels);
+  for (int x=job.first; x<job.last; x++)
+    for (int z=0; z<g.depth; z++)
+      blurLine(g.cell(x, 0, z), g.height, qint64(g.width)*g.depth*channels, tmp.data());
+}
+
+// Trilinear interpolation of the grid at each pixel
+static void sliceSpans(BilateralJob &job)
+{
+  const BilateralGrid &g = *job.grid;
+  for (int i=job.first; i<job.last; i++)
+  {
+    const Span &s = job.spans[i];
+    QRgb *line = job.image->depth() == 32
+        ? reinterpret_cast<QRgb *>(job.image->scanLine(s.y)) : 0;
+    double fy = double(s.y)/g.space - g.originY;
+    int gy = int(fy);
+    float ty = fy - gy;
+
+    for (int x=s.x1; x<=s.x2; x++)
+    {
+      QRgb c = line ? line[x] : job.image->pixel(x, s.y);
+      double fx = double(x)/g.space - g.originX;
+      double fz = double(qGray(c))/g.range + 1;
+      int gx = int(fx), gz = int(fz);
+      float tx = fx - gx, tz = fz - gz;
+
+      float acc[channels] = { 0, 0, 0, 0 };
+      for (int k=0; k<8; k++)
+      {
+        int dx = k & 1, dy = (k >> 1) & 1, dz = k >> 2;
+        float w = (dx ? tx : 1-tx)*(dy ? ty : 1-ty)*(dz ? tz : 1-tz);
+        const float *p = g.cell(gx+dx, gy+dy, gz+dz);
+        for (int ch=0; ch<channels; ch++)
+          acc[ch] += w*p[ch];
+      }
+      if (acc[3] <= 0)
+        continue;
+
+      QRgb res = qRgb(qBound(0, int(acc[0]/acc[3] + 0.5f), 255),
+                      qBound(0, int(acc[1]/acc[3] + 0.5f), 255),
+                      qBound(0, int(acc[2]/acc[3] + 0.5f), 255));
+      if (line)
+        line[x] = res;
+      else
+        job.image->setPixel(x, s.y, res);
+    }
+  }
+}
+
+int bilateralHalo(int sigmaSpace)
+{
+  // Splat, blur and slice each reach a cell further
+  return 3*sigmaSpace;
+}
+
+void bilateral(QImage &img, const SpanMask &mask, int sigmaSpace, int sigmaRange)
+{
+  if (mask.isEmpty())
+    return;
+
+  int halo = bilateralHalo(sigmaSpace);
+  QRect input = mask.boundingRect().adjusted(-halo, -halo, halo, halo) & img.rect();
+
+  // Cells sit at multiples of sigmaSpace in the image, so the result at a
+  // pixel does not depend on the selection. One spare cell on every side.
+  BilateralGrid g;
+  g.space = sigmaSpace;
+  g.range = sigmaRange;
+  g.originX = nearestCell(input.left(), sigmaSpace) - 1;
+  g.originY = nearestCell(input.top(), sigmaSpace) - 1;
+  g.width = nearestCell(input.right(), sigmaSpace) - g.originX + 2;
+  g.height = nearestCell(input.bottom(), sigmaSpace) - g.originY + 2;
+  g.depth = nearestCell(255, sigmaRange) + 3;
+
+  int size = g.width*g.height*g.depth*channels;
+  ScratchFloats cells(size);
+  memset(cells.data(), 0, size*sizeof(float));
+  g.cells = cells.data();
+
+  BilateralJob job;
+  job.grid = &g;
+  job.image = &img;
+  job.input = input;
+  job.spans = mask.spans().constData();
+
+  // Grid rows are independent when splatting and blurring along x and
+  // z, columns when blurring along y, spans when slicing
+  QVector<Band> rows = rowBands(0, g.height-1);
+  runBands(rows, job, splatRows);
+  runBands(rows, job, blurRows);
+  runBands(columnBands(g.width), job, blurColumns);
+  runBands(img, spanBands(mask.spans()), job, sliceSpans);
+}
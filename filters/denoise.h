@@ -0,0 +1,16 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include <QImage>
+#include "spanmask.h"
+
+/* Edge-preserving smoothing: bilateral filter evaluated on a bilateral
+ * grid. Pixels are accumulated into cells of sigmaSpace pixels by
+ * sigmaRange luminance levels, the grid is blurred and read back
+ * interpolated at each pixel, so the cost does not grow with the radius.
+ */
+void bilateral(QImage &img, const SpanMask &mask, int sigmaSpace, int sigmaRange);
+// Distance from an output pixel within which the input affects it
+int bilateralHalo(int sigmaSpace);
+
+#endif // DENOISE_H
@@ -0,0 +1,278 @@
+#include <cmath>
+#include <QVector>
+
+#include "edges.h"
+#include "histogram.h"
+#include "memorymeter.h"
+#include "pixelformat.h"
+#include "tuning.h"
+
+// Smoothing taps of the operators: side, center, side
+static const int sideWeight[] = { 1, 3 };
+static const int centerWeight[] = { 2, 10 };
+
+static int normOf(EdgeOperator op)
+{
+  return 2*sideWeight[op] + centerWeight[op];
+}
+
+static inline int levelOf(uchar p) { return p; }
+static inline int levelOf(QRgb p) { return lumaLevel(p); }
+
+// Rows [first, last) of the gradients over area, which may reach past
+// the image: pixels there repeat the border ones. Results go to gx and
+// gy, or as magnitude levels to levels, in rows of area.width().
+struct GradientJob
+{
+    const QImage *img;
+    EdgeOperator op;
+    QRect area;
+    qint16 *gx, *gy;
+    uchar *levels;
+    int first, last;
+};
+
+template<int Channels>
+static void gradientBand(GradientJob &job)
+{
+  typedef Pixels<Channels> P;
+  const QImage &img = *job.img;
+  int w = job.area.width();
+  int rows = job.last - job.first;
+  int side = sideWeight[job.op], center = centerWeight[job.op];
+
+  // Row pass over rows first-1 .. last: derivative and smoothing along x
+  QVector<qint16> luma(w + 2);
+  QVector<qint16> diff((rows + 2)*w), smooth((rows + 2)*w);
+  for (int i=0; i<rows+2; i++)
+  {
+    int y = qBound(0, job.area.top() + job.first + i - 1, img.height()-1);
+    const typename P::Type *line = constPixelLine<Channels>(img, y);
+    for (int x=0; x<w+2; x++)
+      luma[x] = levelOf(line[qBound(0, job.area.left() + x - 1, img.width()-1)]);
+
+    const qint16 *l = luma.constData();
+    qint16 *d = diff.data() + i*w;
+    qint16 *s = smooth.data() + i*w;
+    for (int x=0; x<w; x++)
+    {
+      d[x] = l[x+2] - l[x];
+      s[x] = side*(l[x] + l[x+2]) + center*l[x+1];
+    }
+  }
+
+  // Column pass: smoothing of the x derivative, derivative of the smoothing
+  QVector<qint16> rowX(w), rowY(w);
+  float scale = 1.0f/normOf(job.op);
+  for (int i=0; i<rows; i++)
+  {
+    const qint16 *d = diff.constData() + i*w;
+    const qint16 *s = smooth.constData() + i*w;
+    int offset = (job.first + i)*w;
+    qint16 *gx = job.gx ? job.gx + offset : rowX.data();
+    qint16 *gy = job.gy ? job.gy + offset : rowY.data();
+    // Separate loops keep the aliasing checks few enough to vectorize
+    for (int x=0; x<w; x++)
+      gx[x] = side*(d[x] + d[x + 2*w]) + center*d[x + w];
+    for (int x=0; x<w; x++)
+      gy[x] = s[x + 2*w] - s[x];
+
+    // Straight-line float code, for the compiler to vectorize
+    if (job.levels)
+    {
+      uchar *dst = job.levels + offset;
+      for (int x=0; x<w; x++)
+      {
+        float m = std::sqrt(float(gx[x]*gx[x] + gy[x]*gy[x]))*scale + 0.5f;
+        dst[x] = uchar(qMin(m, 255.0f));
+      }
+    }
+  }
+}
+
+static void gradients(const QImage &img, EdgeOperator op, const QRect &area,
+                      qint16 *gx, qint16 *gy, uchar *levels)
+{
+  GradientJob job;
+  job.img = &img;
+  job.op = op;
+  job.area = area;
+  job.gx = gx;
+  job.gy = gy;
+  job.levels = levels;
+  runBands(rowBands(0, area.height()-1), job,
+           isGray(img) ? gradientBand<1> : gradientBand<3>);
+}
+
+// Spans [first, last) of the selection take their levels from the rows
+// of area in levels
+struct LevelsJob
+{
+    QImage *img;
+    const uchar *levels;
+    QRect area;
+    const Span *spans;
+    int first, last;
+};
+
+template<int Channels>
+static void writeSpans(LevelsJob &job)
+{
+  typedef Pixels<Channels> P;
+  int w = job.area.width();
+  for (int i=job.first; i<job.last; i++)
+  {
+    const Span &s = job.spans[i];
+    typename P::Type *dst = pixelLine<Channels>(*job.img, s.y);
+    const uchar *src = job.levels + (s.y - job.area.top())*w - job.area.left();
+    for (int x=s.x1; x<=s.x2; x++)
+    {
+      int v[Channels];
+      for (int c=0; c<Channels; c++)
+        v[c] = src[x];
+      dst[x] = P::pack(v);
+    }
+  }
+}
+
+static void writeLevels(QImage &img, const SpanMask &mask, const QRect &area,
+                        const uchar *levels)
+{
+  LevelsJob job;
+  job.img = &img;
+  job.levels = levels;
+  job.area = area;
+  job.spans = mask.spans().constData();
+  runBands(img, spanBands(mask.spans()), job,
+           isGray(img) ? writeSpans<1> : writeSpans<3>);
+}
+
+void edges(QImage &img, const SpanMask &mask, EdgeOperator op)
+{
+  if (mask.isEmpty())
+    return;
+
+  QRect area = mask.boundingRect();
+  QVector<uchar> levels(area.width()*area.height());
+  MemoryMeter::instance().allocated("edge levels", levels.size());
+  gradients(img, op, area, 0, 0, levels.data());
+  writeLevels(img, mask, area, levels.constData());
+}
+
+// ==========
+
+enum EdgeClass { NoEdge, WeakEdge, StrongEdge };
+
+// Rows [first, last) of area: non-maximum suppression and thresholds.
+// The gradients cover area and one pixel around it.
+struct SuppressJob
+{
+    const qint16 *gx, *gy;
+    int stride;
+    int width;
+    int low2, high2;        // squared thresholds, in gradient units
+    uchar *classes;
+    int first, last;
+};
+
+static inline int magnitude2(const qint16 *gx, const qint16 *gy, int i)
+{
+  return gx[i]*gx[i] + gy[i]*gy[i];
+}
+
+static void suppressBand(SuppressJob &job)
+{
+  int stride = job.stride;
+  for (int y=job.first; y<job.last; y++)
+  {
+    const qint16 *gx = job.gx + (y+1)*stride + 1;
+    const qint16 *gy = job.gy + (y+1)*stride + 1;
+    uchar *dst = job.classes + y*job.width;
+    for (int x=0; x<job.width; x++)
+    {
+      int m = magnitude2(gx, gy, x);
+      if (m <= job.low2)
+      {
+        dst[x] = NoEdge;
+        continue;
+      }
+
+      // Neighbors along the gradient, in 45 degree sectors. The sector
+      // bounds are at tan(22.5) = sqrt(2)-1, tested exactly as
+      // (a + b)^2 <= 2 b^2 for a/b.
+      int ax = qAbs(int(gx[x])), ay = qAbs(int(gy[x]));
+      int step;
+      if ((ax + ay)*(ax + ay) <= 2*ax*ax)
+        step = 1;
+      else if ((ax + ay)*(ax + ay) <= 2*ay*ay)
+        step = stride;
+      else if ((gx[x] > 0) == (gy[x] > 0))
+        step = stride + 1;
+      else
+        step = stride - 1;
+
+      bool maximum = m > magnitude2(gx, gy, x - step) && m >= magnitude2(gx, gy, x + step);
+      dst[x] = !maximum ? NoEdge : m > job.high2 ? StrongEdge : WeakEdge;
+    }
+  }
+}
+
+// Promote weak edges 8-connected to strong ones, following the chains
+// from every strong pixel
+static void hysteresis(uchar *classes, int width, int height)
+{
+  QVector<int> stack;
+  for (int i=0; i<width*height; i++)
+    if (classes[i] == StrongEdge)
+      stack.append(i);
+
+  while (!stack.isEmpty())
+  {
+    int i = stack.last();
+    stack.remove(stack.size()-1);
+    int x = i % width, y = i / width;
+    for (int ny=qMax(0, y-1); ny<=qMin(height-1, y+1); ny++)
+      for (int nx=qMax(0, x-1); nx<=qMin(width-1, x+1); nx++)
+      {
+        int j = ny*width + nx;
+        if (classes[j] == WeakEdge)
+        {
+          classes[j] = StrongEdge;
+          stack.append(j);
+        }
+      }
+  }
+}
+
+void canny(QImage &img, const SpanMask &mask, EdgeOperator op, int low, int high)
+{
+  if (mask.isEmpty())
+    return;
+
+  // Gradients one pixel around area, for the suppression
+  QRect area = mask.boundingRect();
+  QRect outer = area.adjusted(-1, -1, 1, 1);
+  int n = outer.width()*outer.height();
+  QVector<qint16> gx(n), gy(n);
+  MemoryMeter::instance().allocated("edge gradients", 2*n*sizeof(qint16));
+  gradients(img, op, outer, gx.data(), gy.data(), 0);
+
+  int norm = normOf(op);
+  high = qMax(low, high);
+  QVector<uchar> classes(area.width()*area.height());
+  SuppressJob job;
+  job.gx = gx.constData();
+  job.gy = gy.constData();
+  job.stride = outer.width();
+  job.width = area.width();
+  job.low2 = low*norm*low*norm;
+  job.high2 = high*norm*high*norm;
+  job.classes = classes.data();
+  runBands(rowBands(0, area.height()-1), job, suppressBand);
+
+  // Serial, but linear in the area
+  hysteresis(classes.data(), area.width(), area.height());
+  for (int i=0; i<classes.size(); i++)
+    classes[i] = classes[i] == StrongEdge ? 255 : 0;
+  writeLevels(img, mask, area, classes.constData());
+}
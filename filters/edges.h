@@ -0,0 +1,29 @@
+#ifndef EDGES_H
+#define EDGES_H
+
+#include <QImage>
+#include "spanmask.h"
+
+enum EdgeOperator
+{
+  Sobel,    // Derivative [-1 0 1] smoothed across by [1 2 1]
+  Scharr    // Smoothed by [3 10 3]: closer to rotation invariant
+};
+
+/* Gradient magnitude of luma, as gray levels. Both gradients come from
+ * one pass of the separable integer kernels, in row bands run in
+ * parallel; the magnitude is divided by the smoothing weight, so that a
+ * step of n levels gives n. Borders repeat the edge pixels. Reads one
+ * pixel around the selection.
+ */
+void edges(QImage &img, const SpanMask &mask, EdgeOperator op);
+
+/* Canny edges: the gradient of edges(), thinned by non-maximum
+ * suppression across the edge, then hysteresis: pixels whose magnitude
+ * exceeds high, and those exceeding low 8-connected to them through
+ * such pixels, become white, the rest black. Connections are followed
+ * within the bounding rect of the selection. Reads two pixels around it.
+ */
+void canny(QImage &img, const SpanMask &mask, EdgeOperator op, int low, int high);
+
+#endif // EDGES_H
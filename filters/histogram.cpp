@@ -1,17 +1,44 @@
 #include <cmath>
 #include <QPainter>
 #include "histogram.h"
+#include "pixelformat.h"
+#include "tuning.h"
 
-QPixmap drawHistogram(const QImage &img, const QRect &rect,
-                      ColorProp prop, int w, int h,
-                      const QColor &bg, const QColor &fg)
+static const double quantile = 0.01;
+
+void findQuantiles(const QVector<double> &stats, int *qmin, int *qmax)
 {
-  int qmin, qmax;
-  QVector<double> stats = makeHistogram(img, rect, prop, w, &qmin, &qmax);
+  int w = stats.size();
+
+  if (qmin)
+  {
+    int q = 0;
+    double s = 0;
+    while (s<quantile && q<w)
+      s += stats[q++];
+    *qmin = q;
+  }
+
+  if (qmax)
+  {
+    int q = w-1;
+    double s = 0;
+    while (s<quantile && q>=0)
+      s += stats[q--];
+    *qmax = q;
+  }
+}
+
+static QPixmap paintHistogram(const QVector<double> &stats, int qmin, int qmax,
+                              int h, const QColor &bg, const QColor &fg)
+{
+  int w = stats.size();
 
   double smax = stats[0];
   for (int i=1; i<w; i++)
     smax = qMax(smax, stats[i]);
+  if (smax <= 0)
+    smax = 1;
 
   QPixmap res(w, h);
   QPainter p;
@@ -34,41 +61,33 @@ QPixmap drawHistogram(const QImage &img, const QRect &rect,
   return res;
 }
 
-QVector<double> makeHistogram(const QImage &img, const QRect &rect,
+QPixmap drawHistogram(const QImage &img, const QRect &rect,
+                      ColorProp prop, int w, int h,
+                      const QColor &bg, const QColor &fg)
+{
+  int qmin, qmax;
+  QVector<double> stats = makeHistogram(img, rect, prop, w, &qmin, &qmax);
+  return paintHistogram(stats, qmin, qmax, h, bg, fg);
+}
+
+QVector<double> makeHistogram(const QImage &img, const SpanMask &mask,
                               ColorProp prop, int w,
                               int *qmin, int *qmax)
 {
-  static const double quantile = 0.01;
-
   QVector<double> stats(w, 0);
-  for (int y=rect.top(); y<=rect.bottom(); y++)
-    for (int x=rect.left(); x<=rect.right(); x++)
+  const QVector<Span> &spans = mask.spans();
+  for (int i=0; i<spans.size(); i++)
+    for (int x=spans[i].x1; x<=spans[i].x2; x++)
     {
-      int pos = qBound(0, int(prop(img.pixel(x, y)) * (w-1)), w-1);
+      int pos = qBound(0, int(prop(img.pixel(x, spans[i].y)) * (w-1)), w-1);
       stats[pos] += 1;
     }
 
-  double k = 1.0/(rect.width()*rect.height());
+  double k = 1.0/mask.area();
   for (int p=0; p<w; p++)
     stats[p] *= k;
 
-  if (qmin)
-  {
-    int q = 0;
-    double s = 0;
-    while (s<quantile)
-      s += stats[q++];
-    *qmin = q;
-  }
-
-  if (qmax)
-  {
-    int q = w-1;
-    double s = 0;
-    while (s<quantile)
-      s += stats[q--];
-    *qmax = q;
-  }
+  findQuantiles(stats, qmin, qmax);
 
   return stats;
 }
@@ -92,3 +111,209 @@ double getBlue(QRgb rgb)
 {
   return qBlue(rgb)/255.0;
 }
+
+// =======
+
+ImageHistogram::ImageHistogram()
+  : m_total(0)
+{
+  for (int c=0; c<ChannelCount; c++)
+    m_counts[c] = QVector<qint64>(bins, 0);
+}
+
+void ImageHistogram::clear()
+{
+  for (int c=0; c<ChannelCount; c++)
+    m_counts[c].fill(0);
+  m_total = 0;
+}
+
+void ImageHistogram::add(const QImage &img, const QRect &rect)
+{
+  accumulate(img, rect, 1);
+}
+
+void ImageHistogram::subtract(const QImage &img, const QRect &rect)
+{
+  accumulate(img, rect, -1);
+}
+
+void ImageHistogram::add(const QImage &img, const SpanMask &mask)
+{
+  accumulate(img, mask, 1);
+}
+
+void ImageHistogram::subtract(const QImage &img, const SpanMask &mask)
+{
+  accumulate(img, mask, -1);
+}
+
+// Rows [first, last) of rect, or spans [first, last), counted apart
+struct HistogramJob
+{
+    const QImage *img;
+    QRect rect;
+    const Span *spans;
+    int first, last;
+    QVector<qint64> counts[ImageHistogram::ChannelCount];
+};
+
+static void countRow(HistogramJob &job, int y, int x1, int x2)
+{
+  qint64 *luma = job.counts[ImageHistogram::Luma].data();
+  qint64 *red = job.counts[ImageHistogram::Red].data();
+  qint64 *green = job.counts[ImageHistogram::Green].data();
+  qint64 *blue = job.counts[ImageHistogram::Blue].data();
+
+  if (isGray(*job.img))
+  {
+    // Gray levels count alike in every channel
+    const uchar *line = job.img->constScanLine(y);
+    for (int x=x1; x<=x2; x++)
+    {
+      int v = line[x];
+      luma[v]++;
+      red[v]++;
+      green[v]++;
+      blue[v]++;
+    }
+  }
+  else if (job.img->depth() == 32)
+  {
+    const QRgb *line = reinterpret_cast<const QRgb *>(job.img->constScanLine(y));
+    for (int x=x1; x<=x2; x++)
+    {
+      QRgb c = line[x];
+      luma[lumaLevel(c)]++;
+      red[qRed(c)]++;
+      green[qGreen(c)]++;
+      blue[qBlue(c)]++;
+    }
+  }
+  else
+    for (int x=x1; x<=x2; x++)
+    {
+      QRgb c = job.img->pixel(x, y);
+      luma[lumaLevel(c)]++;
+      red[qRed(c)]++;
+      green[qGreen(c)]++;
+      blue[qBlue(c)]++;
+    }
+}
+
+static void countBand(HistogramJob &job)
+{
+  for (int c=0; c<ImageHistogram::ChannelCount; c++)
+    job.counts[c] = QVector<qint64>(ImageHistogram::bins, 0);
+  for (int i=job.first; i<job.last; i++)
+    if (job.spans)
+      countRow(job, job.spans[i].y, job.spans[i].x1, job.spans[i].x2);
+    else
+      countRow(job, i, job.rect.left(), job.rect.right());
+}
+
+void ImageHistogram::accumulate(const QImage &img, const QRect &rect, int sign)
+{
+  QRect r = rect & img.rect();
+  if (r.isEmpty())
+    return;
+
+  HistogramJob job;
+  job.img = &img;
+  job.rect = r;
+  job.spans = 0;
+  QVector<HistogramJob> jobs = bandJobs(job, rowBands(r.top(), r.bottom()));
+  merge(jobs, sign);
+  m_total += sign * qint64(r.width()) * r.height();
+}
+
+void ImageHistogram::accumulate(const QImage &img, const SpanMask &mask, int sign)
+{
+  SpanMask clipped = mask.intersected(img.rect());
+  const QVector<Span> &spans = clipped.spans();
+  if (spans.isEmpty())
+    return;
+
+  HistogramJob job;
+  job.img = &img;
+  job.spans = spans.constData();
+  QVector<HistogramJob> jobs = bandJobs(job, spanBands(spans));
+  merge(jobs, sign);
+  m_total += sign * clipped.area();
+}
+
+void ImageHistogram::merge(QVector<HistogramJob> &jobs, int sign)
+{
+  runJobs(jobs, countBand);
+  for (int i=0; i<jobs.size(); i++)
+    for (int c=0; c<ChannelCount; c++)
+    {
+      qint64 *dst = m_counts[c].data();
+      const qint64 *src = jobs[i].counts[c].constData();
+      for (int b=0; b<bins; b++)
+        dst[b] += sign*src[b];
+    }
+}
+
+double ImageHistogram::mean(Channel c) const
+{
+  if (m_total <= 0)
+    return 0;
+
+  double sum = 0;
+  for (int i=0; i<bins; i++)
+    sum += double(i) * m_counts[c][i];
+  return sum / m_total;
+}
+
+double ImageHistogram::variance(Channel c) const
+{
+  if (m_total <= 0)
+    return 0;
+
+  // Exact: every pixel of a bin has the bin's level
+  double m = mean(c), sum = 0;
+  for (int i=0; i<bins; i++)
+    sum += (i - m)*(i - m) * m_counts[c][i];
+  return sum / m_total;
+}
+
+int ImageHistogram::minimum(Channel c) const
+{
+  for (int i=0; i<bins; i++)
+    if (m_counts[c][i] > 0)
+      return i;
+  return 0;
+}
+
+int ImageHistogram::maximum(Channel c) const
+{
+  for (int i=bins-1; i>=0; i--)
+    if (m_counts[c][i] > 0)
+      return i;
+  return 0;
+}
+
+QVector<double> ImageHistogram::normalized(Channel c, int w,
+                                           int *qmin, int *qmax) const
+{
+  QVector<double> stats(w, 0);
+  if (m_total > 0)
+  {
+    double k = 1.0/m_total;
+    for (int i=0; i<bins; i++)
+      stats[i*(w-1)/(bins-1)] += m_counts[c][i]*k;
+  }
+
+  findQuantiles(stats, qmin, qmax);
+
+  return stats;
+}
+
+QPixmap ImageHistogram::draw(Channel c, int w, int h,
+                             const QColor &bg, const QColor &fg) const
+{
+  int qmin, qmax;
+  QVector<double> stats = normalized(c, w, &qmin, &qmax);
+  return paintHistogram(stats, qmin, qmax, h, bg, fg);
+}
@@ -4,6 +4,7 @@
 #include <QColor>
 #include <QPixmap>
 #include <QVector>
+#include "spanmask.h"
 
 // Pixel property accessor (R, G, B, Luma, etc) -> double [0, 1]
 typedef double (*ColorProp)(QRgb color);
@@ -14,13 +15,65 @@ QPixmap drawHistogram(const QImage &img, const QRect &rect,
 
 // Make histogram with resolution w
 // First and last percentiles optionally returned in qmin, qmax
-QVector<double> makeHistogram(const QImage &img, const QRect &rect,
+QVector<double> makeHistogram(const QImage &img, const SpanMask &mask,
                               ColorProp prop, int w,
                               int *qmin, int *qmax);
 
+// First and last percentiles of a normalized histogram
+void findQuantiles(const QVector<double> &stats, int *qmin, int *qmax);
+
 double getLuma(QRgb rgb);
+// BT.709 luma level in 16-bit fixed point, same weights as getLuma().
+// The bin of a pixel in ImageHistogram::Luma.
+inline int lumaLevel(QRgb rgb)
+{
+  return (13927*qRed(rgb) + 46884*qGreen(rgb) + 4725*qBlue(rgb)) >> 16;
+}
 double getRed(QRgb rgb);
 double getGreen(QRgb rgb);
 double getBlue(QRgb rgb);
 
+struct HistogramJob;
+
+// Raw 8-bit histograms of luma, red, green and blue.
+// Counts are not normalized, so regions may be added and subtracted
+// incrementally instead of rescanning the whole image.
+class ImageHistogram
+{
+  public:
+    enum Channel { Luma, Red, Green, Blue, ChannelCount };
+    static const int bins = 256;
+
+    ImageHistogram();
+
+    void clear();
+    void add(const QImage &img, const QRect &rect);
+    void subtract(const QImage &img, const QRect &rect);
+    void add(const QImage &img, const SpanMask &mask);
+    void subtract(const QImage &img, const SpanMask &mask);
+
+    qint64 total() const { return m_total; }
+    qint64 count(Channel c, int bin) const { return m_counts[c][bin]; }
+
+    // Statistics of the counted pixels, in 8-bit levels
+    double mean(Channel c) const;
+    double variance(Channel c) const;
+    int minimum(Channel c) const;
+    int maximum(Channel c) const;
+
+    // Histogram with resolution w, normalized like makeHistogram()
+    QVector<double> normalized(Channel c, int w, int *qmin, int *qmax) const;
+    QPixmap draw(Channel c, int w, int h,
+                 const QColor &bg, const QColor &fg) const;
+
+  private:
+    void accumulate(const QImage &img, const QRect &rect, int sign);
+    void accumulate(const QImage &img, const SpanMask &mask, int sign);
+    // Runs the counting jobs and adds their counts times sign
+    void merge(QVector<HistogramJob> &jobs, int sign);
+
+    QVector<qint64> m_counts[ChannelCount];
+    qint64 m_total;
+};
+
 #endif // HISTOGRAM_H
@@ -0,0 +1,257 @@
+#include "integral.h"
+#include "pixelformat.h"
+#include "tuning.h"
+
+// Largest pixel counts whose sums fit in 32 bits
+static const qint64 sumLimit = Q_INT64_C(0xffffffff) / 255;
+static const qint64 squareLimit = Q_INT64_C(0xffffffff) / (255*255);
+
+static const int columnChunk = 256*IntegralImage::ChannelCount;
+
+// Rows [first, last) of the horizontal prefix pass, or entries
+// [first, last) of rows [fromRow, toRow) of the vertical one
+struct IntegralJob
+{
+    const QImage *image;
+    QPoint origin;
+    int width;
+    int stride;
+    quint32 *sums;
+    quint32 *squares;
+    int first, last;
+    int fromRow, toRow;
+    bool gray;
+};
+
+static void prefixRows(IntegralJob &job)
+{
+  for (int y=job.first; y<job.last; y++)
+  {
+    quint32 *s = job.sums + (y+1)*job.stride + IntegralImage::ChannelCount;
+    quint32 *q = job.squares + (y+1)*job.stride + IntegralImage::ChannelCount;
+    int iy = job.origin.y() + y;
+    quint32 r = 0, g = 0, b = 0;
+    quint32 rr = 0, gg = 0, bb = 0;
+    if (job.gray)
+    {
+      const uchar *line = job.image->constScanLine(iy) + job.origin.x();
+      for (int x=0; x<job.width; x++)
+      {
+        int v = line[x];
+        int i = x*IntegralImage::ChannelCount;
+        s[i] = s[i+1] = s[i+2] = r += v;
+        q[i] = q[i+1] = q[i+2] = rr += v*v;
+      }
+      continue;
+    }
+
+    const QRgb *line = job.image->depth() == 32
+        ? reinterpret_cast<const QRgb *>(job.image->constScanLine(iy)) + job.origin.x()
+        : 0;
+    for (int x=0; x<job.width; x++)
+    {
+      QRgb c = line ? line[x] : job.image->pixel(job.origin.x() + x, iy);
+      int red = qRed(c), green = qGreen(c), blue = qBlue(c);
+      int i = x*IntegralImage::ChannelCount;
+      s[i]   = r += red;
+      s[i+1] = g += green;
+      s[i+2] = b += blue;
+      q[i]   = rr += red*red;
+      q[i+1] = gg += green*green;
+      q[i+2] = bb += blue*blue;
+    }
+  }
+}
+
+static void accumulateColumns(IntegralJob &job)
+{
+  for (int y=job.fromRow; y<job.toRow; y++)
+  {
+    quint32 *s = job.sums + (y+1)*job.stride;
+    quint32 *q = job.squares + (y+1)*job.stride;
+    for (int x=job.first; x<job.last; x++)
+    {
+      s[x] += s[x - job.stride];
+      q[x] += q[x - job.stride];
+    }
+  }
+}
+
+IntegralImage::IntegralImage()
+  : m_stride(0), m_validRows(0), m_key(0)
+{
+}
+
+IntegralImage::IntegralImage(const QImage &img, const QRect &area)
+  : m_stride(0), m_validRows(0), m_key(0)
+{
+  build(img, area);
+}
+
+void IntegralImage::build(const QImage &img, const QRect &area)
+{
+  m_area = area.isNull() ? img.rect() : area & img.rect();
+  m_stride = (m_area.width() + 1)*ChannelCount;
+  m_key = img.cacheKey();
+
+  // Row and column 0 stay zero
+  int entries = isNull() ? 0 : m_stride*(m_area.height() + 1);
+  m_sums.fill(0, entries);
+  m_squares.fill(0, entries);
+  m_validRows = 0;
+  rebuild(img, 0);
+}
+
+void IntegralImage::sync(const QImage &img)
+{
+  if (isNull() || img.cacheKey() != m_key || m_area != img.rect())
+    build(img);
+  else if (m_validRows < m_area.height())
+    rebuild(img, m_validRows);
+}
+
+void IntegralImage::invalidate(const QImage &img, const QRect &rect)
+{
+  QRect r = rect & m_area;
+  if (!r.isEmpty())
+    m_validRows = qMin(m_validRows, r.top() - m_area.top());
+  m_key = img.cacheKey();
+}
+
+bool IntegralImage::isFresh(const QImage &img, const QRect &rect) const
+{
+  return !isNull() && img.cacheKey() == m_key && m_area.contains(rect)
+           && rect.bottom() - m_area.top() < m_validRows;
+}
+
+void IntegralImage::clear()
+{
+  m_sums.clear();
+  m_squares.clear();
+  m_area = QRect();
+  m_stride = 0;
+  m_validRows = 0;
+  m_key = 0;
+}
+
+void IntegralImage::rebuild(const QImage &img, int fromRow)
+{
+  if (isNull())
+    return;
+
+  IntegralJob job;
+  job.image = &img;
+  job.origin = m_area.topLeft();
+  job.width = m_area.width();
+  job.stride = m_stride;
+  job.sums = m_sums.data();
+  job.squares = m_squares.data();
+  job.fromRow = fromRow;
+  job.toRow = m_area.height();
+  job.gray = isGray(img);
+
+  // Rows are independent in the first pass, columns in the second
+  runBands(rowBands(fromRow, job.toRow-1), job, prefixRows);
+  runBands(columnBands(m_stride, columnChunk), job, accumulateColumns);
+
+  m_validRows = job.toRow;
+}
+
+quint64 IntegralImage::tableSum(const QVector<quint32> &table, Channel c,
+                                const QRect &rect, qint64 limit) const
+{
+  QRect r = (rect & m_area).translated(-m_area.topLeft());
+  if (r.isEmpty())
+    return 0;
+  Q_ASSERT(r.bottom() < m_validRows);
+
+  // Each band sums to less than 2^32, so wrapped differences are exact
+  const quint32 *t = table.constData() + c;
+  int cols = int(qMin<qint64>(r.width(), limit));
+  int rows = int(qMax<qint64>(1, limit/cols));
+  quint64 res = 0;
+  for (int y1=r.top(); y1<=r.bottom(); y1+=rows)
+  {
+    int y2 = qMin(y1 + rows, r.bottom() + 1);
+    const quint32 *top = t + y1*m_stride;
+    const quint32 *bottom = t + y2*m_stride;
+    for (int x1=r.left(); x1<=r.right(); x1+=cols)
+    {
+      int x2 = qMin(x1 + cols, r.right() + 1);
+      quint32 s = bottom[x2*ChannelCount] - bottom[x1*ChannelCount]
+                - top[x2*ChannelCount] + top[x1*ChannelCount];
+      res += s;
+    }
+  }
+  return res;
+}
+
+quint64 IntegralImage::tableSum(const QVector<quint32> &table, Channel c,
+                                const SpanMask &mask, qint64 limit) const
+{
+  if (mask.isRect())
+    return tableSum(table, c, mask.boundingRect(), limit);
+
+  quint64 res = 0;
+  const QVector<Span> &spans = mask.spans();
+  for (int i=0; i<spans.size(); i++)
+    res += tableSum(table, c, QRect(QPoint(spans[i].x1, spans[i].y),
+                                    QPoint(spans[i].x2, spans[i].y)), limit);
+  return res;
+}
+
+quint64 IntegralImage::sum(Channel c, const QRect &rect) const
+{
+  return tableSum(m_sums, c, rect, sumLimit);
+}
+
+quint64 IntegralImage::sumSquares(Channel c, const QRect &rect) const
+{
+  return tableSum(m_squares, c, rect, squareLimit);
+}
+
+double IntegralImage::mean(Channel c, const QRect &rect) const
+{
+  QRect r = rect & m_area;
+  if (r.isEmpty())
+    return 0;
+  return double(sum(c, r))/(qint64(r.width())*r.height());
+}
+
+double IntegralImage::variance(Channel c, const QRect &rect) const
+{
+  QRect r = rect & m_area;
+  if (r.isEmpty())
+    return 0;
+  double n = double(qint64(r.width())*r.height());
+  double m = sum(c, r)/n;
+  return qMax(0.0, sumSquares(c, r)/n - m*m);
+}
+
+quint64 IntegralImage::sum(Channel c, const SpanMask &mask) const
+{
+  return tableSum(m_sums, c, mask, sumLimit);
+}
+
+quint64 IntegralImage::sumSquares(Channel c, const SpanMask &mask) const
+{
+  return tableSum(m_squares, c, mask, squareLimit);
+}
+
+double IntegralImage::mean(Channel c, const SpanMask &mask) const
+{
+  SpanMask m = mask.intersected(m_area);
+  if (m.isEmpty())
+    return 0;
+  return double(sum(c, m))/m.area();
+}
+
+double IntegralImage::variance(Channel c, const SpanMask &mask) const
+{
+  SpanMask m = mask.intersected(m_area);
+  if (m.isEmpty())
+    return 0;
+  double n = double(m.area());
+  double avg = sum(c, m)/n;
+  return qMax(0.0, sumSquares(c, m)/n - avg*avg);
+}
@@ -0,0 +1,65 @@
+#ifndef INTEGRAL_H
+#define INTEGRAL_H
+
+#include <QImage>
+#include <QVector>
+#include "spanmask.h"
+
+/** Summed-area tables of the R, G and B channels and of their squares.
+ * Sums, means and variances of any rect then take four lookups per
+ * channel. Entries are kept modulo 2^32 (24 bytes per pixel); queries
+ * split large rects into bands small enough for the wrap-around to
+ * cancel out.
+ */
+class IntegralImage
+{
+  public:
+    enum Channel { Red, Green, Blue, ChannelCount };
+
+    IntegralImage();
+    // Tables over area of img, the whole image if area is null
+    explicit IntegralImage(const QImage &img, const QRect &area = QRect());
+
+    void build(const QImage &img, const QRect &area = QRect());
+    // Bring whole-image tables up to date with img. Only the rows from
+    // the first invalidated one down are rebuilt, if img is the image
+    // last built from or invalidated with.
+    void sync(const QImage &img);
+    // img, the image of the tables, changed only inside rect since
+    void invalidate(const QImage &img, const QRect &rect);
+    void clear();
+
+    bool isNull() const { return m_area.isEmpty(); }
+    // True if the tables are up to date with img over rect, so that
+    // queries on rect need no sync()
+    bool isFresh(const QImage &img, const QRect &rect) const;
+    QRect area() const { return m_area; }
+
+    // Rect and mask arguments are in image coordinates, clipped to area()
+    quint64 sum(Channel c, const QRect &rect) const;
+    quint64 sumSquares(Channel c, const QRect &rect) const;
+    double mean(Channel c, const QRect &rect) const;
+    double variance(Channel c, const QRect &rect) const;
+
+    // One lookup per span
+    quint64 sum(Channel c, const SpanMask &mask) const;
+    quint64 sumSquares(Channel c, const SpanMask &mask) const;
+    double mean(Channel c, const SpanMask &mask) const;
+    double variance(Channel c, const SpanMask &mask) const;
+
+  private:
+    void rebuild(const QImage &img, int fromRow);
+    quint64 tableSum(const QVector<quint32> &table, Channel c,
+                     const QRect &rect, qint64 limit) const;
+    quint64 tableSum(const QVector<quint32> &table, Channel c,
+                     const SpanMask &mask, qint64 limit) const;
+
+    QVector<quint32> m_sums;
+    QVector<quint32> m_squares;
+    QRect m_area;
+    int m_stride;       // entries per table row
+    int m_validRows;    // rows of area the tables are up to date for
+    qint64 m_key;       // cacheKey() of the image
+};
+
+#endif // INTEGRAL_H
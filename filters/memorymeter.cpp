@@ -0,0 +1,178 @@
+#include <QDateTime>
+#include <QFile>
+#include <QMutexLocker>
+#include <QTextStream>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#include "memorymeter.h"
+
+static QString megabytes(qint64 bytes)
+{
+  return QString::number(bytes/(1024.0*1024.0), 'f', 1);
+}
+
+MemoryMeter &MemoryMeter::instance()
+{
+  static MemoryMeter meter;
+  return meter;
+}
+
+MemoryMeter::MemoryMeter()
+  : m_live(0)
+{
+}
+
+void MemoryMeter::allocated(const char *site, qint64 bytes)
+{
+  QMutexLocker lock(&m_mutex);
+  foreach (MemoryMeasure *m, m_measures)
+  {
+    m->m_stats.allocated += bytes;
+    m->m_stats.allocations++;
+    m->m_stats.sites[site] += bytes;
+  }
+}
+
+void MemoryMeter::acquired(qint64 bytes)
+{
+  QMutexLocker lock(&m_mutex);
+  m_live += bytes;
+  foreach (MemoryMeasure *m, m_measures)
+    m->m_stats.peak = qMax(m->m_stats.peak, m_live - m->m_startLive);
+  sampleHeap();
+}
+
+void MemoryMeter::released(qint64 bytes)
+{
+  QMutexLocker lock(&m_mutex);
+  m_live -= bytes;
+}
+
+void MemoryMeter::copied(const char *site, const QImage &img)
+{
+  qint64 bytes = img.byteCount();
+  QMutexLocker lock(&m_mutex);
+  foreach (MemoryMeasure *m, m_measures)
+  {
+    m->m_stats.copies++;
+    m->m_stats.copied += bytes;
+    m->m_stats.sites[site] += bytes;
+  }
+  sampleHeap();
+}
+
+qint64 MemoryMeter::heapBytes()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  struct mallinfo2 info = mallinfo2();
+  return qint64(info.uordblks) + qint64(info.hblkhd);
+#elif defined(__GLIBC__)
+  // Fields are int and wrap past 2 GB; unsigned gets 4 GB
+  struct mallinfo info = mallinfo();
+  return qint64(unsigned(info.uordblks)) + qint64(unsigned(info.hblkhd));
+#else
+  return -1;
+#endif
+}
+
+// Called locked, where buffers are taken: the heap peaks around those
+void MemoryMeter::sampleHeap()
+{
+  if (m_measures.isEmpty())
+    return;
+  qint64 heap = heapBytes();
+  foreach (MemoryMeasure *m, m_measures)
+    m->m_stats.heapPeak = qMax(m->m_stats.heapPeak, heap);
+}
+
+void MemoryMeter::setLogFile(const QString &path)
+{
+  QMutexLocker lock(&m_mutex);
+  m_logFile = path;
+}
+
+QString MemoryMeter::logFile() const
+{
+  QMutexLocker lock(&m_mutex);
+  return m_logFile;
+}
+
+// ==========
+
+MemoryMeasure::MemoryMeasure(const QString &operation)
+  : m_operation(operation)
+{
+  m_stats.allocated = 0;
+  m_stats.allocations = 0;
+  m_stats.peak = 0;
+  m_stats.copies = 0;
+  m_stats.copied = 0;
+  m_stats.heapPeak = MemoryMeter::heapBytes();
+
+  MemoryMeter &meter = MemoryMeter::instance();
+  QMutexLocker lock(&meter.m_mutex);
+  m_startLive = meter.m_live;
+  meter.m_measures.append(this);
+}
+
+MemoryMeasure::~MemoryMeasure()
+{
+  MemoryMeter &meter = MemoryMeter::instance();
+  QMutexLocker lock(&meter.m_mutex);
+  meter.m_measures.removeOne(this);
+}
+
+MemoryStats MemoryMeasure::stats() const
+{
+  MemoryMeter &meter = MemoryMeter::instance();
+  QMutexLocker lock(&meter.m_mutex);
+  MemoryStats res = m_stats;
+  // The heap at the end counts too
+  res.heapPeak = qMax(res.heapPeak, MemoryMeter::heapBytes());
+  return res;
+}
+
+bool MemoryMeasure::isEmpty() const
+{
+  MemoryStats s = stats();
+  return s.allocations == 0 && s.copies == 0 && s.peak == 0;
+}
+
+QString MemoryMeasure::summary() const
+{
+  MemoryStats s = stats();
+  QString res = QString("%1 MB allocated, peak %2 MB, %3 image copies")
+                  .arg(megabytes(s.allocated)).arg(megabytes(s.peak)).arg(s.copies);
+  if (s.heapPeak >= 0)
+    res += QString(", heap %1 MB").arg(megabytes(s.heapPeak));
+  return res;
+}
+
+void MemoryMeasure::log() const
+{
+  QString path = MemoryMeter::instance().logFile();
+  if (path.isEmpty())
+    return;
+
+  QFile file(path);
+  if (!file.open(QIODevice::WriteOnly | QIODevice::Append | QIODevice::Text))
+    return;
+
+  // Bytes throughout; sites as site.<name>=<bytes>
+  MemoryStats s = stats();
+  QTextStream out(&file);
+  out << QDateTime::currentDateTime().toString(Qt::ISODate)
+      << " operation=\"" << m_operation << "\""
+      << " allocated=" << s.allocated
+      << " allocations=" << s.allocations
+      << " peak=" << s.peak
+      << " copies=" << s.copies
+      << " copied=" << s.copied
+      << " heap_peak=" << s.heapPeak;
+  for (QMap<QByteArray, qint64>::const_iterator i=s.sites.constBegin();
+       i!=s.sites.constEnd(); ++i)
+    out << " site." << i.key() << "=" << i.value();
+  out << "\n";
+}
@@ -0,0 +1,117 @@
+#ifndef MEMORYMETER_H
+#define MEMORYMETER_H
+
+#include <QImage>
+#include <QList>
+#include <QMap>
+#include <QMutex>
+#include <QString>
+
+class MemoryMeasure;
+
+struct MemoryStats
+{
+    qint64 allocated;       // bytes newly allocated
+    int allocations;
+    qint64 peak;            // high-water of the buffers in use, above the start
+    int copies;             // full-image copies, detaches included
+    qint64 copied;          // bytes of those copies
+    qint64 heapPeak;        // heap in use as sampled, -1 if unknown
+    QMap<QByteArray, qint64> sites;     // allocated and copied bytes by site
+};
+
+/** Accounting of the large buffers. Sites report scratch buffers taken
+ * and given back, new allocations and full-image copies, each under a
+ * short site name; every MemoryMeasure alive at the time collects them.
+ * Reports come from any thread, so a measure also sees what other work,
+ * such as a batch job, does meanwhile. Thread-safe.
+ */
+class MemoryMeter
+{
+  public:
+    static MemoryMeter &instance();
+
+    // bytes newly allocated at site; acquired() follows if it is in use
+    void allocated(const char *site, qint64 bytes);
+    // A buffer of bytes taken into use, or given back
+    void acquired(qint64 bytes);
+    void released(qint64 bytes);
+    // A full copy of img was made at site
+    void copied(const char *site, const QImage &img);
+
+    // Bytes in use on the heap, -1 where the C library doesn't tell
+    static qint64 heapBytes();
+
+    // One line per measure logged is appended to path; empty disables
+    void setLogFile(const QString &path);
+    QString logFile() const;
+
+  private:
+    friend class MemoryMeasure;
+    MemoryMeter();
+    void sampleHeap();
+
+    mutable QMutex m_mutex;
+    QList<MemoryMeasure *> m_measures;
+    qint64 m_live;
+    QString m_logFile;
+};
+
+/** Collects the reports to MemoryMeter from construction on. */
+class MemoryMeasure
+{
+  public:
+    explicit MemoryMeasure(const QString &operation);
+    ~MemoryMeasure();
+
+    MemoryStats stats() const;
+    bool isEmpty() const;
+    // Short form for the status bar
+    QString summary() const;
+    // Append a line of key=value fields to the meter's log file
+    void log() const;
+
+  private:
+    Q_DISABLE_COPY(MemoryMeasure)
+    friend class MemoryMeter;
+
+    QString m_operation;
+    qint64 m_startLive;
+    MemoryStats m_stats;
+};
+
+/** Counts a copy at site when img no longer holds the pixel data it had
+ * at construction or at the last check, as after a detach. rebase()
+ * accepts a replacement made on purpose.
+ */
+class DetachWatch
+{
+  public:
+    DetachWatch(const char *site, const QImage &img)
+      : m_site(site), m_image(img)
+    {
+      rebase();
+    }
+    ~DetachWatch() { check(); }
+
+    void check()
+    {
+      if (!m_image.isNull() && m_image.size() == m_size && m_image.constBits() != m_bits)
+        MemoryMeter::instance().copied(m_site, m_image);
+      rebase();
+    }
+
+    void rebase()
+    {
+      m_bits = m_image.constBits();
+      m_size = m_image.size();
+    }
+
+  private:
+    const char *m_site;
+    const QImage &m_image;
+    const uchar *m_bits;
+    QSize m_size;
+};
+
+#endif // MEMORYMETER_H
@@ -0,0 +1,215 @@
+#include <cstring>
+
+#include "morphology.h"
+#include "convolution.h"
+#include "memorymeter.h"
+#include "pixelformat.h"
+#include "scratchpool.h"
+#include "tuning.h"
+
+// Rows [first, last) of dst for the row pass, bytes [first, last) of every
+// row for the column pass
+struct MorphologyJob
+{
+    bool max;
+    const QImage *src;
+    QImage *dst;
+    // Column pass: running extrema from the start and from the end of
+    // each block of size rows
+    QImage *forward, *backward;
+    // Window along the pass
+    int size;
+    // Row pass: position in src of the window of dst pixel (0, 0)
+    int offsetX, offsetY;
+    int first, last;
+};
+
+// Channel by channel, so that the compiler can vectorize it
+template<bool Max>
+static inline void combine(uchar *dst, const uchar *a, const uchar *b, int n)
+{
+  for (int i=0; i<n; i++)
+    dst[i] = Max ? qMax(a[i], b[i]) : qMin(a[i], b[i]);
+}
+
+template<bool Max>
+static void rowPass(const MorphologyJob &job)
+{
+  int n = job.size;
+  int w = job.dst->width();
+  // Pixels under the windows of a row, in blocks of n
+  int len = w + n - 1;
+  int bpp = job.src->depth()/8;
+  QVector<uchar> forward(len*bpp), backward(len*bpp);
+  uchar *g = forward.data(), *h = backward.data();
+
+  for (int y=job.first; y<job.last; y++)
+  {
+    const uchar *p = job.src->constScanLine(y + job.offsetY) + job.offsetX*bpp;
+    for (int i=0; i<len; i++)
+      if (i % n == 0)
+        memcpy(g + i*bpp, p + i*bpp, bpp);
+      else
+        combine<Max>(g + i*bpp, g + (i-1)*bpp, p + i*bpp, bpp);
+    for (int i=len-1; i>=0; i--)
+      if (i % n == n-1 || i == len-1)
+        memcpy(h + i*bpp, p + i*bpp, bpp);
+      else
+        combine<Max>(h + i*bpp, h + (i+1)*bpp, p + i*bpp, bpp);
+    // The window [x, x+n) ends h's block of x and starts g's block of x+n-1
+    combine<Max>(job.dst->scanLine(y), h, g + (n-1)*bpp, w*bpp);
+  }
+}
+
+template<bool Max>
+static void columnPass(const MorphologyJob &job)
+{
+  int n = job.size;
+  int len = job.src->height();
+  int first = job.first, bytes = job.last - job.first;
+
+  // Same recurrences as the row pass, whole row segments at a time
+  for (int i=0; i<len; i++)
+  {
+    const uchar *p = job.src->constScanLine(i) + first;
+    uchar *g = job.forward->scanLine(i) + first;
+    if (i % n == 0)
+      memcpy(g, p, bytes);
+    else
+      combine<Max>(g, job.forward->constScanLine(i-1) + first, p, bytes);
+  }
+  for (int i=len-1; i>=0; i--)
+  {
+    const uchar *p = job.src->constScanLine(i) + first;
+    uchar *h = job.backward->scanLine(i) + first;
+    if (i % n == n-1 || i == len-1)
+      memcpy(h, p, bytes);
+    else
+      combine<Max>(h, job.backward->constScanLine(i+1) + first, p, bytes);
+  }
+  for (int y=0; y<job.dst->height(); y++)
+    combine<Max>(job.dst->scanLine(y) + first, job.backward->constScanLine(y) + first,
+                 job.forward->constScanLine(y + n-1) + first, bytes);
+}
+
+static void rowJob(MorphologyJob &job)
+{
+  if (job.max)
+    rowPass<true>(job);
+  else
+    rowPass<false>(job);
+}
+
+static void columnJob(MorphologyJob &job)
+{
+  if (job.max)
+    columnPass<true>(job);
+  else
+    columnPass<false>(job);
+}
+
+// Maximum or minimum of the window around each pixel of src into dst.
+// Both 32-bit or gray, and of the same size.
+static void extremum(const QImage &src, QImage &dst, int width, int height, bool max)
+{
+  int hx = width/2, hy = height/2;
+  int pad = qMax(hx, hy);
+  ScratchImage grown(grownSize(src, pad), src.format(), "grow");
+  grow(src, pad, grown.image());
+
+  // Rows: the height-1 extra rows are the input of the column pass
+  ScratchImage rows(QSize(src.width(), src.height() + height-1), src.format(),
+                    "morphology passes");
+  MorphologyJob job;
+  job.max = max;
+  job.src = &grown.image();
+  job.dst = &rows.image();
+  job.forward = job.backward = 0;
+  job.size = width;
+  job.offsetX = pad - hx;
+  job.offsetY = pad - hy;
+  runBands(rows.image(), rowBands(0, rows.image().height()-1), job, rowJob);
+
+  ScratchImage forward(rows.image().size(), src.format(), "morphology passes");
+  ScratchImage backward(rows.image().size(), src.format(), "morphology passes");
+  job.src = &rows.image();
+  job.dst = &dst;
+  job.forward = &forward.image();
+  job.backward = &backward.image();
+  job.size = height;
+  job.offsetX = job.offsetY = 0;
+  runBands(dst, columnBands(src.width()*src.depth()/8, 64), job, columnJob);
+}
+
+QSize morphologyHalo(MorphologyOp op, int width, int height)
+{
+  // Open, close and top-hat run two passes
+  int stages = op == Dilate || op == Erode ? 1 : 2;
+  return QSize(width/2*stages, height/2*stages);
+}
+
+void morphology(QImage &img, const SpanMask &mask, MorphologyOp op, int width, int height)
+{
+  if (mask.isEmpty())
+    return;
+
+  QSize halo = morphologyHalo(op, width, height);
+  QRect input = mask.boundingRect().adjusted(-halo.width(), -halo.height(),
+                                             halo.width(), halo.height()) & img.rect();
+  QImage src = img.copy(input);
+  MemoryMeter::instance().allocated("morphology input", src.byteCount());
+  bool gray = isGray(src);
+  if (src.depth() != 32 && !gray)
+    src = src.convertToFormat(QImage::Format_ARGB32);
+
+  ScratchImage res(src.size(), src.format(), "morphology");
+  switch (op)
+  {
+  case Dilate:
+    extremum(src, res.image(), width, height, true);
+    break;
+  case Erode:
+    extremum(src, res.image(), width, height, false);
+    break;
+  case Open:
+  case TopHat:
+    {
+      ScratchImage tmp(src.size(), src.format(), "morphology");
+      extremum(src, tmp.image(), width, height, false);
+      extremum(tmp.image(), res.image(), width, height, true);
+    }
+    break;
+  case Close:
+    {
+      ScratchImage tmp(src.size(), src.format(), "morphology");
+      extremum(src, tmp.image(), width, height, true);
+      extremum(tmp.image(), res.image(), width, height, false);
+    }
+    break;
+  }
+
+  if (op == TopHat && gray)
+  {
+    for (int y=0; y<src.height(); y++)
+    {
+      const uchar *s = src.constScanLine(y);
+      uchar *d = res.image().scanLine(y);
+      for (int x=0; x<src.width(); x++)
+        d[x] = s[x] - d[x];
+    }
+  }
+  else if (op == TopHat)
+  {
+    // The opening is below the image in every channel; alpha is kept
+    for (int y=0; y<src.height(); y++)
+    {
+      const QRgb *s = reinterpret_cast<const QRgb *>(src.constScanLine(y));
+      QRgb *d = reinterpret_cast<QRgb *>(res.image().scanLine(y));
+      for (int x=0; x<src.width(); x++)
+        d[x] = qRgba(qRed(s[x]) - qRed(d[x]), qGreen(s[x]) - qGreen(d[x]),
+                     qBlue(s[x]) - qBlue(d[x]), qAlpha(s[x]));
+    }
+  }
+
+  copySpans(img, res.image(), mask, input.topLeft());
+}
@@ -0,0 +1,25 @@
+#ifndef MORPHOLOGY_H
+#define MORPHOLOGY_H
+
+#include <QImage>
+#include "spanmask.h"
+
+enum MorphologyOp
+{
+  Dilate,   // Maximum over the window
+  Erode,    // Minimum over the window
+  Open,     // Erode, then dilate: removes small bright details
+  Close,    // Dilate, then erode: fills small dark details
+  TopHat    // Image minus its opening: the small bright details
+};
+
+/* Morphology with a width x height rectangle (odd sizes), per channel.
+ * Van Herk/Gil-Werman: separate row and column passes, each taking
+ * three comparisons per pixel whatever the window size. Borders repeat
+ * the edge pixels, as for the median.
+ */
+void morphology(QImage &img, const SpanMask &mask, MorphologyOp op, int width, int height);
+// Reach of op beyond the selection
+QSize morphologyHalo(MorphologyOp op, int width, int height);
+
+#endif // MORPHOLOGY_H
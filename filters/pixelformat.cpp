@@ -0,0 +1,61 @@
+#include <cstring>
+#include <QVector>
+#include "pixelformat.h"
+
+static QVector<QRgb> makeGrayTable()
+{
+  QVector<QRgb> table(256);
+  for (int i=0; i<256; i++)
+    table[i] = qRgb(i, i, i);
+  return table;
+}
+
+static const QVector<QRgb> grayTable = makeGrayTable();
+
+bool isGray(const QImage &img)
+{
+  return img.format() == QImage::Format_Indexed8 && img.colorTable() == grayTable;
+}
+
+QImage grayImage(const QSize &size)
+{
+  QImage res(size, QImage::Format_Indexed8);
+  res.setColorTable(grayTable);
+  return res;
+}
+
+void setGrayTable(QImage &img)
+{
+  img.setColorTable(grayTable);
+}
+
+QImage toGray(const QImage &img)
+{
+  if (img.depth() > 8 || img.isNull())
+    return QImage();
+  if (isGray(img))
+    return img;
+
+  QImage src = img.format() == QImage::Format_Indexed8
+      ? img : img.convertToFormat(QImage::Format_Indexed8);
+  QVector<QRgb> colors = src.colorTable();
+  uchar levels[256];
+  memset(levels, 0, sizeof(levels));
+  for (int i=0; i<colors.size(); i++)
+  {
+    QRgb c = colors[i];
+    if (qAlpha(c) != 255 || qRed(c) != qGreen(c) || qGreen(c) != qBlue(c))
+      return QImage();
+    levels[i] = qRed(c);
+  }
+
+  QImage res = grayImage(src.size());
+  for (int y=0; y<src.height(); y++)
+  {
+    const uchar *s = src.constScanLine(y);
+    uchar *d = res.scanLine(y);
+    for (int x=0; x<src.width(); x++)
+      d[x] = levels[s[x]];
+  }
+  return res;
+}
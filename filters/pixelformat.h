@@ -0,0 +1,51 @@
+#ifndef PIXELFORMAT_H
+#define PIXELFORMAT_H
+
+#include <QImage>
+
+/** Grayscale images keep one byte per pixel. Qt 4 has no grayscale
+ * format, so they are 8-bit indexed images whose color table maps each
+ * index to the gray of that level: kernels read the index as the level,
+ * and everything else still sees gray pixels through pixel().
+ * Kernels are specialized on the channel count through Pixels<1> for
+ * these and Pixels<3> for 32-bit images, whose results are opaque.
+ */
+bool isGray(const QImage &img);
+// Gray image of size with the identity table, uninitialized
+QImage grayImage(const QSize &size);
+// Give img, 8-bit indexed, the identity table
+void setGrayTable(QImage &img);
+// img as a gray image if it has at most 8 bits per pixel and only gray
+// colors, else a null image
+QImage toGray(const QImage &img);
+
+template<int Channels> struct Pixels;
+
+template<> struct Pixels<1>
+{
+    typedef uchar Type;
+    static int level(Type p, int) { return p; }
+    static Type pack(const int *v) { return Type(v[0]); }
+};
+
+template<> struct Pixels<3>
+{
+    typedef QRgb Type;
+    // Channels 0, 1, 2 are red, green, blue
+    static int level(Type p, int c) { return (p >> (16 - 8*c)) & 0xff; }
+    static Type pack(const int *v) { return qRgb(v[0], v[1], v[2]); }
+};
+
+template<int Channels>
+inline const typename Pixels<Channels>::Type *constPixelLine(const QImage &img, int y)
+{
+  return reinterpret_cast<const typename Pixels<Channels>::Type *>(img.constScanLine(y));
+}
+
+template<int Channels>
+inline typename Pixels<Channels>::Type *pixelLine(QImage &img, int y)
+{
+  return reinterpret_cast<typename Pixels<Channels>::Type *>(img.scanLine(y));
+}
+
+#endif // PIXELFORMAT_H
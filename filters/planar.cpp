@@ -0,0 +1,174 @@
+#include <cstring>
+#include "planar.h"
+#include "memorymeter.h"
+
+static const int alignment = 32;
+static const int strideAlign = alignment/sizeof(float);
+
+static const float k255 = 1.0f/255.0f;
+
+PlanarImage::PlanarImage()
+  : m_width(0), m_height(0), m_stride(0)
+{
+  for (int p=0; p<PlaneCount; p++)
+    m_planes[p] = 0;
+}
+
+PlanarImage::PlanarImage(int width, int height)
+  : m_width(0), m_height(0), m_stride(0)
+{
+  for (int p=0; p<PlaneCount; p++)
+    m_planes[p] = 0;
+  allocate(width, height);
+}
+
+PlanarImage::PlanarImage(const QImage &img)
+  : m_width(0), m_height(0), m_stride(0)
+{
+  for (int p=0; p<PlaneCount; p++)
+    m_planes[p] = 0;
+  allocate(img.width(), img.height());
+  fromImage(img, img.rect());
+}
+
+PlanarImage::PlanarImage(const PlanarImage &other)
+  : m_width(0), m_height(0), m_stride(0)
+{
+  for (int p=0; p<PlaneCount; p++)
+    m_planes[p] = 0;
+  *this = other;
+}
+
+PlanarImage::~PlanarImage()
+{
+  release();
+}
+
+PlanarImage &PlanarImage::operator=(const PlanarImage &other)
+{
+  if (this == &other)
+    return *this;
+
+  if (size() != other.size())
+  {
+    release();
+    allocate(other.m_width, other.m_height);
+  }
+  for (int p=0; p<PlaneCount; p++)
+    if (m_planes[p])
+      memcpy(m_planes[p], other.m_planes[p], m_stride*m_height*sizeof(float));
+  return *this;
+}
+
+void PlanarImage::allocate(int width, int height)
+{
+  m_width = width;
+  m_height = height;
+  m_stride = (width + strideAlign-1) / strideAlign * strideAlign;
+  if (isNull())
+    return;
+
+  for (int p=0; p<PlaneCount; p++)
+    m_planes[p] = static_cast<float *>(
+          qMallocAligned(m_stride*m_height*sizeof(float), alignment));
+  MemoryMeter::instance().allocated("planar", qint64(PlaneCount)*m_stride*m_height*sizeof(float));
+}
+
+void PlanarImage::release()
+{
+  for (int p=0; p<PlaneCount; p++)
+  {
+    qFreeAligned(m_planes[p]);
+    m_planes[p] = 0;
+  }
+  m_width = m_height = m_stride = 0;
+}
+
+void PlanarImage::fill(int plane, const QRect &rect, float value)
+{
+  QRect r = rect & this->rect();
+  for (int y=r.top(); y<=r.bottom(); y++)
+  {
+    float *dst = line(plane, y);
+    for (int x=r.left(); x<=r.right(); x++)
+      dst[x] = value;
+  }
+}
+
+PlanarImage PlanarImage::copy(const QRect &rect) const
+{
+  QRect r = rect & this->rect();
+  PlanarImage res(r.width(), r.height());
+  for (int p=0; p<PlaneCount; p++)
+    for (int y=0; y<r.height(); y++)
+      memcpy(res.line(p, y), line(p, r.top() + y) + r.left(), r.width()*sizeof(float));
+  return res;
+}
+
+void PlanarImage::fromImage(const QImage &img, const QRect &rect)
+{
+  Q_ASSERT(img.size() == size());
+  QRect r = rect & this->rect();
+  for (int y=r.top(); y<=r.bottom(); y++)
+  {
+    float *red = line(Red, y);
+    float *green = line(Green, y);
+    float *blue = line(Blue, y);
+    float *alpha = line(Alpha, y);
+    const QRgb *src = reinterpret_cast<const QRgb *>(img.constScanLine(y));
+    for (int x=r.left(); x<=r.right(); x++)
+    {
+      QRgb c = src[x];
+      red[x]   = qRed(c)   * k255;
+      green[x] = qGreen(c) * k255;
+      blue[x]  = qBlue(c)  * k255;
+      alpha[x] = qAlpha(c) * k255;
+    }
+  }
+}
+
+static inline int pack(float v)
+{
+  return int(qBound(0.0f, v, 1.0f) * 255.0f + 0.5f);
+}
+
+void PlanarImage::toImage(QImage &img, const QRect &rect) const
+{
+  Q_ASSERT(img.size() == size());
+  QRect r = rect & this->rect();
+  for (int y=r.top(); y<=r.bottom(); y++)
+  {
+    const float *red = line(Red, y);
+    const float *green = line(Green, y);
+    const float *blue = line(Blue, y);
+    const float *alpha = line(Alpha, y);
+    QRgb *dst = reinterpret_cast<QRgb *>(img.scanLine(y));
+    if (img.hasAlphaChannel())
+      for (int x=r.left(); x<=r.right(); x++)
+        dst[x] = qRgba(pack(red[x]), pack(green[x]), pack(blue[x]), pack(alpha[x]));
+    else
+      for (int x=r.left(); x<=r.right(); x++)
+        dst[x] = qRgb(pack(red[x]), pack(green[x]), pack(blue[x]));
+  }
+}
+
+QImage PlanarImage::toImage() const
+{
+  QImage img(size(), QImage::Format_ARGB32);
+  toImage(img, rect());
+  return img;
+}
+
+void copySpans(PlanarImage &dst, const PlanarImage &src, const SpanMask &mask,
+               const QPoint &offset)
+{
+  const QVector<Span> &spans = mask.spans();
+  for (int p=0; p<PlanarImage::PlaneCount; p++)
+    for (int i=0; i<spans.size(); i++)
+    {
+      const Span &s = spans[i];
+      memcpy(dst.line(p, s.y) + s.x1,
+             src.line(p, s.y - offset.y()) + s.x1 - offset.x(),
+             (s.x2 - s.x1 + 1)*sizeof(float));
+    }
+}
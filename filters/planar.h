@@ -0,0 +1,58 @@
+#ifndef PLANAR_H
+#define PLANAR_H
+
+#include <QImage>
+#include "spanmask.h"
+
+/** Floating-point working image.
+ * Channels are stored in separate 32-byte aligned float planes [0.0, 1.0],
+ * rows padded to a multiple of 8 floats, so kernels can process
+ * whole rows of a single channel with SIMD-friendly loops.
+ */
+class PlanarImage
+{
+  public:
+    enum Plane { Red, Green, Blue, Alpha, PlaneCount };
+
+    PlanarImage();
+    PlanarImage(int width, int height);
+    explicit PlanarImage(const QImage &img);
+    PlanarImage(const PlanarImage &other);
+    ~PlanarImage();
+
+    PlanarImage &operator=(const PlanarImage &other);
+
+    bool isNull() const { return m_width == 0 || m_height == 0; }
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+    QSize size() const { return QSize(m_width, m_height); }
+    QRect rect() const { return QRect(0, 0, m_width, m_height); }
+    int stride() const { return m_stride; }
+
+    float *line(int plane, int y) { return m_planes[plane] + m_stride*y; }
+    const float *line(int plane, int y) const { return m_planes[plane] + m_stride*y; }
+
+    void fill(int plane, const QRect &rect, float value);
+    // The part of the image in rect, as QImage::copy()
+    PlanarImage copy(const QRect &rect) const;
+
+    // Unpack rect of img (same size) into the planes
+    void fromImage(const QImage &img, const QRect &rect);
+    // Pack rect of the planes into img (same size)
+    void toImage(QImage &img, const QRect &rect) const;
+    QImage toImage() const;
+
+  private:
+    void allocate(int width, int height);
+    void release();
+
+    int m_width, m_height, m_stride;
+    float *m_planes[PlaneCount];
+};
+
+// Copy masked pixels of all planes from src, whose origin is at offset
+// in dst
+void copySpans(PlanarImage &dst, const PlanarImage &src, const SpanMask &mask,
+               const QPoint &offset = QPoint(0, 0));
+
+#endif // PLANAR_H
@@ -0,0 +1,554 @@
+#include <cmath>
+#include <cstdlib>
+#include <QtAlgorithms>
+#include <QVector>
+
+#include "reference.h"
+#include "histogram.h"
+#include "rgbv.h"
+
+#ifndef M_PI
+#define M_PI 3.1415926535897932385
+#endif
+
+namespace reference
+{
+
+static QImage grow(const QImage &img, int size)
+{
+  QImage res(img.width() + size*2, img.height() + size*2, img.format());
+  for (int y=0; y<res.height(); y++)
+    for (int x=0; x<res.width(); x++)
+    {
+      int ox = qBound(0, x-size, img.width()-1);
+      int oy = qBound(0, y-size, img.height()-1);
+      res.setPixel(x, y, img.pixel(ox, oy));
+    }
+  return res;
+}
+
+static double decode(int level)
+{
+  double v = level/255.0;
+  return v <= 0.04045 ? v/12.92 : pow((v + 0.055)/1.055, 2.4);
+}
+
+static int encode(double v)
+{
+  v = qBound(0.0, v, 1.0);
+  v = v <= 0.0031308 ? v*12.92 : 1.055*pow(v, 1/2.4) - 0.055;
+  return int(v*255 + 0.5);
+}
+
+static QRgb apply(const QImage &img, const Matrix<double> &m, int x, int y, bool linear)
+{
+  RGBV acc;
+  int size = (m.size()-1)/2;
+  for (int dy=0; dy<m.size(); dy++)
+    for (int dx=0; dx<m.size(); dx++)
+    {
+      QRgb c = img.pixel(x+dx-size, y+dy-size);
+      acc.addk(linear ? RGBV(decode(qRed(c)), decode(qGreen(c)), decode(qBlue(c))) : RGBV(c),
+               m.at(dx, dy));
+    }
+  acc.clamp();
+  if (linear)
+    return qRgb(encode(acc.r), encode(acc.g), encode(acc.b));
+  return acc.toQRgb();
+}
+
+void convolve(QImage &img, const QRect &rect, const Matrix<double> &m, bool linear)
+{
+  int size = (m.size()-1)/2;
+  QImage tmp = grow(img, size);
+
+  for (int y=rect.top(); y<=rect.bottom(); y++)
+    for (int x=rect.left(); x<=rect.right(); x++)
+      img.setPixel(x, y, apply(tmp, m, x+size, y+size, linear));
+}
+
+// ==========
+
+static uchar findMedian(uchar *vs, int size)
+{
+  qSort(vs, vs+size);
+  return vs[size/2];
+}
+
+static QRgb doMedian(const QImage &img, int size, int x, int y)
+{
+  int fsize = size*size;
+  int hsize = (size-1)/2;
+  Q_ASSERT(fsize <= 256);
+  uchar vs[256];
+
+  QRgb res = qRgb(0, 0, 0);
+  QRgb mask = 0xff;
+  int shift = 0;
+  for (int i=0; i<3; i++)
+  {
+    int p = 0;
+    for (int dx=-hsize; dx<=hsize; dx++)
+      for (int dy=-hsize; dy<=hsize; dy++)
+        vs[p++] = (img.pixel(x+dx, y+dy) & mask) >> shift;
+
+    int m = findMedian(vs, fsize);
+    res |= m << shift;
+    mask <<= 8;
+    shift += 8;
+  }
+  return res;
+}
+
+void median(QImage &img, const QRect &rect, int size)
+{
+  int hsize = (size-1)/2;
+  QImage tmp = grow(img, hsize);
+
+  for (int y=rect.top(); y<=rect.bottom(); y++)
+    for (int x=rect.left(); x<=rect.right(); x++)
+      img.setPixel(x, y, doMedian(tmp, size, x+hsize, y+hsize));
+}
+
+// ==========
+
+void boxblur(QImage &img, const QRect &rect, int radius)
+{
+  QImage src = img;
+  for (int y=rect.top(); y<=rect.bottom(); y++)
+    for (int x=rect.left(); x<=rect.right(); x++)
+    {
+      QRect window = QRect(x-radius, y-radius, 2*radius+1, 2*radius+1) & src.rect();
+      int n = window.width()*window.height();
+      int r = 0, g = 0, b = 0;
+      for (int wy=window.top(); wy<=window.bottom(); wy++)
+        for (int wx=window.left(); wx<=window.right(); wx++)
+        {
+          QRgb c = src.pixel(wx, wy);
+          r += qRed(c);
+          g += qGreen(c);
+          b += qBlue(c);
+        }
+      img.setPixel(x, y, qRgb((r + n/2)/n, (g + n/2)/n, (b + n/2)/n));
+    }
+}
+
+// Bilateral grid cell by cell: sums of the pixels nearest to each cell,
+// the [1 2 1] blur along all three axes as one 3x3x3 kernel, and
+// trilinear interpolation at each pixel
+void bilateral(QImage &img, const QRect &rect, int sigmaSpace, int sigmaRange)
+{
+  static const int pad = 2;
+  QImage src = img;
+  int s = sigmaSpace, r = sigmaRange;
+  int w = (src.width()-1 + s/2)/s + 1 + 2*pad;
+  int h = (src.height()-1 + s/2)/s + 1 + 2*pad;
+  int d = (255 + r/2)/r + 1 + 2*pad;
+
+  QVector<double> sums(w*h*d*4, 0);
+  for (int y=0; y<src.height(); y++)
+    for (int x=0; x<src.width(); x++)
+    {
+      QRgb c = src.pixel(x, y);
+      int i = (((y + s/2)/s + pad)*w + (x + s/2)/s + pad)*d + (qGray(c) + r/2)/r + pad;
+      sums[i*4]   += qRed(c);
+      sums[i*4+1] += qGreen(c);
+      sums[i*4+2] += qBlue(c);
+      sums[i*4+3] += 1;
+    }
+
+  for (int y=rect.top(); y<=rect.bottom(); y++)
+    for (int x=rect.left(); x<=rect.right(); x++)
+    {
+      QRgb c = src.pixel(x, y);
+      double fx = double(x)/s, fy = double(y)/s, fz = double(qGray(c))/r;
+      int gx = int(fx), gy = int(fy), gz = int(fz);
+
+      double acc[4] = { 0, 0, 0, 0 };
+      for (int kz=0; kz<=1; kz++)
+        for (int ky=0; ky<=1; ky++)
+          for (int kx=0; kx<=1; kx++)
+          {
+            double t = (kx ? fx-gx : 1-(fx-gx))*(ky ? fy-gy : 1-(fy-gy))*
+                       (kz ? fz-gz : 1-(fz-gz));
+            for (int dz=-1; dz<=1; dz++)
+              for (int dy=-1; dy<=1; dy++)
+                for (int dx=-1; dx<=1; dx++)
+                {
+                  double k = t*(2-qAbs(dx))*(2-qAbs(dy))*(2-qAbs(dz));
+                  int i = ((gy+ky+dy+pad)*w + gx+kx+dx+pad)*d + gz+kz+dz+pad;
+                  for (int ch=0; ch<4; ch++)
+                    acc[ch] += k*sums[i*4 + ch];
+                }
+          }
+      if (acc[3] > 0)
+        img.setPixel(x, y, qRgb(qBound(0, int(acc[0]/acc[3] + 0.5), 255),
+                                qBound(0, int(acc[1]/acc[3] + 0.5), 255),
+                                qBound(0, int(acc[2]/acc[3] + 0.5), 255)));
+    }
+}
+
+// Maximum or minimum of each channel over the window, edges repeated
+static QImage extremum(const QImage &src, int width, int height, bool max)
+{
+  QImage res = src.copy();
+  for (int y=0; y<src.height(); y++)
+    for (int x=0; x<src.width(); x++)
+    {
+      int acc[4];
+      for (int wy=y-height/2; wy<=y+height/2; wy++)
+        for (int wx=x-width/2; wx<=x+width/2; wx++)
+        {
+          QRgb c = src.pixel(qBound(0, wx, src.width()-1), qBound(0, wy, src.height()-1));
+          int v[4] = { qRed(c), qGreen(c), qBlue(c), qAlpha(c) };
+          for (int ch=0; ch<4; ch++)
+            if (wx == x-width/2 && wy == y-height/2)
+              acc[ch] = v[ch];
+            else
+              acc[ch] = max ? qMax(acc[ch], v[ch]) : qMin(acc[ch], v[ch]);
+        }
+      res.setPixel(x, y, qRgba(acc[0], acc[1], acc[2], acc[3]));
+    }
+  return res;
+}
+
+void morphology(QImage &img, const QRect &rect, MorphologyOp op, int width, int height)
+{
+  QImage src = img.convertToFormat(QImage::Format_ARGB32), res;
+  switch (op)
+  {
+  case Dilate: res = extremum(src, width, height, true); break;
+  case Erode:  res = extremum(src, width, height, false); break;
+  case Open:
+  case TopHat: res = extremum(extremum(src, width, height, false), width, height, true); break;
+  case Close:  res = extremum(extremum(src, width, height, true), width, height, false); break;
+  }
+
+  for (int y=rect.top(); y<=rect.bottom(); y++)
+    for (int x=rect.left(); x<=rect.right(); x++)
+    {
+      QRgb c = res.pixel(x, y);
+      if (op == TopHat)
+      {
+        QRgb s = src.pixel(x, y);
+        c = qRgba(qRed(s) - qRed(c), qGreen(s) - qGreen(c), qBlue(s) - qBlue(c), qAlpha(s));
+      }
+      img.setPixel(x, y, c);
+    }
+}
+
+// ==========
+
+static int lumaAt(const QImage &img, int x, int y)
+{
+  return lumaLevel(img.pixel(qBound(0, x, img.width()-1), qBound(0, y, img.height()-1)));
+}
+
+// The full 3x3 kernels
+static void gradientAt(const QImage &img, EdgeOperator op, int x, int y, int &gx, int &gy)
+{
+  int side = op == Sobel ? 1 : 3, center = op == Sobel ? 2 : 10;
+  int w[3] = { side, center, side };
+  gx = gy = 0;
+  for (int i=0; i<3; i++)
+  {
+    gx += w[i]*(lumaAt(img, x+1, y-1+i) - lumaAt(img, x-1, y-1+i));
+    gy += w[i]*(lumaAt(img, x-1+i, y+1) - lumaAt(img, x-1+i, y-1));
+  }
+}
+
+static int edgeNorm(EdgeOperator op)
+{
+  return op == Sobel ? 4 : 16;
+}
+
+void edges(QImage &img, const QRect &rect, EdgeOperator op)
+{
+  QImage src = img.copy();
+  for (int y=rect.top(); y<=rect.bottom(); y++)
+    for (int x=rect.left(); x<=rect.right(); x++)
+    {
+      int gx, gy;
+      gradientAt(src, op, x, y, gx, gy);
+      int v = qMin(255, int(sqrt(double(gx*gx + gy*gy))/edgeNorm(op) + 0.5));
+      img.setPixel(x, y, qRgb(v, v, v));
+    }
+}
+
+static int magnitude2At(const QImage &img, EdgeOperator op, int x, int y)
+{
+  int gx, gy;
+  gradientAt(img, op, x, y, gx, gy);
+  return gx*gx + gy*gy;
+}
+
+void canny(QImage &img, const QRect &rect, EdgeOperator op, int low, int high)
+{
+  QImage src = img.copy();
+  high = qMax(low, high);
+  int w = rect.width(), h = rect.height();
+  // 0 none, 1 weak, 2 strong
+  QVector<int> classes(w*h, 0);
+  for (int y=rect.top(); y<=rect.bottom(); y++)
+    for (int x=rect.left(); x<=rect.right(); x++)
+    {
+      int gx, gy;
+      gradientAt(src, op, x, y, gx, gy);
+      int m = gx*gx + gy*gy;
+      double magnitude = sqrt(double(m));
+      if (magnitude <= low*edgeNorm(op))
+        continue;
+
+      double angle = atan2(double(gy), double(gx))*180/M_PI;
+      if (angle < 0)
+        angle += 180;
+      int dx, dy;
+      if (angle < 22.5 || angle >= 157.5)
+        dx = 1, dy = 0;
+      else if (angle < 67.5)
+        dx = 1, dy = 1;
+      else if (angle < 112.5)
+        dx = 0, dy = 1;
+      else
+        dx = -1, dy = 1;
+      if (m > magnitude2At(src, op, x-dx, y-dy) && m >= magnitude2At(src, op, x+dx, y+dy))
+        classes[(y - rect.top())*w + x - rect.left()] = magnitude > high*edgeNorm(op) ? 2 : 1;
+    }
+
+  bool changed = true;
+  while (changed)
+  {
+    changed = false;
+    for (int y=0; y<h; y++)
+      for (int x=0; x<w; x++)
+        for (int ny=qMax(0, y-1); ny<=qMin(h-1, y+1); ny++)
+          for (int nx=qMax(0, x-1); nx<=qMin(w-1, x+1); nx++)
+            if (classes[y*w + x] == 1 && classes[ny*w + nx] == 2)
+            {
+              classes[y*w + x] = 2;
+              changed = true;
+            }
+  }
+
+  for (int y=0; y<h; y++)
+    for (int x=0; x<w; x++)
+    {
+      int v = classes[y*w + x] == 2 ? 255 : 0;
+      img.setPixel(rect.left() + x, rect.top() + y, qRgb(v, v, v));
+    }
+}
+
+// ==========
+
+// Normal distribution approximation in [-1..1]
+static double rand_n()
+{
+  static const int q = 12;
+  double sum = 0;
+  for (int i=0; i<q; i++)
+    sum += double(rand())/double(RAND_MAX);
+  sum -= q/2.0;
+  sum /= q/2.0;
+  return sum;
+}
+
+static int variate(int min, int base, int max, int radius)
+{
+  int d = rand_n() * radius;
+  return qBound(min, base+d, max);
+}
+
+void glass(QImage &img, const QRect &rect, int radius, int samples)
+{
+  QImage src = img;
+  for (int y=rect.top(); y<=rect.bottom(); y++)
+    for (int x=rect.left(); x<=rect.right(); x++)
+    {
+      RGBV acc;
+      double k = 1.0/samples;
+      for (int i=0; i<samples; i++)
+      {
+        int px = variate(0, x, img.width()-1, radius);
+        int py = variate(0, y, img.height()-1, radius);
+        acc.addk(src.pixel(px, py), k);
+      }
+      img.setPixel(x, y, acc.toQRgb());
+    }
+}
+
+// ==========
+
+void transform(QImage &img, const QRect &rect, const Transform &t, bool linear)
+{
+  QImage src = img;
+  for (int y=0; y<img.height(); y++)
+    for (int x=0; x<img.width(); x++)
+    {
+      // Bilinear sample of rect at t(x, y). Corners outside rect take the
+      // nearest pixel of rect, with zero alpha.
+      double px, py;
+      t(x, y, px, py);
+      int x0 = int(floor(px)), y0 = int(floor(py));
+      double h = px - x0, v = py - y0;
+      double c[3] = { 0, 0, 0 }, alpha = 0;
+      for (int i=0; i<4; i++)
+      {
+        int sx = x0 + i%2, sy = y0 + i/2;
+        double w = (i%2 ? h : 1-h) * (i/2 ? v : 1-v);
+        QRgb p = src.pixel(qBound(rect.left(), sx, rect.right()),
+                           qBound(rect.top(), sy, rect.bottom()));
+        int levels[3] = { qRed(p), qGreen(p), qBlue(p) };
+        for (int ch=0; ch<3; ch++)
+          c[ch] += w * (linear ? decode(levels[ch]) : levels[ch]/255.0);
+        if (rect.contains(sx, sy))
+          alpha += w;
+      }
+
+      // Drawn over the image with rect cleared to black
+      QRgb bg = rect.contains(x, y) ? qRgb(0, 0, 0) : src.pixel(x, y);
+      int bgLevels[3] = { qRed(bg), qGreen(bg), qBlue(bg) };
+      int out[3];
+      for (int ch=0; ch<3; ch++)
+      {
+        int level = linear ? encode(c[ch]) : int(c[ch]*255 + 0.5);
+        out[ch] = int(level*alpha + bgLevels[ch]*(1 - alpha) + 0.5);
+      }
+      img.setPixel(x, y, qRgb(out[0], out[1], out[2]));
+    }
+}
+
+// ==========
+
+void whitebalance(QImage &img, const QRect &rect)
+{
+  RGBV mean(0.1, 0.1, 0.1); // Avoid zero division
+
+  // Measure
+  for (int y=rect.top(); y<=rect.bottom(); y++)
+    for (int x=rect.left(); x<=rect.right(); x++)
+      mean.add(img.pixel(x, y));
+
+  double avg = (mean.r + mean.g + mean.b)/3;
+  RGBV k(avg/mean.r, avg/mean.g, avg/mean.b);
+
+  // Adjust
+  for (int y=rect.top(); y<=rect.bottom(); y++)
+    for (int x=rect.left(); x<=rect.right(); x++)
+    {
+      RGBV p(img.pixel(x, y));
+      p.mulv(k);
+      p.clamp();
+      img.setPixel(x, y, p.toQRgb());
+    }
+}
+
+void luma_stretch(QImage &img, const QRect &rect)
+{
+  int qmin, qmax;
+  makeHistogram(img, rect, getLuma, 256, &qmin, &qmax);
+
+  double ymin = qmin/255.0;
+  double k = qmax==qmin? 1.0 : 255.0/(qmax-qmin);
+
+  for (int y=rect.top(); y<=rect.bottom(); y++)
+    for (int x=rect.left(); x<=rect.right(); x++)
+    {
+      RGBV c(img.pixel(x, y));
+      double yval = getLuma(img.pixel(x, y)); // Current luminance
+      double ytgt = (yval - ymin)*k; // Target luminance
+      c.mul(ytgt/yval);
+      c.clamp();
+      img.setPixel(x, y, c.toQRgb());
+    }
+}
+
+void rgb_stretch(QImage &img, const QRect &rect)
+{
+  int rmin, rmax;
+  int gmin, gmax;
+  int bmin, bmax;
+  makeHistogram(img, rect, getRed,   256, &rmin, &rmax);
+  makeHistogram(img, rect, getGreen, 256, &gmin, &gmax);
+  makeHistogram(img, rect, getBlue,  256, &bmin, &bmax);
+
+  RGBV lo(rmin/255.0, gmin/255.0, bmin/255.0);
+  RGBV stretch(rmax==rmin? 1.0 : 255.0/(rmax-rmin),
+               gmax==gmin? 1.0 : 255.0/(gmax-gmin),
+               bmax==bmin? 1.0 : 255.0/(bmax-bmin));
+  for (int y=rect.top(); y<=rect.bottom(); y++)
+    for (int x=rect.left(); x<=rect.right(); x++)
+    {
+      RGBV c(img.pixel(x, y));
+      c.addk(lo, -1);
+      c.mulv(stretch);
+      c.clamp();
+      img.setPixel(x, y, c.toQRgb());
+    }
+}
+
+// Tile by tile: clipped luma histogram and its mapping; then per pixel,
+// bilinear blend of the mappings of the nearest tile centers
+void clahe(QImage &img, const QRect &rect, int tiles, double clipLimit)
+{
+  int tw = (rect.width() + qMin(tiles, rect.width())-1)/qMin(tiles, rect.width());
+  int th = (rect.height() + qMin(tiles, rect.height())-1)/qMin(tiles, rect.height());
+  int columns = (rect.width() + tw-1)/tw, rows = (rect.height() + th-1)/th;
+  QVector<QVector<int> > luts(columns*rows);
+
+  for (int t=0; t<columns*rows; t++)
+  {
+    QRect tile = QRect(rect.left() + t % columns * tw, rect.top() + t / columns * th, tw, th) & rect;
+    QVector<qint64> bins(256, 0);
+    for (int y=tile.top(); y<=tile.bottom(); y++)
+      for (int x=tile.left(); x<=tile.right(); x++)
+        bins[lumaLevel(img.pixel(x, y))]++;
+
+    qint64 total = qint64(tile.width())*tile.height();
+    qint64 limit = qMax<qint64>(1, qint64(clipLimit*total/256));
+    qint64 excess = 0;
+    for (int b=0; b<256; b++)
+      if (bins[b] > limit)
+      {
+        excess += bins[b] - limit;
+        bins[b] = limit;
+      }
+    for (int b=0; b<256; b++)
+      bins[b] += excess/256;
+    for (int i=0; i<excess % 256; i++)
+      bins[i*256/(excess % 256)]++;
+
+    qint64 cdf = 0;
+    for (int b=0; b<256; b++)
+    {
+      cdf += bins[b];
+      luts[t].append(int(qMin<qint64>(255, (cdf*255 + total/2)/total)));
+    }
+  }
+
+  QImage src = img;
+  for (int y=rect.top(); y<=rect.bottom(); y++)
+    for (int x=rect.left(); x<=rect.right(); x++)
+    {
+      double fx = qBound(0.0, (x - rect.left() + 0.5)/tw - 0.5, columns - 1.0);
+      double fy = qBound(0.0, (y - rect.top() + 0.5)/th - 0.5, rows - 1.0);
+      int x0 = int(fx), y0 = int(fy);
+      int x1 = qMin(x0+1, columns-1), y1 = qMin(y0+1, rows-1);
+      double wx = fx - x0, wy = fy - y0;
+
+      QRgb c = src.pixel(x, y);
+      int luma = lumaLevel(c);
+      double target = (1-wy)*((1-wx)*luts[y0*columns + x0][luma] + wx*luts[y0*columns + x1][luma])
+                      + wy*((1-wx)*luts[y1*columns + x0][luma] + wx*luts[y1*columns + x1][luma]);
+      if (luma == 0)
+        img.setPixel(x, y, qRgb(int(target + 0.5), int(target + 0.5), int(target + 0.5)));
+      else
+      {
+        double k = target/luma;
+        img.setPixel(x, y, qRgb(qMin(255, int(qRed(c)*k + 0.5)),
+                                qMin(255, int(qGreen(c)*k + 0.5)),
+                                qMin(255, int(qBlue(c)*k + 0.5))));
+      }
+    }
+}
+
+} // namespace reference
@@ -0,0 +1,34 @@
+#ifndef REFERENCE_H
+#define REFERENCE_H
+
+#include <QImage>
+#include "convolution.h"
+#include "edges.h"
+#include "morphology.h"
+#include "transform.h"
+
+/** Straightforward per-pixel implementations of the filter kernels.
+ * They are kept only as the ground truth for the self check, which
+ * compares the optimized kernels against them; do not optimize.
+ */
+namespace reference
+{
+  // linear: blend in linear light, with the exact sRGB transfer function
+  void convolve(QImage &img, const QRect &rect, const Matrix<double> &m, bool linear = false);
+  void median(QImage &img, const QRect &rect, int size);
+  void boxblur(QImage &img, const QRect &rect, int radius);
+  void glass(QImage &img, const QRect &rect, int radius, int samples);
+  void bilateral(QImage &img, const QRect &rect, int sigmaSpace, int sigmaRange);
+  void morphology(QImage &img, const QRect &rect, MorphologyOp op, int width, int height);
+  void edges(QImage &img, const QRect &rect, EdgeOperator op);
+  void canny(QImage &img, const QRect &rect, EdgeOperator op, int low, int high);
+  // transform() of rect drawn over img, whose rect is cleared to black
+  void transform(QImage &img, const QRect &rect, const Transform &t, bool linear = false);
+
+  void whitebalance(QImage &img, const QRect &rect);
+  void luma_stretch(QImage &img, const QRect &rect);
+  void rgb_stretch(QImage &img, const QRect &rect);
+  void clahe(QImage &img, const QRect &rect, int tiles, double clipLimit);
+}
+
+#endif // REFERENCE_H
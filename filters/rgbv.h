@@ -1,6 +1,8 @@
 #ifndef RGBV_H
 #define RGBV_H
 
+#include "srgb.h"
+
 // Floating-point RGB [0.0, 1.0] with arithmetics
 struct RGBV
 {
@@ -18,6 +20,20 @@ struct RGBV
       return qRgb(r*255, g*255, b*255);
     }
 
+    // Linear-light value of an sRGB pixel, and back
+    static RGBV linear(QRgb rgb)
+    {
+      return RGBV(toLinear(qRed(rgb))   / 65535.0,
+                  toLinear(qGreen(rgb)) / 65535.0,
+                  toLinear(qBlue(rgb))  / 65535.0);
+    }
+    QRgb toQRgbLinear() const
+    {
+      return qRgb(fromLinear(int(r*65535 + 0.5)),
+                  fromLinear(int(g*65535 + 0.5)),
+                  fromLinear(int(b*65535 + 0.5)));
+    }
+
     void mulv(RGBV c)
     {
       r *= c.r;
@@ -56,4 +72,37 @@ struct RGBV
     double r, g, b;
 };
 
+// Pixel to RGBV and back, in linear light or as encoded
+template<bool Linear>
+inline RGBV decodeRGBV(QRgb rgb)
+{
+  return Linear ? RGBV::linear(rgb) : RGBV(rgb);
+}
+
+template<bool Linear>
+inline QRgb encodeRGBV(const RGBV &c)
+{
+  return Linear ? c.toQRgbLinear() : c.toQRgb();
+}
+
+// One channel of decodeRGBV() and encodeRGBV(), for values in [0, 1]
+template<bool Linear>
+inline double decodeUnit(int level)
+{
+  return Linear ? toLinear(level) / 65535.0 : level / 255.0;
+}
+
+template<bool Linear>
+inline int encodeUnit(double v)
+{
+  return Linear ? fromLinear(int(v*65535 + 0.5)) : int(v*255);
+}
+
+// 8-bit level to the scale the integer and float paths accumulate in
+template<bool Linear>
+inline int decodeLevel(int level)
+{
+  return Linear ? toLinear(level) : level;
+}
+
 #endif // RGBV_H
@@ -0,0 +1,228 @@
+#include <cstring>
+#include <QMutexLocker>
+
+#include "scratchpool.h"
+#include "memorymeter.h"
+
+static const qint64 defaultIdleLimit = Q_INT64_C(256)*1024*1024;
+static const int minFloats = 1024;
+static const size_t alignment = 32;
+
+// Buffers come in power-of-two sizes, so that nearby requests share them
+static int sizeClass(int count)
+{
+  int res = minFloats;
+  while (res < count)
+    res *= 2;
+  return res;
+}
+
+ScratchPool &ScratchPool::instance()
+{
+  static ScratchPool pool;
+  return pool;
+}
+
+ScratchPool::ScratchPool()
+  : m_idleBytes(0), m_idleLimit(defaultIdleLimit), m_hits(0), m_misses(0)
+{
+}
+
+ScratchPool::~ScratchPool()
+{
+  clear();
+}
+
+QImage ScratchPool::acquireImage(const QSize &size, QImage::Format format,
+                                 const char *site)
+{
+  {
+    QMutexLocker lock(&m_mutex);
+    for (int i=m_images.size()-1; i>=0; i--)
+      if (m_images[i].size() == size && m_images[i].format() == format)
+      {
+        QImage res = m_images[i];
+        m_images.removeAt(i);
+        m_idleBytes -= res.byteCount();
+        m_hits++;
+        return res;
+      }
+    m_misses++;
+  }
+  QImage res(size, format);
+  MemoryMeter::instance().allocated(site, res.byteCount());
+  return res;
+}
+
+void ScratchPool::releaseImage(QImage &img)
+{
+  if (img.isNull() || !img.isDetached())
+  {
+    img = QImage();
+    return;
+  }
+
+  QMutexLocker lock(&m_mutex);
+  m_idleBytes += img.byteCount();
+  m_images.append(img);
+  img = QImage();
+  trim();
+}
+
+float *ScratchPool::acquireFloats(int count, int *capacity)
+{
+  int size = sizeClass(count);
+  *capacity = size;
+  {
+    QMutexLocker lock(&m_mutex);
+    for (int i=m_blocks.size()-1; i>=0; i--)
+      if (m_blocks[i].capacity == size)
+      {
+        float *res = m_blocks[i].data;
+        m_blocks.removeAt(i);
+        m_idleBytes -= qint64(size)*sizeof(float);
+        m_hits++;
+        return res;
+      }
+    m_misses++;
+  }
+  MemoryMeter::instance().allocated("scratch floats", qint64(size)*sizeof(float));
+  return static_cast<float *>(qMallocAligned(size*sizeof(float), alignment));
+}
+
+void ScratchPool::releaseFloats(float *data, int capacity)
+{
+  if (!data)
+    return;
+
+  QMutexLocker lock(&m_mutex);
+  Block b;
+  b.data = data;
+  b.capacity = capacity;
+  m_blocks.append(b);
+  m_idleBytes += qint64(capacity)*sizeof(float);
+  trim();
+}
+
+ScratchPool::Stats ScratchPool::stats() const
+{
+  QMutexLocker lock(&m_mutex);
+  Stats res;
+  res.hits = m_hits;
+  res.misses = m_misses;
+  res.idleBytes = m_idleBytes;
+  return res;
+}
+
+QString ScratchPool::report() const
+{
+  Stats s = stats();
+  return QString("scratch pool: %1 hits, %2 misses, %3 MB idle")
+           .arg(s.hits).arg(s.misses).arg(s.idleBytes/(1024*1024));
+}
+
+void ScratchPool::setIdleLimit(qint64 bytes)
+{
+  QMutexLocker lock(&m_mutex);
+  m_idleLimit = bytes;
+  trim();
+}
+
+void ScratchPool::clear()
+{
+  QMutexLocker lock(&m_mutex);
+  m_images.clear();
+  foreach (const Block &b, m_blocks)
+    qFreeAligned(b.data);
+  m_blocks.clear();
+  m_idleBytes = 0;
+}
+
+// Free the oldest buffers until within the limit. Called locked.
+void ScratchPool::trim()
+{
+  while (m_idleBytes > m_idleLimit && !(m_images.isEmpty() && m_blocks.isEmpty()))
+  {
+    // Images are the big ones: they go first
+    if (!m_images.isEmpty())
+    {
+      m_idleBytes -= m_images.first().byteCount();
+      m_images.removeFirst();
+    }
+    else
+    {
+      m_idleBytes -= qint64(m_blocks.first().capacity)*sizeof(float);
+      qFreeAligned(m_blocks.first().data);
+      m_blocks.removeFirst();
+    }
+  }
+}
+
+// ==========
+
+ScratchImage::ScratchImage(const QSize &size, QImage::Format format, const char *site)
+  : m_image(ScratchPool::instance().acquireImage(size, format, site)),
+    m_bytes(m_image.byteCount())
+{
+  MemoryMeter::instance().acquired(m_bytes);
+}
+
+ScratchImage::ScratchImage(const QImage &img, const QRect &rect, const char *site)
+  : m_image(ScratchPool::instance().acquireImage(img.size(), img.format(), site)),
+    m_bytes(m_image.byteCount())
+{
+  MemoryMeter::instance().acquired(m_bytes);
+  if (img.format() == QImage::Format_Indexed8)
+    m_image.setColorTable(img.colorTable());
+
+  QRect r = rect & img.rect();
+  if (img.depth() < 8)
+    r = img.rect();
+  if (r.isEmpty())
+    return;
+
+  int bpp = img.depth()/8;
+  int offset = img.depth() < 8 ? 0 : r.left()*bpp;
+  int bytes = img.depth() < 8 ? img.bytesPerLine() : r.width()*bpp;
+  for (int y=r.top(); y<=r.bottom(); y++)
+    memcpy(m_image.scanLine(y) + offset, img.constScanLine(y) + offset, bytes);
+}
+
+ScratchImage::~ScratchImage()
+{
+  ScratchPool::instance().releaseImage(m_image);
+  MemoryMeter::instance().released(m_bytes);
+}
+
+// ==========
+
+ScratchFloats::ScratchFloats(int count)
+  : m_data(0), m_capacity(0), m_size(0)
+{
+  resize(count);
+}
+
+ScratchFloats::~ScratchFloats()
+{
+  release();
+}
+
+void ScratchFloats::resize(int count)
+{
+  if (count > m_capacity)
+  {
+    release();
+    m_data = ScratchPool::instance().acquireFloats(count, &m_capacity);
+    MemoryMeter::instance().acquired(qint64(m_capacity)*sizeof(float));
+  }
+  m_size = count;
+}
+
+void ScratchFloats::release()
+{
+  if (m_data)
+    MemoryMeter::instance().released(qint64(m_capacity)*sizeof(float));
+  ScratchPool::instance().releaseFloats(m_data, m_capacity);
+  m_data = 0;
+  m_capacity = 0;
+}
@@ -0,0 +1,112 @@
+#ifndef SCRATCHPOOL_H
+#define SCRATCHPOOL_H
+
+#include <QImage>
+#include <QList>
+#include <QMutex>
+
+/** Process-wide pool of temporary images and float buffers.
+ * Filters take their temporaries from here instead of allocating
+ * full-frame buffers on every apply: a released buffer of the same
+ * size class is handed out again (a hit), else a new one is allocated
+ * (a miss). Idle memory is bounded; the least recently released
+ * buffers are freed first. Thread-safe.
+ */
+class ScratchPool
+{
+  public:
+    struct Stats
+    {
+        qint64 hits;
+        qint64 misses;
+        qint64 idleBytes;
+    };
+
+    static ScratchPool &instance();
+    ~ScratchPool();
+
+    // Image of exactly size and format, contents undefined. A miss is
+    // reported to MemoryMeter as allocated at site.
+    QImage acquireImage(const QSize &size, QImage::Format format,
+                        const char *site = "scratch");
+    // Kept for reuse unless other copies still share its data
+    void releaseImage(QImage &img);
+
+    // 32-byte aligned; capacity receives the actual size, >= count
+    float *acquireFloats(int count, int *capacity);
+    void releaseFloats(float *data, int capacity);
+
+    Stats stats() const;
+    QString report() const;
+    void setIdleLimit(qint64 bytes);
+    void clear();
+
+  private:
+    struct Block
+    {
+        float *data;
+        int capacity;
+    };
+
+    ScratchPool();
+    void trim();
+
+    mutable QMutex m_mutex;
+    // Most recently released last
+    QList<QImage> m_images;
+    QList<Block> m_blocks;
+    qint64 m_idleBytes;
+    qint64 m_idleLimit;
+    qint64 m_hits;
+    qint64 m_misses;
+};
+
+/** Pooled image, returned to the pool when it goes out of scope.
+ * The second constructor makes a back buffer for filters that read a
+ * copy of the source while writing the image itself: it has the size of
+ * img, and only rect is copied from it.
+ */
+class ScratchImage
+{
+  public:
+    ScratchImage(const QSize &size, QImage::Format format,
+                 const char *site = "scratch");
+    ScratchImage(const QImage &img, const QRect &rect,
+                 const char *site = "scratch copy");
+    ~ScratchImage();
+
+    QImage &image() { return m_image; }
+    const QImage &image() const { return m_image; }
+
+  private:
+    Q_DISABLE_COPY(ScratchImage)
+    QImage m_image;
+    qint64 m_bytes;     // in use, as reported to MemoryMeter
+};
+
+// Pooled aligned float array
+class ScratchFloats
+{
+  public:
+    explicit ScratchFloats(int count = 0);
+    ~ScratchFloats();
+
+    // Contents are lost
+    void resize(int count);
+    int size() const { return m_size; }
+
+    float *data() { return m_data; }
+    const float *constData() const { return m_data; }
+    float &operator[](int i) { return m_data[i]; }
+    float operator[](int i) const { return m_data[i]; }
+
+  private:
+    Q_DISABLE_COPY(ScratchFloats)
+    void release();
+
+    float *m_data;
+    int m_capacity;
+    int m_size;
+};
+
+#endif // SCRATCHPOOL_H
@@ -0,0 +1,312 @@
+#include <cmath>
+#include <cstring>
+#include <QtAlgorithms>
+#include <QPolygonF>
+#include <QImage>
+#include <QBitArray>
+#include "spanmask.h"
+
+SpanMask::SpanMask()
+  : m_isRect(true)
+{
+}
+
+SpanMask::SpanMask(const QRect &rect)
+  : m_isRect(true)
+{
+  QRect r = rect.normalized();
+  if (r.isEmpty())
+    return;
+
+  m_spans.reserve(r.height());
+  for (int y=r.top(); y<=r.bottom(); y++)
+    append(y, r.left(), r.right());
+  finish();
+}
+
+// Pixels whose centers lie in [xa, xb)
+static void centerRange(double xa, double xb, int &x1, int &x2)
+{
+  x1 = int(ceil(xa - 0.5));
+  x2 = int(ceil(xb - 0.5)) - 1;
+}
+
+SpanMask SpanMask::ellipse(const QRect &bounds)
+{
+  SpanMask mask;
+  QRect b = bounds.normalized();
+  if (b.isEmpty())
+    return mask;
+
+  double cx = b.left() + b.width()/2.0;
+  double cy = b.top() + b.height()/2.0;
+  double ra = b.width()/2.0;
+  double rb = b.height()/2.0;
+
+  mask.m_spans.reserve(b.height());
+  for (int y=b.top(); y<=b.bottom(); y++)
+  {
+    double dy = (y + 0.5 - cy)/rb;
+    if (dy*dy >= 1)
+      continue;
+    double half = ra*sqrt(1 - dy*dy);
+    int x1, x2;
+    centerRange(cx-half, cx+half, x1, x2);
+    x1 = qMax(x1, b.left());
+    x2 = qMin(x2, b.right());
+    if (x1 <= x2)
+      mask.append(y, x1, x2);
+  }
+  mask.finish();
+  return mask;
+}
+
+SpanMask SpanMask::polygon(const QPolygonF &poly, const QRect &clip)
+{
+  SpanMask mask;
+  int n = poly.size();
+  if (n < 3)
+    return mask;
+
+  QRect r = poly.boundingRect().toAlignedRect() & clip;
+  if (r.isEmpty())
+    return mask;
+
+  QVector<double> xs;
+  for (int y=r.top(); y<=r.bottom(); y++)
+  {
+    double yc = y + 0.5;
+
+    // Edge crossings of the scanline through pixel centers
+    xs.clear();
+    for (int i=0; i<n; i++)
+    {
+      const QPointF &p = poly[i];
+      const QPointF &q = poly[(i+1) % n];
+      if ((p.y() <= yc) != (q.y() <= yc))
+        xs.append(p.x() + (yc - p.y())*(q.x() - p.x())/(q.y() - p.y()));
+    }
+    qSort(xs.begin(), xs.end());
+
+    for (int i=0; i+1<xs.size(); i+=2)
+    {
+      int x1, x2;
+      centerRange(xs[i], xs[i+1], x1, x2);
+      x1 = qMax(x1, r.left());
+      x2 = qMin(x2, r.right());
+      if (x1 <= x2)
+        mask.append(y, x1, x2);
+    }
+  }
+  mask.finish();
+  return mask;
+}
+
+qint64 SpanMask::area() const
+{
+  qint64 res = 0;
+  for (int i=0; i<m_spans.size(); i++)
+    res += m_spans[i].x2 - m_spans[i].x1 + 1;
+  return res;
+}
+
+SpanMask SpanMask::intersected(const QRect &clip) const
+{
+  if (m_isRect)
+    return SpanMask(m_bounds & clip);
+
+  SpanMask mask;
+  for (int i=0; i<m_spans.size(); i++)
+  {
+    const Span &s = m_spans[i];
+    if (s.y < clip.top() || s.y > clip.bottom())
+      continue;
+    int x1 = qMax(s.x1, clip.left());
+    int x2 = qMin(s.x2, clip.right());
+    if (x1 <= x2)
+      mask.append(s.y, x1, x2);
+  }
+  mask.finish();
+  return mask;
+}
+
+SpanMask SpanMask::translated(int dx, int dy) const
+{
+  SpanMask mask = *this;
+  for (int i=0; i<mask.m_spans.size(); i++)
+  {
+    Span &s = mask.m_spans[i];
+    s.y += dy;
+    s.x1 += dx;
+    s.x2 += dx;
+  }
+  mask.m_bounds.translate(dx, dy);
+  return mask;
+}
+
+SpanMask SpanMask::complement(const QRect &area) const
+{
+  SpanMask mask;
+  int i = 0;
+  for (int y=area.top(); y<=area.bottom(); y++)
+  {
+    while (i<m_spans.size() && m_spans[i].y < y)
+      i++;
+
+    int x = area.left();
+    for (; i<m_spans.size() && m_spans[i].y == y; i++)
+    {
+      const Span &s = m_spans[i];
+      if (s.x1 > x)
+        mask.append(y, x, qMin(s.x1-1, area.right()));
+      x = qMax(x, s.x2+1);
+    }
+    if (x <= area.right())
+      mask.append(y, x, area.right());
+  }
+  mask.finish();
+  return mask;
+}
+
+SpanMask SpanMask::subtracted(const SpanMask &other) const
+{
+  SpanMask mask;
+  const QVector<Span> &b = other.m_spans;
+  int j = 0;
+  for (int i=0; i<m_spans.size(); i++)
+  {
+    const Span &s = m_spans[i];
+    while (j<b.size() && (b[j].y < s.y || (b[j].y == s.y && b[j].x2 < s.x1)))
+      j++;
+
+    int x = s.x1;
+    for (int k=j; k<b.size() && b[k].y == s.y && b[k].x1 <= s.x2; k++)
+    {
+      if (b[k].x1 > x)
+        mask.append(s.y, x, b[k].x1-1);
+      x = qMax(x, b[k].x2+1);
+    }
+    if (x <= s.x2)
+      mask.append(s.y, x, s.x2);
+  }
+  mask.finish();
+  return mask;
+}
+
+SpanMask SpanMask::sampled(int step) const
+{
+  SpanMask mask;
+  if (m_spans.isEmpty())
+    return mask;
+
+  int base = m_bounds.left() - m_bounds.left() % step;
+  QBitArray cells((m_bounds.right() - base)/step + 1);
+  int i = 0;
+  while (i < m_spans.size())
+  {
+    // All rows of one row of cells
+    int cy = m_spans[i].y - m_spans[i].y % step;
+    cells.fill(false);
+    for (; i<m_spans.size() && m_spans[i].y < cy+step; i++)
+      for (int c=(m_spans[i].x1-base)/step; c<=(m_spans[i].x2-base)/step; c++)
+        cells.setBit(c);
+
+    for (int c=0; c<cells.size(); c++)
+      if (cells.testBit(c))
+        mask.append(cy, base + c*step, base + c*step);
+  }
+  mask.finish();
+  return mask;
+}
+
+void SpanMask::append(int y, int x1, int x2)
+{
+  // Merge runs touching on the same row
+  if (!m_spans.isEmpty())
+  {
+    Span &last = m_spans.last();
+    if (last.y == y && last.x2+1 >= x1)
+    {
+      last.x2 = qMax(last.x2, x2);
+      return;
+    }
+  }
+  Span s = { y, x1, x2 };
+  m_spans.append(s);
+}
+
+void SpanMask::finish()
+{
+  if (m_spans.isEmpty())
+  {
+    m_bounds = QRect();
+    m_isRect = true;
+    return;
+  }
+
+  int left = m_spans[0].x1, right = m_spans[0].x2;
+  for (int i=1; i<m_spans.size(); i++)
+  {
+    left = qMin(left, m_spans[i].x1);
+    right = qMax(right, m_spans[i].x2);
+  }
+  int top = m_spans.first().y;
+  int bottom = m_spans.last().y;
+  m_bounds = QRect(QPoint(left, top), QPoint(right, bottom));
+
+  m_isRect = (m_spans.size() == m_bounds.height());
+  for (int i=0; m_isRect && i<m_spans.size(); i++)
+    m_isRect = m_spans[i].x1 == left && m_spans[i].x2 == right;
+}
+
+// ==========
+
+void copySpans(QImage &dst, const QImage &src, const SpanMask &mask,
+               const QPoint &offset)
+{
+  const QVector<Span> &spans = mask.spans();
+  // Byte copies between equal formats of whole bytes per pixel; 8-bit
+  // ones hold indices, which setPixel() would take for colors
+  int bpp = dst.format() == src.format() && dst.depth() >= 8 ? dst.depth()/8 : 0;
+  for (int i=0; i<spans.size(); i++)
+  {
+    const Span &s = spans[i];
+    int sy = s.y - offset.y();
+    if (bpp)
+      memcpy(dst.scanLine(s.y) + s.x1*bpp,
+             src.constScanLine(sy) + (s.x1 - offset.x())*bpp,
+             (s.x2 - s.x1 + 1)*bpp);
+    else
+      for (int x=s.x1; x<=s.x2; x++)
+        dst.setPixel(x, s.y, src.pixel(x - offset.x(), sy));
+  }
+}
+
+void copySampled(QImage &dst, const QImage &src, const SpanMask &mask, int step)
+{
+  const QVector<Span> &spans = mask.spans();
+  bool fast = dst.format() == src.format() && dst.depth() == 32;
+  bool bytes = dst.format() == src.format() && dst.depth() == 8;
+  for (int i=0; i<spans.size(); i++)
+  {
+    const Span &s = spans[i];
+    int sy = s.y - s.y % step;
+    if (bytes)
+    {
+      uchar *d = dst.scanLine(s.y);
+      const uchar *c = src.constScanLine(sy);
+      for (int x=s.x1; x<=s.x2; x++)
+        d[x] = c[x - x % step];
+    }
+    else if (fast)
+    {
+      QRgb *d = reinterpret_cast<QRgb *>(dst.scanLine(s.y));
+      const QRgb *c = reinterpret_cast<const QRgb *>(src.constScanLine(sy));
+      for (int x=s.x1; x<=s.x2; x++)
+        d[x] = c[x - x % step];
+    }
+    else
+      for (int x=s.x1; x<=s.x2; x++)
+        dst.setPixel(x, s.y, src.pixel(x - x % step, sy));
+  }
+}
@@ -0,0 +1,64 @@
+#ifndef SPANMASK_H
+#define SPANMASK_H
+
+#include <QRect>
+#include <QVector>
+
+class QPolygonF;
+class QImage;
+
+// Horizontal run of selected pixels [x1, x2] in row y
+struct Span
+{
+    int y, x1, x2;
+};
+
+/** Selection mask stored as run-length encoded scanline spans.
+ * Spans are sorted by y, then by x, and never overlap, so kernels can
+ * iterate selected pixels directly instead of testing a bitmap.
+ * Implicitly constructible from QRect, so rect-based callers still work.
+ */
+class SpanMask
+{
+  public:
+    SpanMask();
+    SpanMask(const QRect &rect);
+
+    static SpanMask ellipse(const QRect &bounds);
+    // Even-odd fill of a closed polygon, pixel centers sampled
+    static SpanMask polygon(const QPolygonF &poly, const QRect &clip);
+
+    const QVector<Span> &spans() const { return m_spans; }
+    QRect boundingRect() const { return m_bounds; }
+    bool isEmpty() const { return m_spans.isEmpty(); }
+    // True if the mask covers its whole bounding rect
+    bool isRect() const { return m_isRect; }
+    qint64 area() const;
+
+    SpanMask intersected(const QRect &clip) const;
+    SpanMask translated(int dx, int dy) const;
+    // Unselected runs inside area
+    SpanMask complement(const QRect &area) const;
+    // Runs of this mask not in other
+    SpanMask subtracted(const SpanMask &other) const;
+    // Top left pixels of the step x step cells, aligned to multiples of
+    // step, that hold selected pixels
+    SpanMask sampled(int step) const;
+
+  private:
+    void append(int y, int x1, int x2);
+    void finish();
+
+    QVector<Span> m_spans;
+    QRect m_bounds;
+    bool m_isRect;
+};
+
+// Copy masked pixels from src, whose origin is at offset in dst
+void copySpans(QImage &dst, const QImage &src, const SpanMask &mask,
+               const QPoint &offset = QPoint(0, 0));
+// Fill masked pixels from the top left pixel of their cell in src, as
+// computed for sampled(step)
+void copySampled(QImage &dst, const QImage &src, const SpanMask &mask, int step);
+
+#endif // SPANMASK_H
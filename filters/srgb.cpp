@@ -0,0 +1,24 @@
+#include <cmath>
+#include "srgb.h"
+
+// Exact transfer functions, used for the tables only
+static double decode(double v)
+{
+  return v <= 0.04045 ? v/12.92 : pow((v + 0.055)/1.055, 2.4);
+}
+
+static double encode(double v)
+{
+  return v <= 0.0031308 ? v*12.92 : 1.055*pow(v, 1/2.4) - 0.055;
+}
+
+SrgbTables::SrgbTables()
+{
+  for (int i=0; i<256; i++)
+    toLinear[i] = quint16(decode(i/255.0)*65535 + 0.5);
+  // Each entry covers 16 linear values: encode its middle
+  for (int i=0; i<4096; i++)
+    fromLinear[i] = uchar(qBound(0.0, encode((i*16 + 7.5)/65535)*255 + 0.5, 255.0));
+}
+
+const SrgbTables srgbTables;
@@ -0,0 +1,34 @@
+#ifndef SRGB_H
+#define SRGB_H
+
+#include <QtGlobal>
+
+/** sRGB transfer function through tables, for blending in linear light.
+ * Averaging the gamma-encoded levels darkens edges and fine detail;
+ * in linear-light mode the kernels decode 8-bit levels to 16-bit linear
+ * values and encode their results through an inverse table indexed by
+ * the top 12 bits, so no pow() runs per pixel.
+ */
+struct SrgbTables
+{
+    quint16 toLinear[256];
+    uchar fromLinear[4096];
+
+    SrgbTables();
+};
+
+extern const SrgbTables srgbTables;
+
+// 8-bit sRGB level to 16-bit linear value
+inline int toLinear(int level)
+{
+  return srgbTables.toLinear[level];
+}
+
+// 16-bit linear value, clamped, to the nearest 8-bit sRGB level
+inline int fromLinear(int value)
+{
+  return srgbTables.fromLinear[qBound(0, value, 65535) >> 4];
+}
+
+#endif // SRGB_H
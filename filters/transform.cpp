@@ -1,6 +1,11 @@
 #include <QPainter>
 #include "transform.h"
 #include "rgbv.h"
+#include "pixelformat.h"
+#include "planar.h"
+#include "scratchpool.h"
+#include "memorymeter.h"
+#include "tuning.h"
 
 #ifndef M_PI
 #define M_PI 3.1415926535897932385
@@ -20,6 +25,7 @@ static QRgb getPixelEx(const QImage &img, const QRect &clipRect,
   }
 }
 
+template<bool Linear>
 static QRgb interpolate(const QImage &img, const QRect &clipRect,
                         double x, double y,
                         Interpolation method = Bilinear)
@@ -48,12 +54,12 @@ static QRgb interpolate(const QImage &img, const QRect &clipRect,
 
       // FIXME: RGBV doesn't handle alpha properly
       RGBV res;
-      res.addk(c11, (1-h)*(1-v));
-      res.addk(c12, h*(1-v));
-      res.addk(c21, (1-h)*v);
-      res.addk(c22, h*v);
+      res.addk(decodeRGBV<Linear>(c11), (1-h)*(1-v));
+      res.addk(decodeRGBV<Linear>(c12), h*(1-v));
+      res.addk(decodeRGBV<Linear>(c21), (1-h)*v);
+      res.addk(decodeRGBV<Linear>(c22), h*v);
 
-      QRgb qres = res.toQRgb();
+      QRgb qres = encodeRGBV<Linear>(res);
       int alpha = (1-h) * ((1-v)*qAlpha(c11) + v*qAlpha(c21))
                     + h * ((1-v)*qAlpha(c12) + v*qAlpha(c22));
       qres = qRgba(qRed(qres), qGreen(qres), qBlue(qres), alpha);
@@ -63,20 +69,128 @@ static QRgb interpolate(const QImage &img, const QRect &clipRect,
   }
 }
 
-QImage transform(const QImage &img, const QRect &rect,
-                 const Transform &transform, Interpolation ipol)
+Transform scaleTransform(const QRect &rect, double factor)
 {
-  QImage overlay(img.size(), img.format());
-  overlay.fill(qRgba(0, 0, 0, 0));
-  for (int y=0; y<img.height(); y++)
-    for (int x=0; x<img.width(); x++)
+  double cx = rect.left() + rect.width()/2.0;
+  double cy = rect.top() + rect.height()/2.0;
+  return Transform::shift(cx, cy)
+       * Transform::scale(1/factor, 1/factor)
+       * Transform::shift(-cx, -cy);
+}
+
+Transform rotateTransform(const QRect &rect, double degree)
+{
+  double cx = rect.left() + rect.width()/2.0;
+  double cy = rect.top() + rect.height()/2.0;
+  return Transform::shift(cx, cy)
+       * Transform::rotate(degree * M_PI/180)
+       * Transform::shift(-cx, -cy);
+}
+
+// Rows [first, last) of the transformed overlay, or of the result for
+// gray images
+struct TransformJob
+{
+    const QImage *img;
+    QImage *overlay;
+    QRect rect;
+    const Transform *transform;
+    Interpolation ipol;
+    int first, last;
+};
+
+template<bool Linear>
+static void transformRows(TransformJob &job)
+{
+  for (int y=job.first; y<job.last; y++)
+  {
+    QRgb *dst = reinterpret_cast<QRgb *>(job.overlay->scanLine(y));
+    for (int x=0; x<job.overlay->width(); x++)
     {
       double px, py;
-      transform(x, y, px, py);
-      overlay.setPixel(x, y, interpolate(img, rect, px, py, ipol));
+      (*job.transform)(x, y, px, py);
+      dst[x] = interpolate<Linear>(*job.img, job.rect, px, py, job.ipol);
     }
+  }
+}
+
+// Level at (x, y) as getPixelEx() samples it: its alpha is 0 outside
+// clipRect
+static inline int getLevelEx(const QImage &img, const QRect &clipRect,
+                             int x, int y, int &alpha)
+{
+  alpha = clipRect.contains(x, y) ? 255 : 0;
+  int px = qBound(clipRect.left(), x, clipRect.right());
+  int py = qBound(clipRect.top(),  y, clipRect.bottom());
+  return img.constScanLine(py)[px];
+}
+
+// Gray images have no alpha to hold an overlay: each sample is composited
+// as the painter composites the overlay of 32-bit ones
+template<bool Linear>
+static void transformGrayRows(TransformJob &job)
+{
+  for (int y=job.first; y<job.last; y++)
+  {
+    const uchar *src = job.img->constScanLine(y);
+    uchar *dst = job.overlay->scanLine(y);
+    for (int x=0; x<job.overlay->width(); x++)
+    {
+      double px, py;
+      (*job.transform)(x, y, px, py);
+      int level, alpha;
+      if (job.ipol == NearestNeighbor)
+        level = getLevelEx(*job.img, job.rect, int(px), int(py), alpha);
+      else
+      {
+        int a11, a12, a21, a22;
+        int l11 = getLevelEx(*job.img, job.rect, floor(px), floor(py), a11);
+        int l12 = getLevelEx(*job.img, job.rect, ceil(px), floor(py), a12);
+        int l21 = getLevelEx(*job.img, job.rect, floor(px), ceil(py), a21);
+        int l22 = getLevelEx(*job.img, job.rect, ceil(px), ceil(py), a22);
+        double h = px-floor(px);
+        double v = py-floor(py);
+        level = encodeUnit<Linear>(
+            (1-h)*(1-v)*decodeUnit<Linear>(l11) + h*(1-v)*decodeUnit<Linear>(l12)
+          + (1-h)*v*decodeUnit<Linear>(l21) + h*v*decodeUnit<Linear>(l22));
+        alpha = (1-h) * ((1-v)*a11 + v*a21) + h * ((1-v)*a12 + v*a22);
+      }
+      // Over the image with rect blacked out
+      int base = job.rect.contains(x, y) ? 0 : src[x];
+      dst[x] = (level*alpha + base*(255 - alpha) + 127)/255;
+    }
+  }
+}
+
+QImage transform(const QImage &img, const QRect &rect,
+                 const Transform &transform, Interpolation ipol, bool linear)
+{
+  TransformJob job;
+  job.img = &img;
+  job.rect = rect;
+  job.transform = &transform;
+  job.ipol = ipol;
+
+  if (isGray(img))
+  {
+    QImage res = grayImage(img.size());
+    MemoryMeter::instance().allocated("transform result", res.byteCount());
+    job.overlay = &res;
+    runBands(res, rowBands(0, img.height()-1), job,
+             linear ? transformGrayRows<true> : transformGrayRows<false>);
+    return res;
+  }
+
+  // Needs an alpha channel even when img has none
+  ScratchImage scratch(img.size(), QImage::Format_ARGB32, "transform overlay");
+  QImage &overlay = scratch.image();
+  overlay.fill(qRgba(0, 0, 0, 0));
+  job.overlay = &overlay;
+  runBands(overlay, rowBands(0, img.height()-1), job,
+           linear ? transformRows<true> : transformRows<false>);
   // Assemble result
   QImage res(img.size(), img.format());
+  MemoryMeter::instance().allocated("transform result", res.byteCount());
   QPainter p;
   p.begin(&res);
   p.drawImage(0, 0, img);
@@ -87,24 +201,146 @@ QImage transform(const QImage &img, const QRect &rect,
 }
 
 QImage scale(const QImage &img, const QRect &rect,
-             double factor, Interpolation ipol)
+             double factor, Interpolation ipol, bool linear)
 {
-  double cx = rect.left() + rect.width()/2.0;
-  double cy = rect.top() + rect.height()/2.0;
-  Transform tr = Transform::shift(cx, cy) 
-               * Transform::scale(1/factor, 1/factor) 
-               * Transform::shift(-cx, -cy);
-  return transform(img, rect, tr, ipol);
+  return transform(img, rect, scaleTransform(rect, factor), ipol, linear);
 }
 
 QImage rotate(const QImage &img, const QRect &rect,
-              double degree, Interpolation ipol)
+              double degree, Interpolation ipol, bool linear)
 {
-  double cx = rect.left() + rect.width()/2.0;
-  double cy = rect.top() + rect.height()/2.0;
-  Transform tr = Transform::shift(cx, cy)
-               * Transform::rotate(degree * M_PI/180) 
-               * Transform::shift(-cx, -cy);
-  return transform(img, rect, tr, ipol);
+  return transform(img, rect, rotateTransform(rect, degree), ipol, linear);
+}
+
+TransformChain::TransformChain()
+  : m_transform(Transform::scale(1, 1)), m_linear(false), m_key(0), m_length(0)
+{
+}
+
+QImage TransformChain::apply(const QImage &img, const QRect &rect,
+                             const Transform &t, Interpolation ipol, bool linear)
+{
+  if (m_length == 0 || img.cacheKey() != m_key || rect != m_rect || linear != m_linear)
+  {
+    m_source = img;
+    m_rect = rect;
+    m_transform = t;
+    m_linear = linear;
+    m_length = 1;
+  }
+  else
+  {
+    // Pixel of the result -> pixel of the previous result -> of the source
+    m_transform = m_transform * t;
+    m_length++;
+  }
+
+  QImage res = transform(m_source, m_rect, m_transform, ipol, linear);
+  m_key = res.cacheKey();
+  return res;
 }
 
+void TransformChain::clear()
+{
+  m_source = QImage();
+  m_key = 0;
+  m_length = 0;
+}
+
+// ==========
+
+// Same semantics as interpolate(): samples outside clipRect are clamped
+// to its border and get zero alpha
+struct PlanarSample
+{
+  float c[PlanarImage::PlaneCount];
+};
+
+static inline void fetchPlanar(const PlanarImage &img, const QRect &clipRect,
+                               int x, int y, float weight, PlanarSample &acc)
+{
+  float alpha = 1.0f;
+  if (!clipRect.contains(x, y))
+  {
+    x = qBound(clipRect.left(), x, clipRect.right());
+    y = qBound(clipRect.top(),  y, clipRect.bottom());
+    alpha = 0.0f;
+  }
+  acc.c[PlanarImage::Red]   += weight * img.line(PlanarImage::Red, y)[x];
+  acc.c[PlanarImage::Green] += weight * img.line(PlanarImage::Green, y)[x];
+  acc.c[PlanarImage::Blue]  += weight * img.line(PlanarImage::Blue, y)[x];
+  acc.c[PlanarImage::Alpha] += weight * alpha * img.line(PlanarImage::Alpha, y)[x];
+}
+
+static void interpolatePlanar(const PlanarImage &img, const QRect &clipRect,
+                              double x, double y, Interpolation method,
+                              PlanarSample &res)
+{
+  for (int p=0; p<PlanarImage::PlaneCount; p++)
+    res.c[p] = 0;
+
+  switch (method)
+  {
+  case NearestNeighbor:
+    fetchPlanar(img, clipRect, x, y, 1.0f, res);
+    break;
+
+  default:
+  case Bilinear:
+    {
+      int x0 = floor(x);
+      int y0 = floor(y);
+      float h = x-x0;
+      float v = y-y0;
+      fetchPlanar(img, clipRect, x0,   y0,   (1-h)*(1-v), res);
+      fetchPlanar(img, clipRect, x0+1, y0,   h*(1-v),     res);
+      fetchPlanar(img, clipRect, x0,   y0+1, (1-h)*v,     res);
+      fetchPlanar(img, clipRect, x0+1, y0+1, h*v,         res);
+    }
+  }
+}
+
+void transform(PlanarImage &img, const QRect &rect,
+               const Transform &transform, Interpolation ipol)
+{
+  QRect clip = rect & img.rect();
+  if (clip.isEmpty())
+    return;
+
+  PlanarImage src = img;
+  PlanarSample s;
+  for (int y=0; y<img.height(); y++)
+  {
+    float *red = img.line(PlanarImage::Red, y);
+    float *green = img.line(PlanarImage::Green, y);
+    float *blue = img.line(PlanarImage::Blue, y);
+    float *alpha = img.line(PlanarImage::Alpha, y);
+    for (int x=0; x<img.width(); x++)
+    {
+      double px, py;
+      transform(x, y, px, py);
+      interpolatePlanar(src, clip, px, py, ipol, s);
+
+      // Overlay over the image with the selection blacked out
+      float a = s.c[PlanarImage::Alpha];
+      bool inside = clip.contains(x, y);
+      float baseAlpha = inside? 1.0f : alpha[x];
+      red[x]   = s.c[PlanarImage::Red]*a   + (inside? 0.0f : red[x]*(1-a));
+      green[x] = s.c[PlanarImage::Green]*a + (inside? 0.0f : green[x]*(1-a));
+      blue[x]  = s.c[PlanarImage::Blue]*a  + (inside? 0.0f : blue[x]*(1-a));
+      alpha[x] = a + baseAlpha*(1-a);
+    }
+  }
+}
+
+void scale(PlanarImage &img, const QRect &rect,
+           double factor, Interpolation ipol)
+{
+  transform(img, rect, scaleTransform(rect, factor), ipol);
+}
+
+void rotate(PlanarImage &img, const QRect &rect,
+            double degree, Interpolation ipol)
+{
+  transform(img, rect, rotateTransform(rect, degree), ipol);
+}
@@ -4,6 +4,8 @@
 #include <cmath>
 #include <QImage>
 
+class PlanarImage;
+
 /** Transform matrix:
  * / a1 b1 c1 \   / x \   / x'\
  * | a2 b2 c1 | x | y | = | y'|
@@ -61,16 +63,63 @@ enum Interpolation
   Bilinear
 };
 
+// linear: blend in linear light, see srgb.h
 QImage transform(const QImage &img, const QRect &rect,
                  const Transform &transform,
-                 Interpolation ipol = Bilinear);
+                 Interpolation ipol = Bilinear, bool linear = false);
+
+// Mappings of scale() and rotate(): about the center of rect
+Transform scaleTransform(const QRect &rect, double factor);
+Transform rotateTransform(const QRect &rect, double degree);
 
 QImage scale(const QImage &img, const QRect &rect,
              double factor,
-             Interpolation ipol = Bilinear);
+             Interpolation ipol = Bilinear, bool linear = false);
 
 QImage rotate(const QImage &img, const QRect &rect,
               double degree,
-              Interpolation ipol = Bilinear);
+              Interpolation ipol = Bilinear, bool linear = false);
+
+/** Runs of transforms of the same rect, resampled once.
+ * The image under the first transform of a run is kept. Each next
+ * transform of the run's result is composed with the ones before, and
+ * the kept image resampled once with the composition, so quality and
+ * cost don't degrade with the length of the run.
+ */
+class TransformChain
+{
+  public:
+    TransformChain();
+
+    // Result of transform(img, rect, t). If img is the previous result,
+    // unchanged, and rect and linear the same, t joins the run.
+    QImage apply(const QImage &img, const QRect &rect, const Transform &t,
+                 Interpolation ipol = Bilinear, bool linear = false);
+    // End the run, releasing the kept image
+    void clear();
+    // Transforms in the run
+    int length() const { return m_length; }
+
+  private:
+    QImage m_source;
+    QRect m_rect;
+    Transform m_transform;
+    bool m_linear;
+    qint64 m_key;       // cacheKey() of the last result
+    int m_length;
+};
+
+// In-place variants for the floating-point working image
+void transform(PlanarImage &img, const QRect &rect,
+               const Transform &transform,
+               Interpolation ipol = Bilinear);
+
+void scale(PlanarImage &img, const QRect &rect,
+           double factor,
+           Interpolation ipol = Bilinear);
+
+void rotate(PlanarImage &img, const QRect &rect,
+            double degree,
+            Interpolation ipol = Bilinear);
 
 #endif // TRANSFORM_H
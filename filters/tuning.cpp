@@ -0,0 +1,64 @@
+#include <QThread>
+#include <QThreadPool>
+
+#include "tuning.h"
+
+static Tuning current;
+
+Tuning::Tuning()
+  : threads(QThread::idealThreadCount()), bandRows(32), separableMinSize(3)
+{
+}
+
+const Tuning &tuning()
+{
+  return current;
+}
+
+void setTuning(const Tuning &t)
+{
+  current = t;
+  current.threads = qMax(1, t.threads);
+  current.bandRows = qMax(1, t.bandRows);
+  QThreadPool::globalInstance()->setMaxThreadCount(current.threads);
+}
+
+QVector<Band> rowBands(int top, int bottom)
+{
+  QVector<Band> bands;
+  for (int y=top; y<=bottom; y+=current.bandRows)
+  {
+    Band b = { y, qMin(y + current.bandRows, bottom + 1) };
+    bands.append(b);
+  }
+  return bands;
+}
+
+QVector<Band> spanBands(const QVector<Span> &spans)
+{
+  QVector<Band> bands;
+  Band b = { 0, 0 };
+  for (int i=0; i<spans.size(); i++)
+    if (spans[i].y - spans[b.first].y >= current.bandRows)
+    {
+      b.last = i;
+      bands.append(b);
+      b.first = i;
+    }
+  b.last = spans.size();
+  if (b.last > b.first)
+    bands.append(b);
+  return bands;
+}
+
+QVector<Band> columnBands(int count, int align)
+{
+  QVector<Band> bands;
+  int chunk = qMax(1, count/(current.threads*4*align))*align;
+  for (int x=0; x<count; x+=chunk)
+  {
+    Band b = { x, qMin(x + chunk, count) };
+    bands.append(b);
+  }
+  return bands;
+}
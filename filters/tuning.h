@@ -0,0 +1,85 @@
+#ifndef TUNING_H
+#define TUNING_H
+
+#include <QImage>
+#include <QVector>
+#include <QtConcurrentMap>
+#include "spanmask.h"
+
+/** Machine-dependent settings of the kernels. The defaults are safe on
+ * any machine; AutoTuner measures better ones on first start.
+ */
+struct Tuning
+{
+    // Threads of the global pool, which runs the parallel kernels
+    int threads;
+    // Rows per job when convolve, median, transform and histogram work
+    // is split into bands
+    int bandRows;
+    // Smallest rank-1 kernel evaluated as a row and a column pass;
+    // smaller ones take the 2D paths
+    int separableMinSize;
+
+    Tuning();
+};
+
+const Tuning &tuning();
+// Also sizes the global thread pool. Call while no kernel runs.
+void setTuning(const Tuning &t);
+
+// Index range [first, last) of a job
+struct Band
+{
+    int first, last;
+};
+
+// Rows [top, bottom] in bands of tuning().bandRows
+QVector<Band> rowBands(int top, int bottom);
+// Spans of about tuning().bandRows rows per band
+QVector<Band> spanBands(const QVector<Span> &spans);
+// Columns [0, count) in a few bands per thread, each a multiple of align
+// wide but the last
+QVector<Band> columnBands(int count, int align = 1);
+
+// One copy of job per band, with its first and last set to the band
+template<typename Job>
+QVector<Job> bandJobs(const Job &job, const QVector<Band> &bands)
+{
+  QVector<Job> jobs(bands.size(), job);
+  for (int i=0; i<bands.size(); i++)
+  {
+    jobs[i].first = bands[i].first;
+    jobs[i].last = bands[i].last;
+  }
+  return jobs;
+}
+
+// fn on every job, in the calling thread if there is just one
+template<typename Job>
+void runJobs(QVector<Job> &jobs, void (*fn)(Job &))
+{
+  if (jobs.size() == 1)
+    fn(jobs[0]);
+  else
+    QtConcurrent::blockingMap(jobs, fn);
+}
+
+// fn on one copy of job per band, see bandJobs()
+template<typename Job>
+void runBands(const QVector<Band> &bands, const Job &job, void (*fn)(Job &))
+{
+  QVector<Job> jobs = bandJobs(job, bands);
+  runJobs(jobs, fn);
+}
+
+// Same, for jobs that write image. It is detached here, once: scanLine()
+// and setPixel() would detach it in every thread.
+template<typename Job>
+void runBands(QImage &image, const QVector<Band> &bands, const Job &job,
+              void (*fn)(Job &))
+{
+  image.bits();
+  runBands(bands, job, fn);
+}
+
+#endif // TUNING_H
@@ -1,6 +1,10 @@
 #include <QWidget>
 #include <QVBoxLayout>
 #include <QToolButton>
+#include <QSpinBox>
+#include <QDoubleSpinBox>
+#include <QComboBox>
+#include <QLineEdit>
 #include "filterwrapper.h"
 
 FilterWrapper::FilterWrapper(IFilter *filter, QWidget *parent) :
@@ -49,6 +53,19 @@ FilterWrapper::FilterWrapper(IFilter *filter, QWidget *parent) :
       layout->addWidget(m_filter->settingsWidget());
       layout->addStrut(m_filter->settingsWidget()->minimumSizeHint().width()); // Fix size hopping
       m_filter->settingsWidget()->hide();
+
+      // Report edits of the settings, whatever the editor
+      QWidget *sw = m_filter->settingsWidget();
+      foreach (QSpinBox *sb, sw->findChildren<QSpinBox *>())
+        connect(sb, SIGNAL(valueChanged(int)), SIGNAL(settingsChanged()));
+      foreach (QDoubleSpinBox *sb, sw->findChildren<QDoubleSpinBox *>())
+        connect(sb, SIGNAL(valueChanged(double)), SIGNAL(settingsChanged()));
+      foreach (QComboBox *cb, sw->findChildren<QComboBox *>())
+        connect(cb, SIGNAL(currentIndexChanged(int)), SIGNAL(settingsChanged()));
+      // Spin boxes have line edits of their own
+      foreach (QLineEdit *le, sw->findChildren<QLineEdit *>())
+        if (!qobject_cast<QAbstractSpinBox *>(le->parent()))
+          connect(le, SIGNAL(textChanged(QString)), SIGNAL(settingsChanged()));
     }
     else
       // Main button: apply filter
@@ -75,6 +92,7 @@ void FilterWrapper::buttonToggled(bool isPressed)
       m_button->setArrowType(Qt::RightArrow);
       m_applyButton->hide();
     }
+    emit deactivated();
   }
 }
 
@@ -15,7 +15,10 @@ class FilterWrapper : public QWidget
 
   signals:
     void activated();
+    void deactivated();
     void apply();
+    // Any edit in the settings widget
+    void settingsChanged();
 
   public slots:
     void collapse();
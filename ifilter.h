@@ -3,21 +3,131 @@
 
 class QWidget;
 #include <QString>
+#include <QByteArray>
 #include <QImage>
+#include "filters/pixelformat.h"
+#include "filters/planar.h"
+#include "filters/spanmask.h"
+#include "filters/transform.h"
 
 class IFilter
 {
   public:
-    IFilter(QWidget *_sw = 0) : m_settingsWidget(_sw) {}
+    IFilter(QWidget *_sw = 0) : m_settingsWidget(_sw), m_linearLight(false) {}
 
     bool hasSettings() { return m_settingsWidget != 0; }
     QWidget *settingsWidget() const { return m_settingsWidget; }
 
+    // Blur, resampling and glass blend in linear light while set, see
+    // filters/srgb.h. Each instance keeps its own mode; change it while
+    // the instance doesn't run.
+    void setLinearLight(bool enabled) { m_linearLight = enabled; }
+    bool linearLight() const { return m_linearLight; }
+
     virtual QString filterName() = 0;
     virtual void apply(QImage &image, const QRect &rect) = 0;
 
+    // Region of image that apply(image, rect) is going to modify
+    virtual QRect dirtyRect(const QImage &image, const QRect &rect)
+    {
+      return rect & image.rect();
+    }
+
+    // Reach of the input past each written pixel, horizontally and
+    // vertically, for filters whose output pixels depend on neighbours
+    virtual QSize halo() { return QSize(0, 0); }
+
+    // Region of image that the result of apply(image, rect) depends on
+    virtual QRect inputRect(const QImage &image, const QRect &rect)
+    {
+      QSize h = halo();
+      return dirtyRect(image, rect.adjusted(-h.width(), -h.height(), h.width(), h.height()));
+    }
+
+    // Serialized settings; with filterName() they identify the operation
+    virtual QByteArray parameters() { return QByteArray(); }
+    // Restore settings saved by parameters()
+    virtual void setParameters(const QByteArray &) {}
+    // True if each output pixel depends only on the input within
+    // inputRect() of it, so the filter can be evaluated tile by tile
+    virtual bool isLocal() { return false; }
+    // False if equal input may give different results
+    virtual bool isCacheable() { return true; }
+    // True if apply(image, rect) is transform(image, rect, t): output
+    // pixels sample rect at t of their position. Runs of such filters
+    // over the same rect are then resampled once.
+    virtual bool resampling(const QRect &, Transform &) { return false; }
+    // True if apply() and applyMasked() take gray images, see
+    // pixelformat.h, and keep them gray
+    virtual bool supportsGray() { return false; }
+
+    // Convert image to a format the filter takes, before applying it
+    void prepareFormat(QImage &image)
+    {
+      if (isGray(image) && !supportsGray())
+        image = image.convertToFormat(QImage::Format_RGB32);
+    }
+
+    // Progressive previews: number of cheaper approximations shown before
+    // the exact result. Only local filters are previewed.
+    virtual int refinementPasses() { return 0; }
+
+    // Approximation of applyMasked() for pass < refinementPasses(), pass 0
+    // being the coarsest. The default evaluates the filter only at the
+    // corners of a grid, finer with each pass, and fills the cells.
+    virtual void applyCoarse(QImage &image, const SpanMask &mask, int pass)
+    {
+      int step = 1 << (refinementPasses() - pass);
+      QImage samples = image;
+      applyMasked(samples, mask.sampled(step));
+      copySampled(image, samples, mask, step);
+    }
+
+    // Apply to the floating-point working image. Filters without a native
+    // planar kernel round-trip through QImage.
+    virtual void applyPlanar(PlanarImage &image, const QRect &rect)
+    {
+      QImage tmp = image.toImage();
+      apply(tmp, rect);
+      image.fromImage(tmp, dirtyRect(tmp, rect));
+    }
+
+    // Apply to an arbitrary selection. Filters without span-aware kernels
+    // process the bounding rect and restore the unselected pixels.
+    virtual void applyMasked(QImage &image, const SpanMask &mask)
+    {
+      QRect bounds = mask.boundingRect();
+      if (mask.isRect())
+      {
+        apply(image, bounds);
+        return;
+      }
+
+      QRect dirty = dirtyRect(image, bounds);
+      QImage backup = image.copy(dirty);
+      apply(image, bounds);
+      copySpans(image, backup, mask.complement(dirty), dirty.topLeft());
+    }
+
+    virtual void applyPlanarMasked(PlanarImage &image, const SpanMask &mask)
+    {
+      QRect bounds = mask.boundingRect();
+      if (mask.isRect())
+      {
+        applyPlanar(image, bounds);
+        return;
+      }
+
+      // dirtyRect() only looks at the size: a 1-bit image stands in
+      QRect dirty = dirtyRect(QImage(image.size(), QImage::Format_Mono), bounds);
+      PlanarImage backup = image.copy(dirty);
+      applyPlanar(image, bounds);
+      copySpans(image, backup, mask.complement(dirty), dirty.topLeft());
+    }
+
   private:
     QWidget *m_settingsWidget;
+    bool m_linearLight;
 };
 
 #endif // IFILTER_H
@@ -0,0 +1,145 @@
+#include <QImageReader>
+#include <QtConcurrentRun>
+
+#include "imageloader.h"
+#include "filters/pixelformat.h"
+
+// Images up to this many pixels are decoded directly
+static const qint64 previewThreshold = 4*1024*1024;
+// Preview is never reduced below this on its longer side
+static const int previewMinSide = 1024;
+
+static QImage decodeFull(const QString &filename)
+{
+  QImageReader reader(filename);
+  QImage img;
+  if (!reader.read(&img))
+    return QImage();
+  ImageLoader::normalizeFormat(img);
+  return img;
+}
+
+ImageLoader::ImageLoader(QObject *parent)
+  : QObject(parent)
+{
+  connect(&m_watcher, SIGNAL(finished()), SLOT(decodeFinished()));
+  connect(&m_regionWatcher, SIGNAL(finished()), SLOT(regionFinished()));
+}
+
+bool ImageLoader::open(const QString &filename)
+{
+  QImageReader reader(filename);
+  if (!reader.canRead())
+    return false;
+
+  m_fileName = filename;
+  m_size = reader.size();
+  m_region = QRect();
+  m_regionWatcher.setFuture(QFuture<QImage>());
+
+  // Power of two reduction, as libjpeg only scales by 1/2, 1/4 and 1/8
+  int denom = 1;
+  if (m_size.isValid() && qint64(m_size.width())*m_size.height() > previewThreshold
+      && reader.supportsOption(QImageIOHandler::ScaledSize))
+  {
+    int side = qMax(m_size.width(), m_size.height());
+    while (denom < 8 && side/(denom*2) >= previewMinSide)
+      denom *= 2;
+  }
+
+  if (denom > 1)
+  {
+    reader.setScaledSize(QSize((m_size.width() + denom-1)/denom,
+                               (m_size.height() + denom-1)/denom));
+    QImage preview;
+    if (reader.read(&preview))
+    {
+      normalizeFormat(preview);
+      emit previewReady(preview, m_size);
+    }
+  }
+
+  // Switching the future drops notifications from a load still running
+  m_watcher.setFuture(QtConcurrent::run(decodeFull, filename));
+  return true;
+}
+
+void ImageLoader::decodeRegion(const QRect &clip)
+{
+  m_region = clip;
+  if (!isLoading() || clip.isEmpty() || m_regionWatcher.isRunning())
+    return;
+
+  m_decoding = clip;
+  m_regionWatcher.setFuture(QtConcurrent::run(readRegion, m_fileName, clip));
+}
+
+QImage ImageLoader::readRegion(const QString &filename, const QRect &clip)
+{
+  QImageReader reader(filename);
+  reader.setClipRect(clip);
+  QImage img;
+  if (!reader.read(&img))
+    return QImage();
+  normalizeFormat(img);
+  return img;
+}
+
+void ImageLoader::normalizeFormat(QImage &img)
+{
+  switch (img.format())
+  {
+  case QImage::Format_RGB32:
+  case QImage::Format_ARGB32:
+  case QImage::Format_Invalid:
+    break;
+  default:
+    {
+      // Grayscale stays at one byte per pixel
+      QImage gray = toGray(img);
+      if (!gray.isNull())
+        img = gray;
+      else
+        img = img.convertToFormat(img.hasAlphaChannel() ? QImage::Format_ARGB32
+                                                        : QImage::Format_RGB32);
+    }
+  }
+}
+
+void ImageLoader::decodeFinished()
+{
+  // Also called for the empty future set below
+  if (m_watcher.future().isCanceled())
+    return;
+
+  QImage img = m_watcher.result();
+  // The future keeps a reference to the image; release it, so that
+  // the first edit of the loaded image doesn't detach a full copy
+  m_watcher.setFuture(QFuture<QImage>());
+
+  if (img.isNull())
+    emit failed(m_fileName);
+  else
+  {
+    m_size = img.size();
+    emit loaded(img);
+  }
+}
+
+void ImageLoader::regionFinished()
+{
+  // Also called for the empty future set below
+  if (m_regionWatcher.future().isCanceled())
+    return;
+
+  QImage img = m_regionWatcher.result();
+  m_regionWatcher.setFuture(QFuture<QImage>());
+
+  // The full image makes the region pointless
+  if (!isLoading())
+    return;
+  if (m_decoding != m_region)
+    decodeRegion(m_region);
+  else if (!img.isNull())
+    emit regionReady(img, m_decoding);
+}
@@ -0,0 +1,58 @@
+#ifndef IMAGELOADER_H
+#define IMAGELOADER_H
+
+#include <QObject>
+#include <QImage>
+#include <QFutureWatcher>
+
+/** Two-stage image loader built on QImageReader.
+ * Large images whose decoder can scale natively (JPEG scales in the DCT
+ * domain by 1/2, 1/4 or 1/8) get a reduced preview first; the full
+ * resolution image is then decoded on a worker thread. Meanwhile, work
+ * restricted to a region can have just that region decoded.
+ */
+class ImageLoader : public QObject
+{
+  Q_OBJECT
+public:
+  explicit ImageLoader(QObject *parent = 0);
+
+  // Starts loading filename. Emits previewReady() (large images only),
+  // then loaded() or failed(). Returns false if the file is unreadable.
+  bool open(const QString &filename);
+  bool isLoading() const { return m_watcher.isRunning(); }
+  // While loading, decode clip of the file on a worker thread and emit
+  // regionReady(). Requests made during a decode are merged: only the
+  // last one is decoded next.
+  void decodeRegion(const QRect &clip);
+
+  QString fileName() const { return m_fileName; }
+  QSize imageSize() const { return m_size; }
+
+  // Bring img to a format the filters handle: gray, see pixelformat.h,
+  // for images of gray levels, else 32-bit. Images that are already in
+  // one of these formats are left untouched, without a copy.
+  static void normalizeFormat(QImage &img);
+  // Decode only clip of the file
+  static QImage readRegion(const QString &filename, const QRect &clip);
+
+signals:
+  void previewReady(const QImage &preview, const QSize &fullSize);
+  void loaded(const QImage &image);
+  void regionReady(const QImage &image, const QRect &clip);
+  void failed(const QString &filename);
+
+private slots:
+  void decodeFinished();
+  void regionFinished();
+
+private:
+  QFutureWatcher<QImage> m_watcher;
+  QFutureWatcher<QImage> m_regionWatcher;
+  QRect m_decoding;       // clip being decoded
+  QRect m_region;         // clip last asked for
+  QString m_fileName;
+  QSize m_size;
+};
+
+#endif // IMAGELOADER_H
@@ -0,0 +1,107 @@
+#include <QFile>
+#include <QFileInfo>
+#include <QImageWriter>
+#include <QtConcurrentRun>
+
+#include "imagesaver.h"
+#include "pngencoder.h"
+
+struct SaveJob
+{
+    QImage image;
+    QString fileName;
+    int pngLevel;
+    int jpegQuality;
+    QAtomicInt *progress;
+};
+
+static bool isPng(const QString &filename)
+{
+  return QFileInfo(filename).suffix().toLower() == "png";
+}
+
+static bool writeImage(const SaveJob &job)
+{
+#ifndef NO_PARALLEL_PNG
+  if (isPng(job.fileName))
+  {
+    QFile file(job.fileName);
+    if (!file.open(QIODevice::WriteOnly))
+      return false;
+    bool ok = writePng(job.image, &file, job.pngLevel, job.progress);
+    file.close();
+    if (!ok)
+      file.remove();
+    return ok;
+  }
+#endif
+
+  QImageWriter writer(job.fileName);
+  QString suffix = QFileInfo(job.fileName).suffix().toLower();
+  if (suffix == "jpg" || suffix == "jpeg")
+    writer.setQuality(job.jpegQuality);
+  else if (isPng(job.fileName))
+    // The quality Qt's PNG writer maps back to zlib level pngLevel
+    writer.setQuality(100 - (job.pngLevel*91 + 8)/9);
+  return writer.write(job.image);
+}
+
+bool ImageSaver::write(const QImage &img, const QString &filename,
+                       int pngLevel, int jpegQuality)
+{
+  SaveJob job;
+  job.image = img;
+  job.fileName = filename;
+  job.pngLevel = pngLevel;
+  job.jpegQuality = jpegQuality;
+  job.progress = 0;
+  return writeImage(job);
+}
+
+ImageSaver::ImageSaver(QObject *parent)
+  : QObject(parent), m_steps(0)
+{
+  m_timer.setInterval(100);
+  connect(&m_timer, SIGNAL(timeout()), SLOT(pollProgress()));
+  connect(&m_watcher, SIGNAL(finished()), SLOT(saveFinished()));
+}
+
+bool ImageSaver::save(const QImage &img, const QString &filename,
+                      int pngLevel, int jpegQuality)
+{
+  if (isSaving() || img.isNull())
+    return false;
+
+  SaveJob job;
+  job.image = img;
+  job.fileName = filename;
+  job.pngLevel = pngLevel;
+  job.jpegQuality = jpegQuality;
+  job.progress = &m_progress;
+
+  m_fileName = filename;
+  m_progress = 0;
+#ifdef NO_PARALLEL_PNG
+  m_steps = 0;
+#else
+  m_steps = isPng(filename) ? pngStripCount(img) : 0;
+#endif
+  emit progress(m_steps ? 0 : -1);
+
+  m_watcher.setFuture(QtConcurrent::run(writeImage, job));
+  m_timer.start();
+  return true;
+}
+
+void ImageSaver::pollProgress()
+{
+  if (m_steps)
+    emit progress(int(m_progress) * 100 / m_steps);
+}
+
+void ImageSaver::saveFinished()
+{
+  m_timer.stop();
+  bool ok = m_watcher.result();
+  emit finished(m_fileName, ok);
+}
@@ -0,0 +1,46 @@
+#ifndef IMAGESAVER_H
+#define IMAGESAVER_H
+
+#include <QObject>
+#include <QImage>
+#include <QAtomicInt>
+#include <QFutureWatcher>
+#include <QTimer>
+
+/** Writes images on a worker thread.
+ * The job works on a snapshot (a shallow copy), so the caller may keep
+ * editing its image: the first change simply detaches from the snapshot.
+ */
+class ImageSaver : public QObject
+{
+  Q_OBJECT
+public:
+  explicit ImageSaver(QObject *parent = 0);
+
+  // pngLevel is the deflate level 0-9, jpegQuality 0-100
+  bool save(const QImage &img, const QString &filename,
+            int pngLevel, int jpegQuality);
+  bool isSaving() const { return m_watcher.isRunning(); }
+
+  // Synchronous variant, for callers already on a worker thread
+  static bool write(const QImage &img, const QString &filename,
+                    int pngLevel, int jpegQuality);
+
+signals:
+  // percent is -1 if the format doesn't report progress
+  void progress(int percent);
+  void finished(const QString &filename, bool ok);
+
+private slots:
+  void pollProgress();
+  void saveFinished();
+
+private:
+  QFutureWatcher<bool> m_watcher;
+  QTimer m_timer;
+  QAtomicInt m_progress;
+  int m_steps;
+  QString m_fileName;
+};
+
+#endif // IMAGESAVER_H
@@ -0,0 +1,183 @@
+#include "lazyrenderer.h"
+#include "ifilter.h"
+
+static const int tileSize = 256;
+
+LazyRenderer::LazyRenderer(QImage *target, QObject *parent)
+  : QObject(parent), m_target(target), m_columns(0)
+{
+  // Zero interval: fires whenever there are no pending events
+  m_idle.setInterval(0);
+  connect(&m_idle, SIGNAL(timeout()), SLOT(idleStep()));
+}
+
+void LazyRenderer::append(IFilter *filter, const SpanMask &mask)
+{
+  if (m_ops.isEmpty())
+  {
+    m_base = *m_target;
+    m_columns = (m_base.width() + tileSize-1)/tileSize;
+  }
+
+  Op op;
+  op.filter = filter;
+  op.params = filter->parameters();
+  op.mask = mask;
+  op.dirty = filter->dirtyRect(m_base, mask.boundingRect());
+  op.halo = filter->halo();
+
+  m_ops.append(op);
+  m_levels.append(QHash<int, QImage>());
+  foreach (int index, tilesIn(op.dirty))
+    m_pending.insert(index);
+
+  m_idle.start();
+}
+
+void LazyRenderer::setVisibleRect(const QRect &rect)
+{
+  m_visible = rect;
+}
+
+void LazyRenderer::renderVisible()
+{
+  if (m_ops.isEmpty())
+    return;
+
+  foreach (int index, tilesIn(m_visible))
+    if (m_pending.contains(index))
+      renderTile(index);
+  if (m_pending.isEmpty())
+    complete();
+}
+
+void LazyRenderer::finish()
+{
+  if (m_ops.isEmpty())
+    return;
+
+  while (!m_pending.isEmpty())
+    renderTile(*m_pending.begin());
+  complete();
+}
+
+void LazyRenderer::clear()
+{
+  m_idle.stop();
+  m_ops.clear();
+  m_levels.clear();
+  m_pending.clear();
+  m_base = QImage();
+}
+
+void LazyRenderer::idleStep()
+{
+  if (m_pending.isEmpty())
+  {
+    complete();
+    return;
+  }
+
+  // Visible tiles first
+  int next = *m_pending.begin();
+  foreach (int index, tilesIn(m_visible))
+    if (m_pending.contains(index))
+    {
+      next = index;
+      break;
+    }
+  renderTile(next);
+
+  if (m_pending.isEmpty())
+    complete();
+}
+
+QRect LazyRenderer::tileRect(int index) const
+{
+  QRect r((index % m_columns)*tileSize, (index / m_columns)*tileSize,
+          tileSize, tileSize);
+  return r & m_base.rect();
+}
+
+QList<int> LazyRenderer::tilesIn(const QRect &rect) const
+{
+  QList<int> res;
+  QRect r = rect & m_base.rect();
+  if (r.isEmpty())
+    return res;
+
+  for (int ty=r.top()/tileSize; ty<=r.bottom()/tileSize; ty++)
+    for (int tx=r.left()/tileSize; tx<=r.right()/tileSize; tx++)
+      res << ty*m_columns + tx;
+  return res;
+}
+
+// Tile index of the result of the first level+1 operations
+QImage LazyRenderer::tile(int level, int index)
+{
+  if (level < 0)
+    return m_base.copy(tileRect(index));
+
+  QHash<int, QImage> &tiles = m_levels[level];
+  if (tiles.contains(index))
+    return tiles.value(index);
+
+  const Op &op = m_ops[level];
+  QRect r = tileRect(index);
+  QImage res;
+  if (!r.intersects(op.dirty))
+    res = tile(level-1, index);
+  else
+  {
+    QRect in = r.adjusted(-op.halo.width(), -op.halo.height(),
+                          op.halo.width(), op.halo.height()) & m_base.rect();
+    QImage src = region(level-1, in);
+    SpanMask mask = op.mask.intersected(r).translated(-in.left(), -in.top());
+
+    // The filter's widgets may have changed since the op was recorded
+    QByteArray current = op.filter->parameters();
+    bool swap = current != op.params;
+    if (swap)
+      op.filter->setParameters(op.params);
+    op.filter->applyMasked(src, mask);
+    if (swap)
+      op.filter->setParameters(current);
+
+    res = src.copy(r.translated(-in.left(), -in.top()));
+  }
+  tiles.insert(index, res);
+  return res;
+}
+
+QImage LazyRenderer::region(int level, const QRect &rect)
+{
+  if (level < 0)
+    return m_base.copy(rect);
+
+  QImage res(rect.size(), m_base.format());
+  if (isGray(m_base))
+    setGrayTable(res);
+  foreach (int index, tilesIn(rect))
+  {
+    QRect t = tileRect(index);
+    copySpans(res, tile(level, index), (t & rect).translated(-rect.topLeft()),
+              t.topLeft() - rect.topLeft());
+  }
+  return res;
+}
+
+void LazyRenderer::renderTile(int index)
+{
+  QImage t = tile(m_ops.size()-1, index);
+  QRect r = tileRect(index);
+  emit aboutToUpdate(r);
+  copySpans(*m_target, t, r, r.topLeft());
+  emit updated(r);
+  m_pending.remove(index);
+}
+
+void LazyRenderer::complete()
+{
+  clear();
+  emit finished();
+}
@@ -0,0 +1,77 @@
+#ifndef LAZYRENDERER_H
+#define LAZYRENDERER_H
+
+#include <QObject>
+#include <QImage>
+#include <QHash>
+#include <QList>
+#include <QSet>
+#include <QTimer>
+#include <QVector>
+#include "filters/spanmask.h"
+
+class IFilter;
+
+/** Demand-driven evaluation of a chain of local filters.
+ * append() only records the operation. Output tiles are pulled from
+ * the end of the chain: a tile of level i needs the tiles of level i-1
+ * under it plus the filter's halo, computed the same way down to the
+ * base image. Visible tiles are rendered first, the rest one tile at a
+ * time whenever the event loop is idle.
+ */
+class LazyRenderer : public QObject
+{
+  Q_OBJECT
+public:
+  // Renders into target, which must not be replaced while work is pending
+  explicit LazyRenderer(QImage *target, QObject *parent = 0);
+
+  bool isPending() const { return !m_ops.isEmpty(); }
+
+  // Record filter over mask; filter->isLocal() must be true
+  void append(IFilter *filter, const SpanMask &mask);
+
+  void setVisibleRect(const QRect &rect);
+  void renderVisible();
+  // Render all pending tiles at once
+  void finish();
+  // Drop the pending work, leaving target as it is
+  void clear();
+
+signals:
+  // Emitted around every write to target
+  void aboutToUpdate(const QRect &rect);
+  void updated(const QRect &rect);
+  void finished();
+
+private slots:
+  void idleStep();
+
+private:
+  struct Op
+  {
+      IFilter *filter;
+      QByteArray params;
+      SpanMask mask;
+      QRect dirty;
+      QSize halo;
+  };
+
+  QRect tileRect(int index) const;
+  QList<int> tilesIn(const QRect &rect) const;
+  QImage tile(int level, int index);
+  QImage region(int level, const QRect &rect);
+  void renderTile(int index);
+  void complete();
+
+  QImage *m_target;
+  QImage m_base;
+  QList<Op> m_ops;
+  QVector<QHash<int, QImage> > m_levels;
+  QSet<int> m_pending;
+  QRect m_visible;
+  QTimer m_idle;
+  int m_columns;
+};
+
+#endif // LAZYRENDERER_H
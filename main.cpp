@@ -1,9 +1,31 @@
 #include <QtGui/QApplication>
+#include <QTextStream>
 #include "mainwindow.h"
+#include "selfcheck.h"
+#include "autotuner.h"
 
 int main(int argc, char *argv[])
 {
     QApplication a(argc, argv);
+
+    // Compare the optimized kernels with the reference ones and exit.
+    // The check sets the kernel tunings it runs under itself.
+    if (a.arguments().contains("--selfcheck"))
+    {
+        QTextStream out(stdout);
+        return runSelfCheck(out) == 0 ? 0 : 1;
+    }
+
+    // Kernel settings of this machine, measured on first start
+    AutoTuner tuner;
+    tuner.run(a.arguments().contains("--retune"));
+    if (a.arguments().contains("--tuning-report"))
+    {
+        QTextStream out(stdout);
+        out << tuner.report();
+        return 0;
+    }
+
     MainWindow w;
     w.show();
 
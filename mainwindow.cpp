@@ -1,8 +1,17 @@
+#include <cmath>
+#include <QDesktopServices>
+#include <QDir>
 #include <QFileDialog>
 #include <QGraphicsScene>
 #include <QGraphicsPixmapItem>
 #include <QSignalMapper>
 #include <QTime>
+#include <QPainter>
+#include <QFileInfo>
+#include <QInputDialog>
+#include <QProgressBar>
+#include <QScrollBar>
+#include <QMessageBox>
 
 #include "mainwindow.h"
 #include "regioneditor.h"
@@ -10,10 +19,24 @@
 #include "filters.h"
 #include "filterwrapper.h"
 #include "filters/histogram.h"
+#include "filters/memorymeter.h"
+#include "filters/scratchpool.h"
+#include "imageloader.h"
+#include "imagesaver.h"
+#include "lazyrenderer.h"
+#include "progressiverenderer.h"
 
 MainWindow::MainWindow(QWidget *parent) :
   QMainWindow(parent),
-  ui(new Ui::MainWindow)
+  ui(new Ui::MainWindow),
+  pngLevel(6),
+  jpegQuality(90),
+  floatPrecision(false),
+  lazyRendering(false),
+  livePreview(false),
+  editedLayer(-1),
+  batch(0),
+  batchFailures(0)
 {
   ui->setupUi(this);
 
@@ -26,6 +49,33 @@ MainWindow::MainWindow(QWidget *parent) :
   actSaveAs = ui->toolBar->actions()[1];
   //actSave = ui->toolBar->actions()[2];
 
+  ui->toolBar->addSeparator();
+  actFloatPrecision = ui->toolBar->addAction(tr("Float precision"));
+  actFloatPrecision->setCheckable(true);
+  actFloatPrecision->setToolTip(tr("Keep a floating-point working image between filters"));
+  connect(actFloatPrecision, SIGNAL(toggled(bool)), SLOT(setFloatPrecision(bool)));
+
+  actLazyRendering = ui->toolBar->addAction(tr("Lazy rendering"));
+  actLazyRendering->setCheckable(true);
+  actLazyRendering->setToolTip(tr("Render local filters for the visible area first, the rest when idle"));
+  connect(actLazyRendering, SIGNAL(toggled(bool)), SLOT(setLazyRendering(bool)));
+
+  actLivePreview = ui->toolBar->addAction(tr("Live preview"));
+  actLivePreview->setCheckable(true);
+  actLivePreview->setToolTip(tr("Preview local filters while editing their settings, coarse first"));
+  connect(actLivePreview, SIGNAL(toggled(bool)), SLOT(setLivePreview(bool)));
+
+  actLinearLight = ui->toolBar->addAction(tr("Linear light"));
+  actLinearLight->setCheckable(true);
+  actLinearLight->setToolTip(tr("Blend in linear light when blurring, resampling and in Matte Glass"));
+  connect(actLinearLight, SIGNAL(toggled(bool)), SLOT(setLinearLight(bool)));
+
+  ui->toolBar->addSeparator();
+  actBatch = ui->toolBar->addAction(tr("Batch..."), this, SLOT(showBatchDialog()));
+  actBatch->setToolTip(tr("Apply the filters used on this image to other files"));
+  actEditStep = ui->toolBar->addAction(tr("Edit step..."), this, SLOT(editAppliedStep()));
+  actEditStep->setToolTip(tr("Change the settings of a filter applied earlier"));
+
   // Prepare dialogs
   dlgOpen = new QFileDialog(this, tr("Select image..."), QString());
   dlgOpen->setNameFilters(QStringList() << tr("Images (*.bmp *.png *.jpg)"));
@@ -39,6 +89,8 @@ MainWindow::MainWindow(QWidget *parent) :
   // No file opened -> disable unavailable actions
   //connect(this, SIGNAL(fileOperationsEnabled(bool)), actSave, SLOT(setEnabled(bool)));
   connect(this, SIGNAL(fileOperationsEnabled(bool)), actSaveAs, SLOT(setEnabled(bool)));
+  connect(this, SIGNAL(fileOperationsEnabled(bool)), actBatch, SLOT(setEnabled(bool)));
+  connect(this, SIGNAL(fileOperationsEnabled(bool)), actEditStep, SLOT(setEnabled(bool)));
   connect(this, SIGNAL(fileOperationsEnabled(bool)), ui->dockTools, SLOT(setEnabled(bool)));
   connect(this, SIGNAL(fileOperationsEnabled(bool)), ui->dockInfo, SLOT(setEnabled(bool)));
   emit fileOperationsEnabled(false);
@@ -53,11 +105,45 @@ MainWindow::MainWindow(QWidget *parent) :
   ui->graphicsView->scene()->addItem(region);
   connect(ui->btnResetMask, SIGNAL(clicked()), region, SLOT(resetSelection()));
   connect(ui->chkShowMask, SIGNAL(toggled(bool)), region, SLOT(setShowMask(bool)));
+  connect(ui->cbSelectionMode, SIGNAL(currentIndexChanged(int)), region, SLOT(setMode(int)));
+  connect(region, SIGNAL(maskChanged()), SLOT(selectionChanged()));
+
+  loader = new ImageLoader(this);
+  connect(loader, SIGNAL(previewReady(QImage,QSize)), SLOT(showPreview(QImage,QSize)));
+  connect(loader, SIGNAL(loaded(QImage)), SLOT(imageLoaded(QImage)));
+  connect(loader, SIGNAL(failed(QString)), SLOT(imageLoadFailed(QString)));
+  connect(loader, SIGNAL(regionReady(QImage,QRect)), SLOT(regionDecoded(QImage,QRect)));
+
+  saver = new ImageSaver(this);
+  connect(saver, SIGNAL(progress(int)), SLOT(saveProgress(int)));
+  connect(saver, SIGNAL(finished(QString,bool)), SLOT(saveFinished(QString,bool)));
+
+  saveProgressBar = new QProgressBar(this);
+  saveProgressBar->setMaximumWidth(150);
+  saveProgressBar->hide();
+  ui->statusBar->addPermanentWidget(saveProgressBar);
+
+  renderer = new LazyRenderer(&currentImage, this);
+  connect(renderer, SIGNAL(aboutToUpdate(QRect)), SLOT(tileAboutToUpdate(QRect)));
+  connect(renderer, SIGNAL(updated(QRect)), SLOT(tileUpdated(QRect)));
+  connect(renderer, SIGNAL(finished()), SLOT(renderingFinished()));
+  progressive = new ProgressiveRenderer(this);
+  connect(progressive, SIGNAL(updated(QRect)), SLOT(progressiveUpdated(QRect)));
+  connect(progressive, SIGNAL(passFinished(int,int)), SLOT(progressivePassFinished(int,int)));
+  connect(progressive, SIGNAL(finished()), SLOT(progressiveFinished()));
+  connect(ui->graphicsView->horizontalScrollBar(), SIGNAL(valueChanged(int)), SLOT(viewScrolled()));
+  connect(ui->graphicsView->verticalScrollBar(), SIGNAL(valueChanged(int)), SLOT(viewScrolled()));
 
   connect(this, SIGNAL(imageUpdated()), SLOT(updateView()));
+  connect(this, SIGNAL(imageUpdated(QRect)), SLOT(updateView(QRect)));
+
+  // One line per filter run and view update, for tracking memory use
+  QString dataDir = QDesktopServices::storageLocation(QDesktopServices::DataLocation);
+  QDir().mkpath(dataDir);
+  MemoryMeter::instance().setLogFile(QDir(dataDir).filePath("memory.log"));
 
   // Filters
-  QList<IFilter *> ifilters = createFilters(this);
+  QList<IFilter *> ifilters = createFilters(this, &integral);
   foreach(IFilter *ifilter, ifilters)
   {
     if (ifilter)
@@ -67,6 +153,9 @@ MainWindow::MainWindow(QWidget *parent) :
       filters << wrapper;
       connect(wrapper, SIGNAL(activated()), SLOT(filterActivated()));
       connect(wrapper, SIGNAL(apply()), SLOT(filterApply()));
+      connect(wrapper, SIGNAL(activated()), SLOT(previewFilter()));
+      connect(wrapper, SIGNAL(settingsChanged()), SLOT(previewFilter()));
+      connect(wrapper, SIGNAL(deactivated()), SLOT(filterDeactivated()));
     }
     else
       ui->filtersLayout->addSpacing(20);
@@ -81,35 +170,106 @@ MainWindow::~MainWindow()
 void MainWindow::showOpenDialog()
 {
   if (dlgOpen->exec() == QDialog::Accepted)
-  {
-    if (loadFile(dlgOpen->selectedFiles()[0]))
-      emit fileOperationsEnabled(true);
-  }
+    loadFile(dlgOpen->selectedFiles()[0]);
 }
 
 void MainWindow::showSaveDialog()
 {
-  if (dlgSave->exec() == QDialog::Accepted)
-    saveFile(dlgSave->selectedFiles()[0]);
+  if (dlgSave->exec() != QDialog::Accepted)
+    return;
+
+  QString filename = dlgSave->selectedFiles()[0];
+  QString suffix = QFileInfo(filename).suffix().toLower();
+  bool ok = true;
+  if (suffix == "png")
+    pngLevel = QInputDialog::getInt(this, tr("PNG options"), tr("Compression level:"),
+                                    pngLevel, 0, 9, 1, &ok);
+  else if (suffix == "jpg" || suffix == "jpeg")
+    jpegQuality = QInputDialog::getInt(this, tr("JPEG options"), tr("Quality:"),
+                                       jpegQuality, 0, 100, 1, &ok);
+  if (ok)
+    saveFile(filename);
 }
 
 bool MainWindow::loadFile(const QString &filename)
 {
-  if (currentImage.load(filename))
+  loadTime.start();
+  if (!loader->open(filename))
   {
-    currentFileName = filename;
-    if (currentImage.format() != QImage::Format_ARGB32)
-      currentImage = currentImage.convertToFormat(QImage::Format_ARGB32);
-    region->resetSelection();
-    emit imageUpdated();
-    ui->statusBar->showMessage(tr("Image %1 loaded successfully.").arg(filename));
-    return true;
+    imageLoadFailed(filename);
+    return false;
   }
-  else
+
+  // Editing waits for the full image; free the old one meanwhile
+  emit fileOperationsEnabled(false);
+  stopProgressive();
+  renderer->clear();
+  integral.clear();
+  transformChain.clear();
+  currentImage = QImage();
+  previewImage = QImage();
+  planarImage = PlanarImage();
+  ui->statusBar->showMessage(tr("Loading %1...").arg(filename));
+  return true;
+}
+
+void MainWindow::showPreview(const QImage &preview, const QSize &fullSize)
+{
+  // Stretch the reduced image over the full image area
+  previewImage = preview;
+  currentPixmap = QPixmap::fromImage(preview);
+  imageView->setPixmap(currentPixmap);
+  imageView->setScale(double(fullSize.width())/preview.width());
+  region->setArea(QRectF(QPointF(0, 0), fullSize));
+  ui->graphicsView->scene()->setSceneRect(QRectF(QPointF(0, 0), fullSize));
+
+  histogram.clear();
+  histogram.add(preview, preview.rect());
+  updateHistograms();
+
+  ui->statusBar->showMessage(tr("Preview shown after %1 ms, decoding %2...")
+                             .arg(loadTime.elapsed()).arg(loader->fileName()));
+}
+
+void MainWindow::imageLoaded(const QImage &image)
+{
+  currentImage = image;
+  previewImage = QImage();
+  currentFileName = loader->fileName();
+  appliedSteps.clear();
+  layers.reset(currentImage);
+  editedLayer = -1;
+  transformChain.clear();
+  if (floatPrecision)
   {
-    ui->statusBar->showMessage(tr("Loading %1 failed.").arg(filename));
-    return false;
+    leaveGray();
+    planarImage = PlanarImage(currentImage);
   }
+  imageView->setScale(1);
+  region->resetSelection();
+  emit imageUpdated();
+  emit fileOperationsEnabled(true);
+  ui->statusBar->showMessage(tr("Image %1 loaded successfully (%2 ms).")
+                             .arg(currentFileName).arg(loadTime.elapsed()));
+}
+
+// Statistics of the selection, decoded alone while the full image loads
+void MainWindow::regionDecoded(const QImage &image, const QRect &clip)
+{
+  const SpanMask &mask = region->mask();
+  if (!currentImage.isNull() || clip != mask.boundingRect())
+    return;
+
+  histogram.clear();
+  histogram.add(image, mask.translated(-clip.left(), -clip.top()));
+  updateHistograms();
+  ui->statusBar->showMessage(tr("Selection measured at full resolution, decoding %1...")
+                             .arg(loader->fileName()));
+}
+
+void MainWindow::imageLoadFailed(const QString &filename)
+{
+  ui->statusBar->showMessage(tr("Loading %1 failed.").arg(filename));
 }
 
 void MainWindow::saveFile()
@@ -119,9 +279,42 @@ void MainWindow::saveFile()
 
 void MainWindow::saveFile(const QString &filename)
 {
-  if (currentImage.save(filename))
+  if (saver->isSaving())
+  {
+    ui->statusBar->showMessage(tr("Please wait: another image is being saved."));
+    return;
+  }
+
+  // Saving needs every pending tile
+  renderer->finish();
+
+  saveTime.start();
+  if (saver->save(currentImage, filename, pngLevel, jpegQuality))
+    ui->statusBar->showMessage(tr("Saving %1...").arg(filename));
+  else
+    ui->statusBar->showMessage(tr("Saving to %1 failed.").arg(filename));
+}
+
+void MainWindow::saveProgress(int percent)
+{
+  // Busy indicator for formats without progress
+  if (percent < 0)
+    saveProgressBar->setRange(0, 0);
+  else
   {
-    ui->statusBar->showMessage(tr("Image successfully saved to %1.").arg(filename));
+    saveProgressBar->setRange(0, 100);
+    saveProgressBar->setValue(percent);
+  }
+  saveProgressBar->show();
+}
+
+void MainWindow::saveFinished(const QString &filename, bool ok)
+{
+  saveProgressBar->hide();
+  if (ok)
+  {
+    ui->statusBar->showMessage(tr("Image successfully saved to %1 (%2 ms).")
+                               .arg(filename).arg(saveTime.elapsed()));
     currentFileName = filename;
   }
   else
@@ -130,31 +323,91 @@ void MainWindow::saveFile(const QString &filename)
 
 void MainWindow::updateView()
 {
-  static const int histWidth = 128;
-  static const int histHeight = 64;
-
-  imageView->setPixmap(QPixmap::fromImage(currentImage));
+  MemoryMeasure memory("view update");
+  currentPixmap = QPixmap::fromImage(currentImage);
+  MemoryMeter::instance().allocated("pixmap", qint64(currentImage.width())*currentImage.height()*4);
+  imageView->setPixmap(currentPixmap);
+  // Rebuilt from scratch: the old mask may not fit the new image
+  histogram.clear();
+  histogramMask = SpanMask();
   region->setArea(imageView->boundingRect());
+  selectionChanged();
 
   ui->graphicsView->scene()->setSceneRect(imageView->boundingRect()); // Force shrink
+  memory.log();
+}
+
+void MainWindow::updateView(const QRect &dirty)
+{
+  if (currentPixmap.size() != currentImage.size())
+  {
+    updateView();
+    return;
+  }
+
+  QRect r = dirty & currentImage.rect();
+  if (r.isEmpty())
+    return;
+
+  // Called for every tile rendered: logged only if it took memory
+  MemoryMeasure memory("view update (region)");
+  paintPixmap(currentImage, r);
+  updateHistograms();
+  if (!memory.isEmpty())
+    memory.log();
+}
+
+// Draw rect of image over the displayed pixmap
+void MainWindow::paintPixmap(const QImage &image, const QRect &rect)
+{
+  // Release the item's reference first, so that painting doesn't detach
+  imageView->setPixmap(QPixmap());
+  QPainter p;
+  p.begin(&currentPixmap);
+  p.setCompositionMode(QPainter::CompositionMode_Source);
+  // Other formats are converted to 32 bits on the way
+  if (image.depth() != 32)
+    MemoryMeter::instance().allocated("pixmap conversion", qint64(rect.width())*rect.height()*4);
+  p.drawImage(rect.topLeft(), image, rect);
+  p.end();
+  imageView->setPixmap(currentPixmap);
+}
+
+// Caption of a histogram
+static QString channelStats(const QString &name, const ImageHistogram &h,
+                            ImageHistogram::Channel c)
+{
+  return MainWindow::tr("%1: mean %2 %3%4, %5..%6").arg(name)
+           .arg(h.mean(c), 0, 'f', 1).arg(QChar(0x00b1)).arg(sqrt(h.variance(c)), 0, 'f', 1)
+           .arg(h.minimum(c)).arg(h.maximum(c));
+}
+
+void MainWindow::updateHistograms()
+{
+  static const int histWidth = 128;
+  static const int histHeight = 64;
 
-  QRect full(QPoint(0, 0), currentImage.size());
   ui->hstLuminance->
-      setPixmap(drawHistogram(currentImage, full, getLuma,
-                              histWidth, histHeight,
-                              Qt::black, Qt::white));
+      setPixmap(histogram.draw(ImageHistogram::Luma,
+                               histWidth, histHeight,
+                               Qt::black, Qt::white));
   ui->hstRed->
-      setPixmap(drawHistogram(currentImage, full, getRed,
-                              histWidth, histHeight,
-                              Qt::black, Qt::red));
+      setPixmap(histogram.draw(ImageHistogram::Red,
+                               histWidth, histHeight,
+                               Qt::black, Qt::red));
   ui->hstGreen->
-      setPixmap(drawHistogram(currentImage, full, getGreen,
-                              histWidth, histHeight,
-                              Qt::black, Qt::green));
+      setPixmap(histogram.draw(ImageHistogram::Green,
+                               histWidth, histHeight,
+                               Qt::black, Qt::green));
   ui->hstBlue->
-      setPixmap(drawHistogram(currentImage, full, getBlue,
-                              histWidth, histHeight,
-                              Qt::black, Qt::blue));
+      setPixmap(histogram.draw(ImageHistogram::Blue,
+                               histWidth, histHeight,
+                               Qt::black, Qt::blue));
+
+  ui->lblLuminance->setText(channelStats(tr("Luminance"), histogram, ImageHistogram::Luma));
+  ui->lblRed->setText(channelStats(tr("Red"), histogram, ImageHistogram::Red));
+  ui->lblGreen->setText(channelStats(tr("Green"), histogram, ImageHistogram::Green));
+  ui->lblBlue->setText(channelStats(tr("Blue"), histogram, ImageHistogram::Blue));
 }
 
 void MainWindow::filterActivated()
@@ -180,14 +433,436 @@ void MainWindow::filterApply()
     return;
 
   IFilter *ifilter = thisFilter->filter();
+  stopProgressive();
   ui->statusBar->showMessage(tr("Please wait: applying %1...").arg(ifilter->filterName()));
   QCoreApplication::processEvents(QEventLoop::ExcludeUserInputEvents);
 
+  if (editedLayer >= 0 && layers.layer(editedLayer).filterName == ifilter->filterName())
+  {
+    updateLayer(editedLayer, ifilter);
+    editedLayer = -1;
+    return;
+  }
+  editedLayer = -1;
+
+  MemoryMeasure memory(ifilter->filterName());
+  const SpanMask &mask = region->mask();
+  appliedSteps << BatchStep(ifilter->filterName(), ifilter->parameters(),
+                            ifilter->linearLight());
+
+  // Any other step ends a run of resamplings
+  Transform geometry = Transform::scale(1, 1);
+  bool resampling = !floatPrecision && mask.isRect()
+                      && ifilter->resampling(mask.boundingRect(), geometry);
+  if (!resampling)
+    transformChain.clear();
+
+  // Gray images stay 8-bit until a filter without gray kernels comes
+  if (isGray(currentImage) && !ifilter->supportsGray())
+  {
+    renderer->finish();
+    leaveGray();
+  }
+  // Sharing currentImage, as pending tiles and previews do, costs a copy
+  DetachWatch detach("detach", currentImage);
+
+  // Local filters are only recorded in lazy mode. Anything else needs
+  // the pending tiles rendered first.
+  if (lazyRendering && !floatPrecision && ifilter->isLocal())
+  {
+    QTime measure;
+    measure.start();
+    renderer->append(ifilter, mask);
+    layers.appendPending(ifilter, mask);
+    renderer->setVisibleRect(visibleRect());
+    renderer->renderVisible();
+    detach.check();
+    showMemoryMessage(tr("%1 applied to the visible area (%2 ms).")
+                        .arg(ifilter->filterName()).arg(measure.elapsed()), memory);
+    return;
+  }
+  renderer->finish();
+
+  QRect dirty = ifilter->dirtyRect(currentImage, mask.boundingRect());
+  QSize oldSize = currentImage.size();
+
+  // Take the old contents of the dirty region out of the histograms
+  SpanMask counted = histogramMask.intersected(dirty);
+  histogram.subtract(currentImage, counted);
+
   QTime measure;
   measure.start();
-  ifilter->apply(currentImage, region->selection().toRect());
+  ScratchPool::Stats scratch = ScratchPool::instance().stats();
+
+  // Results are cached for the 8-bit image only. A resampling result
+  // depends on the image under its run, which the key doesn't cover.
+  bool cacheable = !floatPrecision && !resampling && ifilter->isCacheable();
+  quint64 key = cacheable ? ResultCache::key(ifilter, currentImage, mask) : 0;
+  QImage tile;
+  bool cached = cacheable && resultCache.find(key, tile);
+
+  if (cached)
+    copySpans(currentImage, tile, dirty, dirty.topLeft());
+  else if (floatPrecision)
+  {
+    ifilter->applyPlanarMasked(planarImage, mask);
+    planarImage.toImage(currentImage, dirty);
+  }
+  else if (resampling)
+  {
+    currentImage = transformChain.apply(currentImage, mask.boundingRect(), geometry,
+                                        Bilinear, ifilter->linearLight());
+    detach.rebase();
+  }
+  else
+  {
+    ifilter->applyMasked(currentImage, mask);
+    if (cacheable)
+    {
+      tile = currentImage.copy(dirty);
+      MemoryMeter::instance().allocated("result cache", tile.byteCount());
+      resultCache.insert(key, tile);
+    }
+  }
   int elapsed = measure.elapsed();
+  detach.check();
+  layers.append(ifilter, mask, dirty, currentImage);
 
-  emit imageUpdated();
-  ui->statusBar->showMessage(tr("%1 applied (%2 ms).").arg(ifilter->filterName()).arg(elapsed));
+  if (currentImage.size() != oldSize)
+    emit imageUpdated();
+  else
+  {
+    histogram.add(currentImage, counted);
+    integral.invalidate(currentImage, dirty);
+    emit imageUpdated(dirty);
+  }
+  QString message;
+  if (cached)
+    message = tr("%1 applied from cache (%2 ms).").arg(ifilter->filterName()).arg(elapsed);
+  else if (resampling && transformChain.length() > 1)
+    message = tr("%1 applied (%2 ms, the last %3 steps resampled at once).")
+                .arg(ifilter->filterName()).arg(elapsed).arg(transformChain.length());
+  else
+  {
+    ScratchPool::Stats after = ScratchPool::instance().stats();
+    message = tr("%1 applied (%2 ms, scratch buffers: %3 reused, %4 allocated).")
+                .arg(ifilter->filterName()).arg(elapsed)
+                .arg(after.hits - scratch.hits).arg(after.misses - scratch.misses);
+  }
+  showMemoryMessage(message, memory);
+}
+
+// message with the memory use measured, which also goes to the log
+void MainWindow::showMemoryMessage(const QString &message, const MemoryMeasure &memory)
+{
+  ui->statusBar->showMessage(message + " " + tr("Memory: %1.").arg(memory.summary()));
+  memory.log();
+}
+
+// Re-render layer index with the settings of ifilter
+void MainWindow::updateLayer(int index, IFilter *ifilter)
+{
+  renderer->finish();
+  transformChain.clear();
+
+  MemoryMeasure memory(tr("%1 (step %2)").arg(ifilter->filterName()).arg(index+1));
+  QTime measure;
+  measure.start();
+  QRect changed;
+  int rendered;
+  QImage result = layers.edit(index, ifilter->parameters(), currentImage, &changed, &rendered);
+  int elapsed = measure.elapsed();
+  appliedSteps[index].parameters = ifilter->parameters();
+
+  if (result.size() != currentImage.size())
+  {
+    currentImage = result;
+    integral.clear();
+    emit imageUpdated();
+  }
+  else
+  {
+    SpanMask counted = histogramMask.intersected(changed);
+    histogram.subtract(currentImage, counted);
+    currentImage = result;
+    histogram.add(currentImage, counted);
+    integral.invalidate(currentImage, changed);
+    emit imageUpdated(changed);
+  }
+  // Layers render at 8 bits: earlier float results are rounded from here
+  if (floatPrecision)
+    planarImage = PlanarImage(currentImage);
+
+  showMemoryMessage(tr("Step %1 (%2) updated: %3 of %4 steps rendered (%5 ms).")
+                      .arg(index+1).arg(ifilter->filterName()).arg(rendered)
+                      .arg(layers.count() - index).arg(elapsed), memory);
+}
+
+// Convert a gray image to 32 bits, for filters and modes without gray
+// kernels. Pixel values are unchanged, so are the histograms.
+void MainWindow::leaveGray()
+{
+  if (!isGray(currentImage))
+    return;
+  currentImage = currentImage.convertToFormat(QImage::Format_RGB32);
+  MemoryMeter::instance().allocated("gray to RGB32", currentImage.byteCount());
+  integral.clear();
+}
+
+void MainWindow::setFloatPrecision(bool enabled)
+{
+  renderer->finish();
+  floatPrecision = enabled;
+  if (enabled && !currentImage.isNull())
+  {
+    leaveGray();
+    planarImage = PlanarImage(currentImage);
+  }
+  else
+    planarImage = PlanarImage();
+}
+
+void MainWindow::setLazyRendering(bool enabled)
+{
+  lazyRendering = enabled;
+  if (!enabled)
+    renderer->finish();
+}
+
+void MainWindow::setLivePreview(bool enabled)
+{
+  livePreview = enabled;
+  if (!enabled)
+    stopProgressive();
+}
+
+void MainWindow::setLinearLight(bool enabled)
+{
+  // Pending work keeps the mode it was started with
+  renderer->finish();
+  stopProgressive();
+  foreach (FilterWrapper *wrapper, filters)
+    wrapper->filter()->setLinearLight(enabled);
+}
+
+QRect MainWindow::visibleRect() const
+{
+  QGraphicsView *view = ui->graphicsView;
+  return view->mapToScene(view->viewport()->rect()).boundingRect().toAlignedRect();
+}
+
+void MainWindow::viewScrolled()
+{
+  renderer->setVisibleRect(visibleRect());
+  renderer->renderVisible();
+}
+
+void MainWindow::tileAboutToUpdate(const QRect &rect)
+{
+  histogram.subtract(currentImage, histogramMask.intersected(rect));
+}
+
+void MainWindow::tileUpdated(const QRect &rect)
+{
+  histogram.add(currentImage, histogramMask.intersected(rect));
+  integral.invalidate(currentImage, rect);
+  emit imageUpdated(rect);
+}
+
+void MainWindow::renderingFinished()
+{
+  ui->statusBar->showMessage(tr("Rendering finished."), 2000);
+}
+
+void MainWindow::previewFilter()
+{
+  FilterWrapper *wrapper = qobject_cast<FilterWrapper *>(sender());
+  if (wrapper)
+    startProgressive(wrapper->filter());
+}
+
+void MainWindow::filterDeactivated()
+{
+  FilterWrapper *wrapper = qobject_cast<FilterWrapper *>(sender());
+  if (wrapper && wrapper->filter() == progressive->filter())
+    stopProgressive();
+}
+
+void MainWindow::startProgressive(IFilter *ifilter)
+{
+  // Pending lazy tiles would be drawn over the preview, and they swap
+  // filter settings while rendering
+  if (!livePreview || currentImage.isNull() || !ifilter->isLocal() || renderer->isPending())
+    return;
+
+  stopProgressive();
+  QImage source = currentImage;
+  ifilter->prepareFormat(source);
+  progressive->start(ifilter, source, region->mask());
+}
+
+void MainWindow::stopProgressive()
+{
+  progressive->cancel();
+  if (!previewRect.isEmpty())
+    paintPixmap(currentImage, previewRect);
+  previewRect = QRect();
+}
+
+void MainWindow::progressiveUpdated(const QRect &rect)
+{
+  previewRect |= rect;
+  paintPixmap(progressive->result(), rect);
+}
+
+void MainWindow::progressivePassFinished(int pass, int passes)
+{
+  if (pass < passes)
+    ui->statusBar->showMessage(tr("Previewing %1: pass %2 of %3 (%4 ms)...")
+                               .arg(progressive->filter()->filterName())
+                               .arg(pass+1).arg(passes+1).arg(progressive->elapsed()));
+}
+
+void MainWindow::progressiveFinished()
+{
+  IFilter *ifilter = progressive->filter();
+  const SpanMask &mask = progressive->mask();
+
+  // Applying with the same settings then takes the result from the cache,
+  // unless the preview had to leave the gray format
+  if (!floatPrecision && ifilter->isCacheable()
+      && progressive->result().format() == currentImage.format())
+  {
+    QRect dirty = ifilter->dirtyRect(currentImage, mask.boundingRect());
+    resultCache.insert(ResultCache::key(ifilter, currentImage, mask),
+                       progressive->result().copy(dirty));
+  }
+  ui->statusBar->showMessage(tr("Preview of %1 finished (%2 ms).")
+                             .arg(ifilter->filterName()).arg(progressive->elapsed()));
+}
+
+void MainWindow::selectionChanged()
+{
+  // While only a preview is shown, a partial selection is decoded alone
+  // at full resolution to be measured
+  if (currentImage.isNull())
+  {
+    const SpanMask &mask = region->mask();
+    if (previewImage.isNull() || !loader->isLoading())
+      return;
+    if (mask.isRect() && mask.boundingRect() == QRect(QPoint(0, 0), loader->imageSize()))
+    {
+      histogram.clear();
+      histogram.add(previewImage, previewImage.rect());
+      updateHistograms();
+    }
+    else
+      loader->decodeRegion(mask.boundingRect());
+    return;
+  }
+
+  // Only the runs that left or entered the selection are counted again
+  const SpanMask &mask = region->mask();
+  histogram.subtract(currentImage, histogramMask.subtracted(mask));
+  histogram.add(currentImage, mask.subtracted(histogramMask));
+  histogramMask = mask;
+  updateHistograms();
+
+  // The preview follows the selection
+  if (progressive->filter())
+    startProgressive(progressive->filter());
+}
+
+void MainWindow::showBatchDialog()
+{
+  if (batch)
+  {
+    ui->statusBar->showMessage(tr("Please wait: a batch job is running."));
+    return;
+  }
+  if (appliedSteps.isEmpty())
+  {
+    ui->statusBar->showMessage(tr("Apply filters to this image first: batch jobs repeat them."));
+    return;
+  }
+
+  QStringList files = QFileDialog::getOpenFileNames(this, tr("Select images..."), QString(),
+                                                    tr("Images (*.bmp *.png *.jpg)"));
+  if (files.isEmpty())
+    return;
+  QString dir = QFileDialog::getExistingDirectory(this, tr("Select output folder..."));
+  if (dir.isEmpty())
+    return;
+  if (BatchPipeline::overwritesInput(files, dir))
+  {
+    ui->statusBar->showMessage(tr("Choose an output folder other than the images' folder: "
+                                  "results keep the file names."));
+    return;
+  }
+
+  batch = new BatchPipeline(appliedSteps, this);
+  connect(batch, SIGNAL(progress(int,int)), SLOT(batchProgress(int,int)));
+  connect(batch, SIGNAL(fileFailed(QString)), SLOT(batchFileFailed(QString)));
+  connect(batch, SIGNAL(finished()), SLOT(batchFinished()));
+
+  batchTime.start();
+  batchFailures = 0;
+  if (!batch->start(files, dir, pngLevel, jpegQuality))
+  {
+    delete batch;
+    batch = 0;
+    ui->statusBar->showMessage(tr("Batch job failed to start."));
+    return;
+  }
+  ui->statusBar->showMessage(tr("Batch: processing %1 images...").arg(files.size()));
+}
+
+void MainWindow::batchProgress(int done, int total)
+{
+  ui->statusBar->showMessage(tr("Batch: %1 of %2 images done.").arg(done).arg(total));
+}
+
+void MainWindow::batchFileFailed(const QString &filename)
+{
+  batchFailures++;
+  ui->statusBar->showMessage(tr("Batch: %1 failed.").arg(filename));
+}
+
+void MainWindow::batchFinished()
+{
+  ui->statusBar->showMessage(tr("Batch finished in %1 ms, %2 failed.")
+                             .arg(batchTime.elapsed()).arg(batchFailures));
+
+  // Per-stage occupancy shows which stage limits the throughput
+  QMessageBox::information(this, tr("Batch finished"), batch->report());
+  batch->deleteLater();
+  batch = 0;
+}
+
+void MainWindow::editAppliedStep()
+{
+  if (layers.count() == 0)
+  {
+    ui->statusBar->showMessage(tr("No filters applied to this image yet."));
+    return;
+  }
+
+  QStringList steps;
+  for (int i=0; i<layers.count(); i++)
+    steps << tr("%1. %2").arg(i+1).arg(layers.layer(i).filterName);
+  bool ok;
+  QString step = QInputDialog::getItem(this, tr("Edit step"), tr("Applied filter:"),
+                                       steps, steps.size()-1, false, &ok);
+  if (!ok)
+    return;
+
+  // Load the step's settings; applying its filter then updates the step
+  int index = steps.indexOf(step);
+  const AdjustmentStack::Layer &layer = layers.layer(index);
+  foreach (FilterWrapper *wrapper, filters)
+    if (wrapper->filter()->filterName() == layer.filterName)
+      wrapper->filter()->setParameters(layer.parameters);
+  editedLayer = index;
+  ui->statusBar->showMessage(tr("Editing step %1: change the settings of %2 and apply to update it.")
+                             .arg(index+1).arg(layer.filterName));
 }
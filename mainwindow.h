@@ -2,6 +2,14 @@
 #define MAINWINDOW_H
 
 #include <QMainWindow>
+#include <QTime>
+#include "filters/histogram.h"
+#include "filters/integral.h"
+#include "filters/planar.h"
+#include "filters/transform.h"
+#include "resultcache.h"
+#include "batchpipeline.h"
+#include "adjustmentstack.h"
 
 namespace Ui {
 class MainWindow;
@@ -10,6 +18,13 @@ class QFileDialog;
 class QGraphicsPixmapItem;
 class FilterWrapper;
 class RegionEditor;
+class ImageLoader;
+class ImageSaver;
+class QProgressBar;
+class LazyRenderer;
+class ProgressiveRenderer;
+class IFilter;
+class MemoryMeasure;
 
 class MainWindow : public QMainWindow
 {
@@ -26,18 +41,62 @@ public slots:
   void saveFile(const QString &filename);
   void saveFile();
   void updateView();
+  void updateView(const QRect &dirty);
   void filterActivated();
   void filterApply();
+  void setFloatPrecision(bool enabled);
+  void setLazyRendering(bool enabled);
+  void setLivePreview(bool enabled);
+  void setLinearLight(bool enabled);
+  void showBatchDialog();
+  void editAppliedStep();
+
+private slots:
+  void showPreview(const QImage &preview, const QSize &fullSize);
+  void imageLoaded(const QImage &image);
+  void regionDecoded(const QImage &image, const QRect &clip);
+  void imageLoadFailed(const QString &filename);
+  void saveProgress(int percent);
+  void saveFinished(const QString &filename, bool ok);
+  void viewScrolled();
+  void tileAboutToUpdate(const QRect &rect);
+  void tileUpdated(const QRect &rect);
+  void renderingFinished();
+  void previewFilter();
+  void filterDeactivated();
+  void progressiveUpdated(const QRect &rect);
+  void progressivePassFinished(int pass, int passes);
+  void progressiveFinished();
+  void selectionChanged();
+  void batchProgress(int done, int total);
+  void batchFileFailed(const QString &filename);
+  void batchFinished();
 
 signals:
   void fileOperationsEnabled(bool);
   void imageUpdated();
+  void imageUpdated(const QRect &dirty);
 
 private:
+  void updateHistograms();
+  QRect visibleRect() const;
+  void paintPixmap(const QImage &image, const QRect &rect);
+  void startProgressive(IFilter *ifilter);
+  void stopProgressive();
+  void updateLayer(int index, IFilter *ifilter);
+  void leaveGray();
+  void showMemoryMessage(const QString &message, const MemoryMeasure &memory);
+
   Ui::MainWindow *ui;
 
   QAction *actOpen;
   QAction *actSaveAs;
+  QAction *actFloatPrecision;
+  QAction *actLazyRendering;
+  QAction *actLivePreview;
+  QAction *actLinearLight;
+  QAction *actBatch;
+  QAction *actEditStep;
   //QAction *actSave;
 
   QFileDialog *dlgOpen;
@@ -45,10 +104,54 @@ private:
 
   QGraphicsPixmapItem *imageView;
   RegionEditor *region;
+  ImageLoader *loader;
+  QTime loadTime;
+  ImageSaver *saver;
+  QProgressBar *saveProgressBar;
+  QTime saveTime;
+  int pngLevel;
+  int jpegQuality;
 
   QImage currentImage;
+  // Reduced image shown until currentImage is loaded
+  QImage previewImage;
+  QPixmap currentPixmap;
+  // Histograms of currentImage under histogramMask, the selection
+  ImageHistogram histogram;
+  SpanMask histogramMask;
+  // Summed-area tables of currentImage, shared with the filters and
+  // invalidated wherever currentImage changes
+  IntegralImage integral;
+  ResultCache resultCache;
+  // Rotate and Scale steps in a row over the same selection, resampled
+  // from the image under the first of them
+  TransformChain transformChain;
+
+  // Floating-point working copy of currentImage, used when enabled.
+  // currentImage then only serves display and saving.
+  PlanarImage planarImage;
+  bool floatPrecision;
+
+  // Records local filters and renders them on demand, when enabled
+  LazyRenderer *renderer;
+  bool lazyRendering;
   QString currentFileName;
 
+  // Preview of the filter being edited, drawn over currentPixmap only
+  ProgressiveRenderer *progressive;
+  bool livePreview;
+  QRect previewRect;
+
+  // Filters applied since loading, repeated by batch jobs
+  QList<BatchStep> appliedSteps;
+  // The same steps as editable layers; editedLayer is the one the next
+  // apply of its filter changes, -1 for none
+  AdjustmentStack layers;
+  int editedLayer;
+  BatchPipeline *batch;
+  QTime batchTime;
+  int batchFailures;
+
   QList<FilterWrapper *> filters;
 };
 
@@ -19,7 +19,29 @@ SOURCES += main.cpp\
     filters.cpp \
     filterwrapper.cpp \
     filters/histogram.cpp \
-    regioneditor.cpp
+    regioneditor.cpp \
+    filters/planar.cpp \
+    filters/spanmask.cpp \
+    imageloader.cpp \
+    imagesaver.cpp \
+    pngencoder.cpp \
+    resultcache.cpp \
+    lazyrenderer.cpp \
+    filters/reference.cpp \
+    selfcheck.cpp \
+    filters/integral.cpp \
+    batchpipeline.cpp \
+    filters/scratchpool.cpp \
+    progressiverenderer.cpp \
+    filters/denoise.cpp \
+    filters/morphology.cpp \
+    filters/tuning.cpp \
+    autotuner.cpp \
+    filters/srgb.cpp \
+    adjustmentstack.cpp \
+    filters/pixelformat.cpp \
+    filters/memorymeter.cpp \
+    filters/edges.cpp
 
 HEADERS  += mainwindow.h \
     filters/transform.h \
@@ -31,10 +53,49 @@ HEADERS  += mainwindow.h \
     filters.h \
     filterwrapper.h \
     filters/histogram.h \
-    regioneditor.h
+    regioneditor.h \
+    filters/planar.h \
+    filters/spanmask.h \
+    imageloader.h \
+    imagesaver.h \
+    pngencoder.h \
+    resultcache.h \
+    lazyrenderer.h \
+    filters/reference.h \
+    selfcheck.h \
+    filters/integral.h \
+    boundedqueue.h \
+    batchpipeline.h \
+    filters/scratchpool.h \
+    progressiverenderer.h \
+    filters/denoise.h \
+    filters/morphology.h \
+    filters/tuning.h \
+    autotuner.h \
+    filters/srgb.h \
+    adjustmentstack.h \
+    filters/pixelformat.h \
+    filters/memorymeter.h \
+    filters/edges.h
 
 FORMS    += mainwindow.ui
 
+# Parallel PNG encoder: the system zlib on unix, Qt's own copy compiled
+# in on Windows. Without either, PNGs are saved through QImageWriter.
+unix: LIBS += -lz
+win32 {
+  exists($$[QT_INSTALL_PREFIX]/src/3rdparty/zlib.pri) {
+    include($$[QT_INSTALL_PREFIX]/src/3rdparty/zlib.pri)
+  } else {
+    DEFINES += NO_PARALLEL_PNG
+    SOURCES -= pngencoder.cpp
+  }
+}
+
+# Let GCC vectorize the planar float kernels; sqrtf() only vectorizes
+# without errno
+*-g++*: QMAKE_CXXFLAGS_RELEASE += -ftree-vectorize -fno-math-errno
+
 
 
 
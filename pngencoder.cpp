@@ -0,0 +1,275 @@
+#include <cstdlib>
+#include <cstring>
+#include <zlib.h>
+#include <QIODevice>
+#include <QAtomicInt>
+#include <QThread>
+#include <QVector>
+#include <QtConcurrentMap>
+
+#include "pngencoder.h"
+#include "filters/pixelformat.h"
+
+static const int minStripRows = 64;
+static const int outChunk = 64*1024;
+
+struct PngStrip
+{
+    const QImage *image;
+    int y1, y2;             // rows [y1, y2)
+    int channels;
+    int level;
+    bool last;
+    QAtomicInt *progress;
+
+    QByteArray out;         // raw deflate data
+    uLong adler;            // of the uncompressed filtered rows
+    uLong rawLength;
+    bool ok;
+};
+
+static void packRow(const QImage &img, int y, int channels, uchar *dst)
+{
+  // Gray levels are stored as they are
+  if (channels == 1)
+  {
+    memcpy(dst, img.constScanLine(y), img.width());
+    return;
+  }
+
+  const QRgb *src = reinterpret_cast<const QRgb *>(img.constScanLine(y));
+  int w = img.width();
+  if (channels == 4)
+    for (int x=0; x<w; x++, dst+=4)
+    {
+      dst[0] = qRed(src[x]);
+      dst[1] = qGreen(src[x]);
+      dst[2] = qBlue(src[x]);
+      dst[3] = qAlpha(src[x]);
+    }
+  else
+    for (int x=0; x<w; x++, dst+=3)
+    {
+      dst[0] = qRed(src[x]);
+      dst[1] = qGreen(src[x]);
+      dst[2] = qBlue(src[x]);
+    }
+}
+
+static inline int paeth(int a, int b, int c)
+{
+  int p = a + b - c;
+  int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  if (pa <= pb && pa <= pc)
+    return a;
+  return pb <= pc ? b : c;
+}
+
+// Filter row into all five candidates, each prefixed with its type byte
+static void filterRow(const uchar *cur, const uchar *prev, int len, int bpp,
+                      uchar *cand[5])
+{
+  cand[0][0] = 0;
+  memcpy(cand[0]+1, cur, len);
+  for (int f=1; f<5; f++)
+    cand[f][0] = f;
+
+  for (int i=0; i<len; i++)
+  {
+    int a = i >= bpp ? cur[i-bpp] : 0;
+    int b = prev[i];
+    int c = i >= bpp ? prev[i-bpp] : 0;
+    cand[1][i+1] = cur[i] - a;
+    cand[2][i+1] = cur[i] - b;
+    cand[3][i+1] = cur[i] - ((a + b) >> 1);
+    cand[4][i+1] = cur[i] - paeth(a, b, c);
+  }
+}
+
+// Minimum sum of absolute differences, as libpng does
+static int pickFilter(uchar *cand[5], int len)
+{
+  int best = 0;
+  long bestSum = -1;
+  for (int f=0; f<5; f++)
+  {
+    long sum = 0;
+    for (int i=1; i<=len; i++)
+      sum += abs(int(static_cast<signed char>(cand[f][i])));
+    if (bestSum < 0 || sum < bestSum)
+    {
+      best = f;
+      bestSum = sum;
+    }
+  }
+  return best;
+}
+
+static bool deflateChunk(z_stream &zs, QByteArray &out, int flush)
+{
+  char buf[outChunk];
+  do
+  {
+    zs.next_out = reinterpret_cast<Bytef *>(buf);
+    zs.avail_out = outChunk;
+    int ret = deflate(&zs, flush);
+    if (ret == Z_STREAM_ERROR)
+      return false;
+    out.append(buf, outChunk - zs.avail_out);
+  } while (zs.avail_out == 0);
+  return true;
+}
+
+static void encodeStrip(PngStrip &s)
+{
+  const QImage &img = *s.image;
+  int len = img.width()*s.channels;
+
+  QVector<uchar> rows(2*len, 0);
+  uchar *prev = rows.data();
+  uchar *cur = rows.data() + len;
+  QVector<uchar> candData(5*(len+1));
+  uchar *cand[5];
+  for (int f=0; f<5; f++)
+    cand[f] = candData.data() + f*(len+1);
+
+  // Filters only look one row up, so strips start from the real row
+  if (s.y1 > 0)
+    packRow(img, s.y1-1, s.channels, prev);
+
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  s.ok = deflateInit2(&zs, s.level, Z_DEFLATED, -MAX_WBITS, 8,
+                      Z_DEFAULT_STRATEGY) == Z_OK;
+  s.adler = adler32(0, Z_NULL, 0);
+  s.rawLength = 0;
+
+  for (int y=s.y1; s.ok && y<s.y2; y++)
+  {
+    packRow(img, y, s.channels, cur);
+    filterRow(cur, prev, len, s.channels, cand);
+    uchar *row = cand[s.level > 0 ? pickFilter(cand, len) : 0];
+
+    s.adler = adler32(s.adler, row, len+1);
+    s.rawLength += len+1;
+    zs.next_in = row;
+    zs.avail_in = len+1;
+    s.ok = deflateChunk(zs, s.out, Z_NO_FLUSH);
+
+    qSwap(prev, cur);
+  }
+
+  // A sync flush ends the strip on a byte boundary without ending the stream
+  if (s.ok)
+    s.ok = deflateChunk(zs, s.out, s.last ? Z_FINISH : Z_SYNC_FLUSH);
+  deflateEnd(&zs);
+
+  if (s.progress)
+    s.progress->fetchAndAddRelaxed(1);
+}
+
+static void putUInt32(QByteArray &data, quint32 v)
+{
+  data.append(char(v >> 24));
+  data.append(char(v >> 16));
+  data.append(char(v >> 8));
+  data.append(char(v));
+}
+
+static bool writeChunk(QIODevice *dev, const char *type, const QByteArray &data)
+{
+  QByteArray chunk;
+  putUInt32(chunk, data.size());
+  chunk.append(type, 4);
+  chunk.append(data);
+  uLong crc = crc32(0, Z_NULL, 0);
+  crc = crc32(crc, reinterpret_cast<const Bytef *>(chunk.constData()) + 4,
+              data.size() + 4);
+  putUInt32(chunk, crc);
+  return dev->write(chunk) == chunk.size();
+}
+
+static int rowsPerStrip(const QImage &img)
+{
+  int strips = QThread::idealThreadCount()*4;
+  return qMax(minStripRows, (img.height() + strips-1)/strips);
+}
+
+int pngStripCount(const QImage &img)
+{
+  int rows = rowsPerStrip(img);
+  return (img.height() + rows-1)/rows;
+}
+
+bool writePng(const QImage &image, QIODevice *dev, int level,
+              QAtomicInt *progress)
+{
+  QImage img = image;
+  bool gray = isGray(img);
+  if (!gray && img.format() != QImage::Format_RGB32 && img.format() != QImage::Format_ARGB32)
+    img = img.convertToFormat(QImage::Format_ARGB32);
+  if (img.isNull())
+    return false;
+  level = qBound(0, level, 9);
+  int channels = gray ? 1 : img.hasAlphaChannel() ? 4 : 3;
+
+  int rows = rowsPerStrip(img);
+  QVector<PngStrip> strips;
+  for (int y=0; y<img.height(); y+=rows)
+  {
+    PngStrip s;
+    s.image = &img;
+    s.y1 = y;
+    s.y2 = qMin(y + rows, img.height());
+    s.channels = channels;
+    s.level = level;
+    s.last = s.y2 == img.height();
+    s.progress = progress;
+    strips.append(s);
+  }
+  QtConcurrent::blockingMap(strips, encodeStrip);
+
+  static const char signature[] = "\x89PNG\r\n\x1a\n";
+  if (dev->write(signature, 8) != 8)
+    return false;
+
+  QByteArray ihdr;
+  putUInt32(ihdr, img.width());
+  putUInt32(ihdr, img.height());
+  ihdr.append(char(8));                    // bit depth
+  ihdr.append(char(channels == 4 ? 6 : channels == 3 ? 2 : 0)); // RGBA, RGB or gray
+  ihdr.append(char(0));                    // deflate
+  ihdr.append(char(0));                    // adaptive filtering
+  ihdr.append(char(0));                    // no interlace
+  if (!writeChunk(dev, "IHDR", ihdr))
+    return false;
+
+  // zlib header: 32K window, level hint, check bits
+  int cmf = 0x78;
+  int flg = (level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6;
+  flg += 31 - (cmf*256 + flg) % 31;
+
+  uLong adler = adler32(0, Z_NULL, 0);
+  for (int i=0; i<strips.size(); i++)
+  {
+    PngStrip &s = strips[i];
+    if (!s.ok)
+      return false;
+    adler = adler32_combine(adler, s.adler, s.rawLength);
+
+    QByteArray idat;
+    if (i == 0)
+    {
+      idat.append(char(cmf));
+      idat.append(char(flg));
+    }
+    idat.append(s.out);
+    s.out.clear();
+    if (s.last)
+      putUInt32(idat, adler);
+    if (!writeChunk(dev, "IDAT", idat))
+      return false;
+  }
+
+  return writeChunk(dev, "IEND", QByteArray());
+}
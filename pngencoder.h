@@ -0,0 +1,21 @@
+#ifndef PNGENCODER_H
+#define PNGENCODER_H
+
+#include <QImage>
+
+class QIODevice;
+class QAtomicInt;
+
+/** PNG encoder deflating horizontal strips in parallel.
+ * Each strip is filtered and compressed independently, ending on a byte
+ * boundary with a sync flush, so the strips concatenate into one valid
+ * zlib stream; the checksum is assembled with adler32_combine().
+ * progress, if given, is incremented once per finished strip.
+ */
+bool writePng(const QImage &img, QIODevice *dev, int level,
+              QAtomicInt *progress = 0);
+
+// Number of strips writePng() splits img into
+int pngStripCount(const QImage &img);
+
+#endif // PNGENCODER_H
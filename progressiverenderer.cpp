@@ -0,0 +1,81 @@
+#include "progressiverenderer.h"
+#include "ifilter.h"
+
+// Pixels per band: small enough to keep the event loop responsive
+static const int bandArea = 64*1024;
+// Band and input origins are multiples of this, so that coarse passes
+// sample the same grid in every band
+static const int gridAlign = 16;
+
+ProgressiveRenderer::ProgressiveRenderer(QObject *parent)
+  : QObject(parent), m_filter(0), m_band(0), m_pass(0), m_passes(0)
+{
+  m_step.setInterval(0);
+  connect(&m_step, SIGNAL(timeout()), SLOT(step()));
+}
+
+void ProgressiveRenderer::start(IFilter *filter, const QImage &source, const SpanMask &mask)
+{
+  cancel();
+
+  QRect bounds = mask.boundingRect() & source.rect();
+  if (bounds.isEmpty())
+    return;
+
+  m_filter = filter;
+  m_source = source;
+  m_result = source;
+  m_mask = mask;
+  m_passes = filter->refinementPasses();
+
+  int rows = qMax(gridAlign, bandArea/bounds.width()/gridAlign*gridAlign);
+  for (int y=bounds.top() - bounds.top() % gridAlign; y<=bounds.bottom(); y+=rows)
+    m_bands << (QRect(bounds.left(), y, bounds.width(), rows) & bounds);
+
+  m_clock.start();
+  m_step.start();
+}
+
+void ProgressiveRenderer::cancel()
+{
+  m_step.stop();
+  m_filter = 0;
+  m_source = QImage();
+  m_result = QImage();
+  m_mask = SpanMask();
+  m_bands.clear();
+  m_band = 0;
+  m_pass = 0;
+}
+
+void ProgressiveRenderer::step()
+{
+  QRect band = m_bands[m_band];
+  SpanMask mask = m_mask.intersected(band);
+  if (!mask.isEmpty())
+  {
+    QRect in = m_filter->inputRect(m_source, band);
+    in.setLeft(in.left() - in.left() % gridAlign);
+    in.setTop(in.top() - in.top() % gridAlign);
+
+    QImage src = m_source.copy(in);
+    SpanMask local = mask.translated(-in.left(), -in.top());
+    if (m_pass < m_passes)
+      m_filter->applyCoarse(src, local, m_pass);
+    else
+      m_filter->applyMasked(src, local);
+    copySpans(m_result, src, mask, in.topLeft());
+    emit updated(mask.boundingRect());
+  }
+
+  if (++m_band < m_bands.size())
+    return;
+
+  m_band = 0;
+  emit passFinished(m_pass, m_passes);
+  if (++m_pass > m_passes)
+  {
+    m_step.stop();
+    emit finished();
+  }
+}
@@ -0,0 +1,60 @@
+#ifndef PROGRESSIVERENDERER_H
+#define PROGRESSIVERENDERER_H
+
+#include <QObject>
+#include <QImage>
+#include <QList>
+#include <QTimer>
+#include <QElapsedTimer>
+#include "filters/spanmask.h"
+
+class IFilter;
+
+/** Preview of a local filter that gets better while the user waits.
+ * The coarse passes of the filter are shown first, then the exact
+ * result. Each pass is computed in bands, one per event loop turn, so
+ * a restart with new parameters or a new selection drops the remaining
+ * work at once instead of after the slowest pass.
+ */
+class ProgressiveRenderer : public QObject
+{
+  Q_OBJECT
+public:
+  explicit ProgressiveRenderer(QObject *parent = 0);
+
+  // Preview filter over mask of source, replacing any previous preview
+  void start(IFilter *filter, const QImage &source, const SpanMask &mask);
+  // Drop the preview
+  void cancel();
+
+  bool isRunning() const { return m_step.isActive(); }
+  // Filter of the current preview, 0 if none
+  IFilter *filter() const { return m_filter; }
+  const SpanMask &mask() const { return m_mask; }
+  // Source with the passes done so far
+  const QImage &result() const { return m_result; }
+  qint64 elapsed() const { return m_clock.elapsed(); }
+
+signals:
+  void updated(const QRect &rect);
+  // pass == passes for the exact one
+  void passFinished(int pass, int passes);
+  void finished();
+
+private slots:
+  void step();
+
+private:
+  IFilter *m_filter;
+  QImage m_source;
+  QImage m_result;
+  SpanMask m_mask;
+  QList<QRect> m_bands;
+  int m_band;
+  int m_pass;
+  int m_passes;
+  QTimer m_step;
+  QElapsedTimer m_clock;
+};
+
+#endif // PROGRESSIVERENDERER_H
@@ -1,4 +1,6 @@
 #include <QGraphicsEllipseItem>
+#include <QGraphicsSceneMouseEvent>
+#include <QStyleOptionGraphicsItem>
 #include <QPainter>
 #include <QDebug>
 
@@ -83,9 +85,11 @@ private:
 // =======
 
 RegionEditor::RegionEditor(const QRectF &area, QGraphicsItem *parent)
-  : QGraphicsObject(parent), m_selectAll(true)
+  : QGraphicsObject(parent), m_selectAll(true), m_showMask(true),
+    m_mode(RectangleMode), m_drawingLasso(false)
 {
   setFlag(QGraphicsItem::ItemSendsGeometryChanges);
+  setFlag(QGraphicsItem::ItemUsesExtendedStyleOption); // Partial mask repaints
 
   m_topLeft = new RegionEditorMarker(this);
   m_topRight = new RegionEditorMarker(this);
@@ -112,8 +116,65 @@ QRectF RegionEditor::boundingRect() const
   return m_area.adjusted(-radius, -radius, radius, radius);
 }
 
+// Fill spans, merging runs repeated on consecutive rows into one rect
+static void paintSpans(QPainter *painter, const SpanMask &mask, const QColor &color)
+{
+  const QVector<Span> &spans = mask.spans();
+  QVector<QRect> open, next;
+  for (int i=0; i<=spans.size(); i++)
+  {
+    bool rowEnd = i==spans.size() || (i>0 && spans[i].y != spans[i-1].y);
+    if (rowEnd && i>0)
+    {
+      // Flush runs not continued on this row
+      int y = spans[i-1].y;
+      for (int j=0; j<open.size(); j++)
+        if (open[j].bottom() < y)
+          painter->fillRect(open[j], color);
+        else
+          next.append(open[j]);
+      open = next;
+      next.clear();
+    }
+    if (i == spans.size())
+      break;
+
+    const Span &s = spans[i];
+    bool extended = false;
+    for (int j=0; j<open.size() && !extended; j++)
+      if (open[j].left() == s.x1 && open[j].right() == s.x2
+          && open[j].bottom() == s.y-1)
+      {
+        open[j].setBottom(s.y);
+        extended = true;
+      }
+    if (!extended)
+      open.append(QRect(QPoint(s.x1, s.y), QPoint(s.x2, s.y)));
+  }
+  for (int j=0; j<open.size(); j++)
+    painter->fillRect(open[j], color);
+}
+
 void RegionEditor::paint(QPainter *painter, const QStyleOptionGraphicsItem *option, QWidget *widget)
 {
+  if (m_mode != RectangleMode)
+  {
+    QRect full = mapRectFromParent(m_area).toRect();
+    QRect exposed = option->exposedRect.toAlignedRect() & full;
+
+    if (m_showMask && !m_drawingLasso)
+      paintSpans(painter, m_mask.complement(exposed), QColor(0, 0, 0, 128));
+
+    painter->setPen(QPen(QColor(0, 0, 0, 128), 2));
+    if (m_mode == EllipseMode)
+      painter->drawEllipse(QRectF(m_topLeft->pos(), m_bottomRight->pos()));
+    else if (m_drawingLasso)
+      painter->drawPolyline(m_lasso);
+    else if (!m_lasso.isEmpty())
+      painter->drawPolygon(m_lasso);
+    return;
+  }
+
   QRectF selected(m_topLeft->pos(), m_bottomRight->pos());
   QRectF inset = selected.adjusted(1, 1, -1, -1);
   QRectF bound = mapRectFromParent(boundingRect());
@@ -140,14 +201,12 @@ void RegionEditor::setArea(const QRectF &area)
   else
   {
     setVisible(true);
-    m_topLeft->setVisible(true);
-    m_topRight->setVisible(true);
-    m_bottomLeft->setVisible(true);
-    m_bottomRight->setVisible(true);
+    setMarkersVisible(m_mode != LassoMode);
   }
 
   if (m_selectAll)
     resetSelection();
+  updateMask();
 }
 
 QRectF RegionEditor::selection() const
@@ -161,11 +220,90 @@ void RegionEditor::resetSelection()
   m_selectAll = true;
   m_topLeft->setPos(QPointF(-1, -1));
   m_bottomRight->setPos(QPointF(m_area.width()+1, m_area.height()+1));
+  m_lasso.clear();
+  updateMask();
+  update();
 }
 
 void RegionEditor::selectionUpdated()
 {
   m_selectAll = (selection() == m_area);
+  updateMask();
+  update();
+}
+
+void RegionEditor::updateMask()
+{
+  QRect area = m_area.toRect();
+  switch (m_mode)
+  {
+  case EllipseMode:
+    m_mask = SpanMask::ellipse(selection().toRect()).intersected(area);
+    break;
+
+  case LassoMode:
+    if (m_lasso.size() < 3)
+      m_mask = SpanMask(area);
+    else
+      m_mask = SpanMask::polygon(m_lasso, area);
+    break;
+
+  default:
+  case RectangleMode:
+    m_mask = SpanMask(selection().toRect() & area);
+  }
+  emit maskChanged();
+}
+
+void RegionEditor::setMarkersVisible(bool visible)
+{
+  m_topLeft->setVisible(visible);
+  m_topRight->setVisible(visible);
+  m_bottomLeft->setVisible(visible);
+  m_bottomRight->setVisible(visible);
+}
+
+void RegionEditor::setMode(int mode)
+{
+  m_mode = SelectionMode(mode);
+  m_drawingLasso = false;
+  setMarkersVisible(m_mode != LassoMode);
+  updateMask();
+  update();
+}
+
+void RegionEditor::mousePressEvent(QGraphicsSceneMouseEvent *event)
+{
+  if (m_mode != LassoMode || event->button() != Qt::LeftButton)
+  {
+    event->ignore();
+    return;
+  }
+
+  m_drawingLasso = true;
+  m_lasso.clear();
+  m_lasso << event->pos();
+  update();
+}
+
+void RegionEditor::mouseMoveEvent(QGraphicsSceneMouseEvent *event)
+{
+  if (!m_drawingLasso)
+    return;
+
+  m_lasso << event->pos();
+  update();
+}
+
+void RegionEditor::mouseReleaseEvent(QGraphicsSceneMouseEvent *event)
+{
+  if (!m_drawingLasso)
+    return;
+
+  m_lasso << event->pos();
+  m_drawingLasso = false;
+  m_selectAll = false;
+  updateMask();
   update();
 }
 
@@ -2,6 +2,8 @@
 #define REGIONEDITOR_H
 
 #include <QGraphicsObject>
+#include <QPolygonF>
+#include "filters/spanmask.h"
 
 class RegionEditorMarker;
 
@@ -9,11 +11,14 @@ class RegionEditor : public QGraphicsObject
 {
   Q_OBJECT
 public:
+  enum SelectionMode { RectangleMode, EllipseMode, LassoMode };
+
   RegionEditor(const QRectF &area, QGraphicsItem *parent = 0);
 
   void setArea(const QRectF &area);
 
   QRectF selection() const;
+  const SpanMask &mask() const { return m_mask; }
 
   QSizeF size() const { return m_area.size(); }
 
@@ -21,15 +26,25 @@ public:
   virtual void paint(QPainter *painter, const QStyleOptionGraphicsItem *option, QWidget *widget = 0);
   virtual QRectF boundingRect() const;
 
+signals:
+  // The selection mask changed, also while markers are being dragged
+  void maskChanged();
+
 public slots:
   void resetSelection();
   void setShowMask(bool value);
+  void setMode(int mode);
 
 protected:
   virtual QVariant itemChange(GraphicsItemChange change, const QVariant &value);
+  virtual void mousePressEvent(QGraphicsSceneMouseEvent *event);
+  virtual void mouseMoveEvent(QGraphicsSceneMouseEvent *event);
+  virtual void mouseReleaseEvent(QGraphicsSceneMouseEvent *event);
 
 private:
   void selectionUpdated();
+  void updateMask();
+  void setMarkersVisible(bool visible);
 
   RegionEditorMarker *m_topLeft;
   RegionEditorMarker *m_topRight;
@@ -39,6 +54,11 @@ private:
   bool m_selectAll;
   bool m_showMask;
 
+  SelectionMode m_mode;
+  QPolygonF m_lasso;
+  bool m_drawingLasso;
+  SpanMask m_mask;
+
   friend class RegionEditorMarker;
 };
 
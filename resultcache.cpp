@@ -0,0 +1,213 @@
+#include <cstring>
+#include <QDesktopServices>
+#include <QDir>
+#include <QFile>
+
+#include "resultcache.h"
+#include "ifilter.h"
+
+static const qint64 memoryBudget = Q_INT64_C(256)*1024*1024;
+static const qint64 diskBudget = Q_INT64_C(1024)*1024*1024;
+
+static const quint64 fnvPrime = Q_UINT64_C(1099511628211);
+
+// MurmurHash3 finalizer: every input bit reaches every output bit. A bare
+// multiply only carries bits upward, so byte k of a word would never
+// reach the low 8k bits of the hash.
+static inline quint64 mixWord(quint64 k)
+{
+  k ^= k >> 33;
+  k *= Q_UINT64_C(0xff51afd7ed558ccd);
+  k ^= k >> 33;
+  k *= Q_UINT64_C(0xc4ceb9fe1a85ec53);
+  k ^= k >> 33;
+  return k;
+}
+
+quint64 hashBytes(const void *data, qint64 size, quint64 h)
+{
+  const uchar *p = static_cast<const uchar *>(data);
+  for (; size >= 8; size -= 8, p += 8)
+  {
+    quint64 word;
+    memcpy(&word, p, 8);
+    h = (h ^ mixWord(word)) * fnvPrime;
+  }
+  for (; size > 0; size--, p++)
+    h = (h ^ *p) * fnvPrime;
+  return mixWord(h);
+}
+
+quint64 ResultCache::key(IFilter *filter, const QImage &image, const SpanMask &mask)
+{
+  QString name = filter->filterName();
+  QByteArray params = filter->parameters();
+  const QVector<Span> &spans = mask.spans();
+  int header[4] = { image.width(), image.height(), image.format(), filter->linearLight() };
+
+  quint64 h = hashBytes(header, sizeof(header));
+  h = hashBytes(name.constData(), name.size()*sizeof(QChar), h);
+  h = hashBytes(params.constData(), params.size(), h);
+  h = hashBytes(spans.constData(), spans.size()*sizeof(Span), h);
+
+  QRect input = filter->inputRect(image, mask.boundingRect()) & image.rect();
+  int bpp = image.depth()/8;
+  for (int y=input.top(); y<=input.bottom(); y++)
+    h = hashBytes(image.constScanLine(y) + input.left()*bpp, input.width()*bpp, h);
+  return h;
+}
+
+ResultCache::ResultCache()
+  : m_memoryUsed(0), m_diskUsed(0)
+{
+  m_dir = QDir(QDesktopServices::storageLocation(QDesktopServices::CacheLocation))
+            .filePath("results");
+  QDir().mkpath(m_dir);
+}
+
+ResultCache::~ResultCache()
+{
+  clear();
+}
+
+bool ResultCache::find(quint64 key, QImage &tile)
+{
+  if (m_memory.contains(key))
+  {
+    m_memoryLru.removeOne(key);
+    m_memoryLru.append(key);
+    tile = m_memory.value(key);
+    return true;
+  }
+
+  if (m_disk.contains(key))
+  {
+    tile = readRawImage(tilePath(key));
+    QFile::remove(tilePath(key));
+    m_diskUsed -= m_disk.take(key);
+    m_diskLru.removeOne(key);
+    if (tile.isNull())
+      return false;
+
+    // Promote back to memory
+    insert(key, tile);
+    return true;
+  }
+  return false;
+}
+
+void ResultCache::insert(quint64 key, const QImage &tile)
+{
+  if (m_memory.contains(key) || tile.byteCount() > memoryBudget)
+    return;
+
+  m_memory.insert(key, tile);
+  m_memoryLru.append(key);
+  m_memoryUsed += tile.byteCount();
+  trimMemory();
+}
+
+void ResultCache::clear()
+{
+  m_memory.clear();
+  m_memoryLru.clear();
+  m_memoryUsed = 0;
+
+  foreach (quint64 key, m_diskLru)
+    QFile::remove(tilePath(key));
+  m_disk.clear();
+  m_diskLru.clear();
+  m_diskUsed = 0;
+}
+
+void ResultCache::trimMemory()
+{
+  while (m_memoryUsed > memoryBudget && !m_memoryLru.isEmpty())
+  {
+    quint64 key = m_memoryLru.takeFirst();
+    QImage tile = m_memory.take(key);
+    m_memoryUsed -= tile.byteCount();
+
+    if (!m_disk.contains(key) && writeRawImage(tilePath(key), tile))
+    {
+      m_disk.insert(key, tile.byteCount());
+      m_diskLru.append(key);
+      m_diskUsed += tile.byteCount();
+    }
+  }
+  trimDisk();
+}
+
+void ResultCache::trimDisk()
+{
+  while (m_diskUsed > diskBudget && !m_diskLru.isEmpty())
+  {
+    quint64 key = m_diskLru.takeFirst();
+    QFile::remove(tilePath(key));
+    m_diskUsed -= m_disk.take(key);
+  }
+}
+
+QString ResultCache::tilePath(quint64 key) const
+{
+  return QDir(m_dir).filePath(QString("%1.tile").arg(key, 16, 16, QChar('0')));
+}
+
+// Raw image: width, height, format, the color table of indexed formats
+// as a count and the entries, then the scanlines
+bool writeRawImage(const QString &path, const QImage &image)
+{
+  QFile file(path);
+  if (!file.open(QIODevice::WriteOnly))
+    return false;
+
+  qint32 header[3] = { image.width(), image.height(), image.format() };
+  bool ok = file.write(reinterpret_cast<const char *>(header), sizeof(header))
+              == sizeof(header);
+  if (ok && image.depth() <= 8)
+  {
+    QVector<QRgb> colors = image.colorTable();
+    qint32 count = colors.size();
+    qint64 bytes = count*sizeof(QRgb);
+    ok = file.write(reinterpret_cast<const char *>(&count), sizeof(count)) == sizeof(count)
+           && file.write(reinterpret_cast<const char *>(colors.constData()), bytes) == bytes;
+  }
+  int rowBytes = image.width()*image.depth()/8;
+  for (int y=0; ok && y<image.height(); y++)
+    ok = file.write(reinterpret_cast<const char *>(image.constScanLine(y)), rowBytes)
+           == rowBytes;
+  file.close();
+  if (!ok)
+    file.remove();
+  return ok;
+}
+
+QImage readRawImage(const QString &path)
+{
+  QFile file(path);
+  if (!file.open(QIODevice::ReadOnly))
+    return QImage();
+
+  qint32 header[3];
+  if (file.read(reinterpret_cast<char *>(header), sizeof(header)) != sizeof(header))
+    return QImage();
+
+  QImage image(header[0], header[1], QImage::Format(header[2]));
+  if (image.depth() <= 8)
+  {
+    qint32 count;
+    if (file.read(reinterpret_cast<char *>(&count), sizeof(count)) != sizeof(count)
+        || count < 0 || count > 256)
+      return QImage();
+    QVector<QRgb> colors(count);
+    qint64 bytes = count*sizeof(QRgb);
+    if (file.read(reinterpret_cast<char *>(colors.data()), bytes) != bytes)
+      return QImage();
+    image.setColorTable(colors);
+  }
+  int rowBytes = image.width()*image.depth()/8;
+  for (int y=0; y<image.height(); y++)
+    if (file.read(reinterpret_cast<char *>(image.scanLine(y)), rowBytes) != rowBytes)
+      return QImage();
+  return image;
+}
@@ -0,0 +1,54 @@
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#include <QImage>
+#include <QHash>
+#include <QList>
+#include <QString>
+
+class IFilter;
+class SpanMask;
+
+/** Cache of filter output tiles, keyed by a 64-bit content hash.
+ * Tiles live in memory up to a budget; least recently used tiles then
+ * spill to a disk directory, which is trimmed to its own budget the
+ * same way. The disk tier only lives as long as the cache object.
+ */
+class ResultCache
+{
+public:
+  ResultCache();
+  ~ResultCache();
+
+  // Key of applying filter to mask of image: covers the filter identity,
+  // its parameters, the mask shape, the pixels the result depends on and
+  // the blending mode
+  static quint64 key(IFilter *filter, const QImage &image, const SpanMask &mask);
+
+  bool find(quint64 key, QImage &tile);
+  void insert(quint64 key, const QImage &tile);
+  void clear();
+
+private:
+  void trimMemory();
+  void trimDisk();
+  QString tilePath(quint64 key) const;
+
+  QHash<quint64, QImage> m_memory;
+  QList<quint64> m_memoryLru;     // least recently used first
+  qint64 m_memoryUsed;
+
+  QHash<quint64, qint64> m_disk;  // key -> file size
+  QList<quint64> m_diskLru;
+  qint64 m_diskUsed;
+  QString m_dir;
+};
+
+// 64-bit FNV-1a, consuming whole words where possible, each mixed first
+quint64 hashBytes(const void *data, qint64 size, quint64 h = Q_UINT64_C(14695981039346656037));
+
+// Uncompressed image files for spilled tiles; a null image if reading fails
+bool writeRawImage(const QString &path, const QImage &image);
+QImage readRawImage(const QString &path);
+
+#endif // RESULTCACHE_H
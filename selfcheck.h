@@ -0,0 +1,12 @@
+#ifndef SELFCHECK_H
+#define SELFCHECK_H
+
+class QTextStream;
+
+// Run the optimized filter kernels against the reference ones on
+// randomized images, selections and parameters, under each of a set of
+// kernel tunings, and report the max and mean per-channel error of
+// each. Returns the number of checks that exceeded their tolerance.
+int runSelfCheck(QTextStream &out, int rounds = 20);
+
+#endif // SELFCHECK_H